@@ -35,3 +35,8 @@ namespace NLP {
 
 #include "pool.h"
 #include "shared.h"
+#include "thread.h"
+#include "simd.h"
+#include "socket.h"
+#include "binary.h"
+#include "sketch.h"
@@ -0,0 +1,57 @@
+#ifndef _BINARY_H
+#define _BINARY_H
+
+/**
+ * binary.h
+ * Helpers for reading and writing plain values, strings and vectors of
+ * plain values to binary streams in the native byte order. These are used
+ * for files that are only ever read back by the same build on the same
+ * machine, such as training checkpoints. Reads throw an IOException if the
+ * stream ends early.
+ */
+namespace Util {
+  namespace binary {
+
+    template <typename T>
+    inline void write(std::ostream &out, const T &value) {
+      out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    inline void read(std::istream &in, T &value) {
+      if (!in.read(reinterpret_cast<char *>(&value), sizeof(T)))
+        throw IOException("unexpected end of binary file");
+    }
+
+    inline void write(std::ostream &out, const std::string &str) {
+      write(out, (uint64_t)str.size());
+      out.write(str.data(), str.size());
+    }
+
+    inline void read(std::istream &in, std::string &str) {
+      uint64_t size;
+      read(in, size);
+      str.resize(size);
+      if (size && !in.read(&str[0], size))
+        throw IOException("unexpected end of binary file");
+    }
+
+    template <typename T>
+    inline void write(std::ostream &out, const std::vector<T> &vec) {
+      write(out, (uint64_t)vec.size());
+      if (!vec.empty())
+        out.write(reinterpret_cast<const char *>(&vec[0]), vec.size() * sizeof(T));
+    }
+
+    template <typename T>
+    inline void read(std::istream &in, std::vector<T> &vec) {
+      uint64_t size;
+      read(in, size);
+      vec.resize(size);
+      if (size && !in.read(reinterpret_cast<char *>(&vec[0]), size * sizeof(T)))
+        throw IOException("unexpected end of binary file");
+    }
+  }
+}
+
+#endif
@@ -7,9 +7,9 @@
 #include "prob.h"
 #include "tagset.h"
 #include "taglimits.h"
+#include "tagdict.h"
 #include "vector.h"
 #include "factor.h"
-#include "crf/nodepool.h"
 #include "crf/lattice.h"
 #include "crf/state.h"
 #include "crf/features.h"
@@ -26,13 +26,24 @@ namespace NLP {
         void load(const std::string &filename, std::istream &input);
         void save_attributes(const std::string &filename, const std::string &preface);
         void save_attributes(std::ostream &out, const std::string &preface);
-        void save_features(const std::string &filename, const std::string &preface);
-        void save_features(std::ostream &out, const std::string &preface);
+        void save(const std::string &attribs_file, const std::string &features_file,
+            const std::string &preface, uint64_t &nattributes, uint64_t &nfeatures);
+        void save_binary(std::ostream &out) const;
+        void load_binary(std::istream &in);
 
         void operator()(const char *type, const std::string &str, TagPair &tp, const bool add_state_feature=true, const bool add_trans_feature=true);
         void operator()(const char *type, const std::string &str, Context &c);
+        void merge(const Attributes &other);
+        void hash_keys(const uint64_t bits);
+        bool hashed(void) const;
+        void load_hashed(const std::string &filename);
+        void count_keys(Util::CountMinSketch *sketch);
+        void filter_keys(const Util::CountMinSketch *sketch, const Type &type, const uint64_t freq, const uint64_t def);
+        void copy_key_filter(const Attributes &other);
+        lbfgsfloatval_t *find_lambda(const std::string &type, const std::string &str, const TagPair &klasses);
         void sort_by_freq(void);
         void reset_expectations(void);
+        void add_expectations(const lbfgsfloatval_t *exp);
 
         uint64_t nfeatures(void) const;
 
@@ -45,6 +56,7 @@ namespace NLP {
         void assign_lambdas(lbfgsfloatval_t *x);
         void zero_lambdas(void);
         void copy_gradients(lbfgsfloatval_t *x, lbfgsfloatval_t inv_sigma_sq);
+        void copy_klasses(TagPair *x) const;
         bool inc_next_lambda(lbfgsfloatval_t val);
         void print_current_gradient(lbfgsfloatval_t val, lbfgsfloatval_t inv_sigma_sq);
         void print(lbfgsfloatval_t inv_sigma_sq);
@@ -79,6 +79,213 @@ namespace NLP {
         const_reverse_iterator rend(void) const { return contexts.rend(); }
     };
 
-    typedef std::vector<Contexts> Instances;
+    class Instances;
+
+    /**
+     * Instance object.
+     * Lightweight view of a single training instance stored in an Instances
+     * object. The i'th word in the sentence corresponds to position i. The
+     * features active at each position are stored as dense feature ids,
+     * i.e. indices into the lambda and expectation arrays used in training.
+     */
+    class Instance {
+      private:
+        const uint32_t *_features;
+        const uint64_t *_feature_offsets;
+        const TagPair *_klasses;
+        const uint64_t *_klass_offsets;
+        const uint16_t *_candidates;
+        const uint64_t *_candidate_offsets;
+        size_t _size;
+
+      public:
+        Instance(void) : _features(0), _feature_offsets(0), _klasses(0),
+          _klass_offsets(0), _candidates(0), _candidate_offsets(0), _size(0) { }
+        Instance(const Instances &instances, const size_t index);
+
+        size_t size(void) const { return _size; }
+
+        const uint32_t *begin(const size_t i) const { return _features + _feature_offsets[i]; }
+        const uint32_t *end(const size_t i) const { return _features + _feature_offsets[i + 1]; }
+
+        /**
+         * klass.
+         * Returns the first gold tagpair at position i.
+         */
+        const TagPair &klass(const size_t i) const { return _klasses[_klass_offsets[i]]; }
+
+        /**
+         * klass_begin, klass_end.
+         * The range of gold tagpairs at position i, one for each chain.
+         */
+        const TagPair *klass_begin(const size_t i) const { return _klasses + _klass_offsets[i]; }
+        const TagPair *klass_end(const size_t i) const { return _klasses + _klass_offsets[i + 1]; }
+
+        /**
+         * candidate_begin, candidate_end.
+         * The range of tags (in ascending order) that the lattice is
+         * restricted to at position i by the tag dictionary. The range is
+         * empty if position i is not restricted.
+         */
+        const uint16_t *candidate_begin(const size_t i) const {
+          return _candidate_offsets ? _candidates + _candidate_offsets[i] : 0;
+        }
+        const uint16_t *candidate_end(const size_t i) const {
+          return _candidate_offsets ? _candidates + _candidate_offsets[i + 1] : 0;
+        }
+
+        bool klasses_match(const size_t i, const TagPair &other) const {
+          for (uint64_t k = _klass_offsets[i]; k != _klass_offsets[i + 1]; ++k)
+            if (_klasses[k] == other)
+              return true;
+          return false;
+        }
+
+        bool klasses_match_or_none(const size_t i, const TagPair &other) const {
+          for (uint64_t k = _klass_offsets[i]; k != _klass_offsets[i + 1]; ++k)
+            if (_klasses[k] == other || (other.prev == None::val && other.curr == _klasses[k].curr))
+              return true;
+          return false;
+        }
+    };
+
+    /**
+     * Instances object.
+     * Compressed sparse row storage for the training instances. The feature
+     * ids active at every position of every instance are stored in a single
+     * flat array, with a per-position offset into that array, and the gold
+     * tagpairs are stored in the same way. A per-instance offset into the
+     * position arrays marks where each instance begins.
+     *
+     * This replaces a vector of Contexts per instance, which needs several
+     * small allocations and a pointer for every active feature per word.
+     * Contexts are now only used as scratch space while extracting the
+     * features for one sentence, which is then appended here.
+     *
+     * When training lattices are pruned with the tag dictionary, the
+     * candidate tags of every position are stored in the same way, in
+     * step with the feature offsets. Otherwise no candidates are stored.
+     */
+    class Instances {
+      private:
+        std::vector<uint32_t> _features;
+        std::vector<uint64_t> _feature_offsets;
+        TagPairs _klasses;
+        std::vector<uint64_t> _klass_offsets;
+        std::vector<uint16_t> _candidates;
+        std::vector<uint64_t> _candidate_offsets;
+        std::vector<uint64_t> _instances;
+
+        friend class Instance;
+
+      public:
+        Instances(void) : _features(), _feature_offsets(1, 0), _klasses(),
+          _klass_offsets(1, 0), _candidates(), _candidate_offsets(),
+          _instances(1, 0) { }
+
+        void reserve(const size_t ninstances) { _instances.reserve(ninstances + 1); }
+
+        /**
+         * add.
+         * Appends an instance built by the feature generators. Each feature
+         * is stored as the offset of its lambda pointer from lambdas, so the
+         * lambdas must be assigned before the instances are built.
+         */
+        void add(const Contexts &contexts, const lbfgsfloatval_t *lambdas) {
+          for (Contexts::const_iterator i = contexts.begin(); i != contexts.end(); ++i) {
+            for (FeaturePtrs::const_iterator j = i->features.begin(); j != i->features.end(); ++j)
+              _features.push_back((*j)->lambda - lambdas);
+            _feature_offsets.push_back(_features.size());
+            _klasses.insert(_klasses.end(), i->klasses.begin(), i->klasses.end());
+            _klass_offsets.push_back(_klasses.size());
+          }
+          _instances.push_back(_feature_offsets.size() - 1);
+        }
+
+        /**
+         * add_candidates.
+         * Stores the candidate tags of the next position of the instances
+         * added so far. Must be called for every position of every
+         * instance, or for none of them.
+         */
+        void add_candidates(const uint16_t *begin, const uint16_t *end) {
+          if (_candidate_offsets.empty())
+            _candidate_offsets.push_back(0);
+          _candidates.insert(_candidates.end(), begin, end);
+          _candidate_offsets.push_back(_candidates.size());
+        }
+
+        /**
+         * append.
+         * Appends all of the instances stored in another Instances object,
+         * offsetting its position and entry offsets to follow the instances
+         * already stored here.
+         */
+        void append(const Instances &other) {
+          const uint64_t nfeatures = _features.size();
+          const uint64_t nklasses = _klasses.size();
+          const uint64_t ncandidates = _candidates.size();
+          const uint64_t npositions = _feature_offsets.size() - 1;
+
+          _features.insert(_features.end(), other._features.begin(), other._features.end());
+          _klasses.insert(_klasses.end(), other._klasses.begin(), other._klasses.end());
+          for (size_t i = 1; i < other._feature_offsets.size(); ++i) {
+            _feature_offsets.push_back(nfeatures + other._feature_offsets[i]);
+            _klass_offsets.push_back(nklasses + other._klass_offsets[i]);
+          }
+          for (size_t i = 1; i < other._instances.size(); ++i)
+            _instances.push_back(npositions + other._instances[i]);
+
+          if (!other._candidate_offsets.empty()) {
+            if (_candidate_offsets.empty())
+              _candidate_offsets.push_back(0);
+            _candidates.insert(_candidates.end(), other._candidates.begin(), other._candidates.end());
+            for (size_t i = 1; i < other._candidate_offsets.size(); ++i)
+              _candidate_offsets.push_back(ncandidates + other._candidate_offsets[i]);
+          }
+        }
+
+        size_t size(void) const { return _instances.size() - 1; }
+        uint64_t ntokens(void) const { return _feature_offsets.size() - 1; }
+        uint64_t nentries(void) const { return _features.size(); }
+        uint64_t ncandidates(void) const { return _candidates.size(); }
+        bool pruned(void) const { return !_candidate_offsets.empty(); }
+
+        Instance operator[](const size_t index) const { return Instance(*this, index); }
+
+        /**
+         * save.
+         * Writes the instances to a binary stream, so that a training
+         * checkpoint can be resumed without repeating feature extraction.
+         */
+        void save(std::ostream &out) const {
+          Util::binary::write(out, _features);
+          Util::binary::write(out, _feature_offsets);
+          Util::binary::write(out, _klasses);
+          Util::binary::write(out, _klass_offsets);
+          Util::binary::write(out, _candidates);
+          Util::binary::write(out, _candidate_offsets);
+          Util::binary::write(out, _instances);
+        }
+
+        void load(std::istream &in) {
+          Util::binary::read(in, _features);
+          Util::binary::read(in, _feature_offsets);
+          Util::binary::read(in, _klasses);
+          Util::binary::read(in, _klass_offsets);
+          Util::binary::read(in, _candidates);
+          Util::binary::read(in, _candidate_offsets);
+          Util::binary::read(in, _instances);
+        }
+    };
+
+    inline Instance::Instance(const Instances &instances, const size_t index)
+      : _features(instances._features.empty() ? 0 : &instances._features[0]),
+        _feature_offsets(&instances._feature_offsets[instances._instances[index]]),
+        _klasses(instances._klasses.empty() ? 0 : &instances._klasses[0]),
+        _klass_offsets(&instances._klass_offsets[instances._instances[index]]),
+        _candidates(instances._candidates.empty() ? 0 : &instances._candidates[0]),
+        _candidate_offsets(instances._candidate_offsets.empty() ? 0 : &instances._candidate_offsets[instances._instances[index]]),
+        _size(instances._instances[index + 1] - instances._instances[index]) { }
   }
 }
@@ -18,7 +18,7 @@ namespace NLP {
         lbfgsfloatval_t *lambda;
         lbfgsfloatval_t exp;
 
-        Feature(TagPair &klasses, const uint64_t freq=1)
+        Feature(const TagPair &klasses, const uint64_t freq=1)
           : klasses(klasses), freq(freq), lambda(0), exp(0.0) { }
 
         lbfgsfloatval_t gradient(lbfgsfloatval_t inv_sigma_sq) {
@@ -73,7 +73,7 @@ namespace NLP {
 
         TransDict &dict;
         const static std::string name;
-        bool trans_loaded;
+        volatile bool trans_loaded;
     };
 
     class OffsetGen : public FeatureGen {
@@ -137,7 +137,6 @@ namespace NLP {
         virtual void operator()(const Type &type, Sentence &sent, PDFs &dist, int i);
 
         AffixDict &dict;
-        Shape shape;
     };
 
     class OffsetShapeGen : public OffsetGen {
@@ -151,7 +150,6 @@ namespace NLP {
         virtual void operator()(const Type &type, Sentence &sent, PDFs &dist, int i);
 
         AffixDict &dict;
-        Shape shape;
     };
 
     class PosGen : public FeatureGen {
@@ -22,6 +22,7 @@ namespace NLP {
             const bool extract);
 
         void add_features(Lexicon lexicon, Sentence &sent, PDFs &dist, int i);
+        void add_features(Attributes &attributes, Lexicon lexicon, Sentence &sent, PDFs &dist, int i);
 
       private:
         class Impl;
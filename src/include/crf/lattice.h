@@ -1,107 +1,156 @@
 namespace NLP {
   namespace CRF {
-    class Node {
-      public:
-        mutable const Node *prev;
-        Tag tag;
-        lbfgsfloatval_t score;
-
-        void *operator new(size_t size, NodePool<Node> *pool) { return pool->alloc(size); }
-
-        void operator delete(void *, NodePool<Node> *) { }
-
-        Node(const Node *prev, Tag tag, lbfgsfloatval_t score)
-          : prev(prev), tag(tag), score(score) { }
-    };
-
+    /**
+     * Lattice.
+     * Viterbi decoder over the tags of a sentence, fed one word at a time.
+     *
+     * Only two rows of scores are kept: the best score of a path ending in
+     * each tag at the previous word and at the current word. The best
+     * previous tag of each tag at each word is stored in a flat
+     * (nwords * nklasses) matrix of 16 bit backpointers, which is reused
+     * between sentences, so decoding makes no allocations once the matrix
+     * has grown to the longest sentence. The best path is recovered by
+     * following the backpointers from the best tag at the last word.
+     *
+     * The maximization over the previous tags runs along the rows of dist
+     * with the max_plus kernel, updating the scores of every current tag
+     * for one previous tag at a time. Ties go to the lowest previous tag
+     * and the lowest final tag.
+     *
+     * A word may be restricted to a set of candidate tags from the tag
+     * dictionary. Only the candidates of a restricted word are scored, and
+     * only the candidates of a restricted previous word are considered as
+     * its tag, so a pair of restricted words costs the product of their
+     * candidate counts rather than nklasses squared. Tags outside the
+     * candidates keep a score of -max, so they are never on the best path.
+     */
     class Lattice {
       private:
-        typedef std::vector<Node *> Nodes;
+        typedef std::vector<uint16_t> Backpointers;
 
-        NodePool<Node> *pool;
-        Nodes nodes;
-        const Node *max;
+        const Util::simd::Kernels &kernels;
         const uint64_t nklasses;
+        PDF prev;
+        PDF curr;
+        Backpointers backpointers;
+        TagDict::Candidates last;
+        size_t nwords;
+
+        uint16_t argmax(void) const {
+          uint16_t best = 2;
+          for (uint16_t tag = 3; tag < nklasses; ++tag)
+            if (curr[best] < curr[tag])
+              best = tag;
+          return best;
+        }
 
       public:
-        Lattice(uint64_t nklasses)
-          : pool(new NodePool<Node>()), nodes(), max(NULL), nklasses(nklasses) {
-          nodes.reserve(nklasses * 100);
+        Lattice(uint64_t nklasses, const Util::simd::Kernels &kernels)
+          : kernels(kernels), nklasses(nklasses), prev(nklasses, 0.0),
+            curr(nklasses, 0.0), backpointers(), last(), nwords(0) {
+          backpointers.reserve(nklasses * 100);
         }
 
-        ~Lattice(void) { delete pool; }
+        void viterbi(TagSet &tags, const PDFs &dist,
+            const TagDict::Candidates &candidates=TagDict::Candidates()) {
+          const lbfgsfloatval_t *state = dist[None::val];
+          if (backpointers.size() < (nwords + 1) * nklasses)
+            backpointers.resize((nwords + 1) * nklasses);
 
-        void viterbi(TagSet &tags, PDFs &dist) {
-          if (nodes.size() == 0) {
-            for (size_t curr = 2; curr < nklasses; ++curr) {
-              //std::cout << "score " << dist[Sentinel::val][curr] << " for " << curr << std::endl;
-              lbfgsfloatval_t score = dist[None::val][curr] + dist[Sentinel::val][curr];
-              Node *n = new (pool) Node(NULL, curr, score);
-              nodes.push_back(n);
-              if (!max || max->score < n->score)
-                max = n;
+          if (nwords == 0) {
+            const lbfgsfloatval_t *start = dist[Sentinel::val];
+            if (candidates.empty()) {
+              for (size_t tag = 2; tag < nklasses; ++tag)
+                curr[tag] = state[tag] + start[tag];
+            }
+            else {
+              std::fill(curr.begin() + 2, curr.end(), -std::numeric_limits<lbfgsfloatval_t>::max());
+              for (const uint16_t *c = candidates.begin; c != candidates.end; ++c)
+                curr[*c] = state[*c] + start[*c];
             }
           }
           else {
-            size_t size = nodes.size();
-            const Node *new_max = NULL;
-            for (size_t curr = 2; curr < nklasses; ++curr) {
-              lbfgsfloatval_t best_score = -std::numeric_limits<lbfgsfloatval_t>::max();
-              Node *best_prev = NULL;
-              for (size_t prev = 2; prev < nklasses; ++prev) {
-                size_t prev_index = size - (nklasses - prev);
-                lbfgsfloatval_t score = dist[prev][curr] + nodes[prev_index]->score;
-                //std::cout << "considering score of " << score << " = " << dist[prev][curr] << " + " << nodes[prev_index]->score << " for " << prev << " -> " << curr << std::endl;
-                if (score > best_score) {
-                  best_score = score;
-                  best_prev = nodes[prev_index];
-                  //std::cout << "updating best_prev to " << best_prev->tag << std::endl;
+            uint16_t *bp = &backpointers[nwords * nklasses];
+            prev.swap(curr);
+            std::fill(curr.begin() + 2, curr.end(), -std::numeric_limits<lbfgsfloatval_t>::max());
+            if (candidates.empty()) {
+              if (last.empty())
+                for (uint16_t p = 2; p < nklasses; ++p)
+                  kernels.max_plus(&curr[2], bp + 2, prev[p], dist[p] + 2, p, nklasses - 2);
+              else
+                for (const uint16_t *p = last.begin; p != last.end; ++p)
+                  kernels.max_plus(&curr[2], bp + 2, prev[*p], dist[*p] + 2, *p, nklasses - 2);
+              for (size_t tag = 2; tag < nklasses; ++tag)
+                curr[tag] += state[tag];
+            }
+            else {
+              for (const uint16_t *c = candidates.begin; c != candidates.end; ++c) {
+                lbfgsfloatval_t best = -std::numeric_limits<lbfgsfloatval_t>::max();
+                uint16_t arg = last.empty() ? 2 : *last.begin;
+                if (last.empty()) {
+                  for (uint16_t p = 2; p < nklasses; ++p)
+                    if (best < prev[p] + dist[p][*c]) {
+                      best = prev[p] + dist[p][*c];
+                      arg = p;
+                    }
                 }
+                else {
+                  for (const uint16_t *p = last.begin; p != last.end; ++p)
+                    if (best < prev[*p] + dist[*p][*c]) {
+                      best = prev[*p] + dist[*p][*c];
+                      arg = *p;
+                    }
+                }
+                curr[*c] = best + state[*c];
+                bp[*c] = arg;
               }
-              Node *n = new (pool) Node(best_prev, curr, best_score + dist[None::val][curr]);
-              nodes.push_back(n);
-              //std::cout << "creating node from " << best_prev->tag << " to " << curr << " with score " << best_score << " + " << dist[None::val][curr] << " = " << n->score << std::endl;
-              if (!new_max || new_max->score < n->score)
-                new_max = n;
             }
-            max = new_max;
           }
+          last = candidates;
+          ++nwords;
         }
 
         void best(TagSet &tags, Raws &raws, int size) {
-          int index = size - 1;
-          const Node *m = max;
           raws.resize(size);
-          while (index >= 0) {
-            raws[index--] = tags.str(m->tag);
-            m = m->prev;
+          if (size == 0)
+            return;
+          uint16_t tag = argmax();
+          for (int i = size - 1; i >= 0; --i) {
+            raws[i] = tags.str(tag);
+            if (i > 0)
+              tag = backpointers[i * nklasses + tag];
           }
         }
 
         void reset(void) {
-          pool->clear();
-          nodes.clear();
-          max = NULL;
+          last = TagDict::Candidates();
+          nwords = 0;
         }
 
+        /**
+         * print.
+         * Prints the backpointer of each tag at each word and the final
+         * score of each tag, with the best path in red.
+         */
         void print(std::ostream &out, TagSet &tags, size_t nwords) {
-          for (size_t i = 0; i < nklasses - 2; ++i) {
-            size_t index = nodes.size() - (nklasses - 2) + i;
-            out << std::setw(16) << tags.str(i+2);
-            _print(out, nodes[index], max, nwords);
-            out << '\n';
-          }
-        }
+          std::vector<uint16_t> path(nwords);
+          if (nwords)
+            path[nwords - 1] = argmax();
+          for (size_t i = nwords - 1; i > 0 && i < nwords; --i)
+            path[i-1] = backpointers[i * nklasses + path[i]];
 
-        void _print(std::ostream &out, const Node *n, const Node *max, size_t nwords) {
-          if (max->prev)
-            _print(out, (n-nklasses+2), max->prev, nwords);
-          if (max->tag == n->tag)
-            out << ' ' << Util::port::RED << std::setprecision(4) << std::setw(10) << n->score << Util::port::OFF;
-          else
-            out << ' ' << std::setprecision(4) << std::setw(10) << n->score;
+          for (uint16_t tag = 2; tag < nklasses; ++tag) {
+            out << std::setw(16) << tags.str(tag);
+            for (size_t i = 1; i < nwords; ++i) {
+              const char *str = tags.str(backpointers[i * nklasses + tag]);
+              if (path[i] == tag)
+                out << ' ' << Util::port::RED << std::setw(10) << str << Util::port::OFF;
+              else
+                out << ' ' << std::setw(10) << str;
+            }
+            out << ' ' << std::setprecision(4) << std::setw(10) << curr[tag] << '\n';
+          }
         }
-
     };
   }
 }
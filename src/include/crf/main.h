@@ -14,8 +14,15 @@ namespace NLP {
 
       config::OpAlias model(cfg, "model", "location to store the model", false, tagger_cfg.model);
       config::OpAlias sigma(cfg, "sigma", "sigma value for regularization", false, tagger_cfg.sigma);
+      config::OpAlias threads(cfg, "threads", "number of threads to use for training", false, tagger_cfg.threads);
+      config::OpAlias listen(cfg, "listen", "address to coordinate distributed L-BFGS training on", false, tagger_cfg.listen);
+      config::OpAlias connect(cfg, "connect", "address of the coordinator to join as a distributed L-BFGS worker", false, tagger_cfg.connect);
+      config::OpAlias nworkers(cfg, "nworkers", "number of worker processes for distributed L-BFGS training", false, tagger_cfg.nworkers);
+      config::OpAlias checkpoint_every(cfg, "checkpoint_every", "save a checkpoint every N L-BFGS iterations or SGD epochs", false, tagger_cfg.checkpoint_every);
+      config::OpAlias resume(cfg, "resume", "resume training from the last checkpoint", false, tagger_cfg.resume);
+      config::OpAlias init_model(cfg, "init_model", "existing model directory to initialize the weights from", false, tagger_cfg.init_model);
       config::Op<std::string> ifmt(cfg, "ifmt", "input file format", IFMT, false, true);
-      config::OpRestricted<std::string> trainer(cfg, "trainer", "training algorithm to use", TRAINER, "lbfgs|sgd", false, '|');
+      config::OpRestricted<std::string> trainer(cfg, "trainer", "training algorithm to use", TRAINER, "lbfgs|sgd|adagrad|adam|perceptron|pl|tron|svrg", false, '|');
 
       tagger_cfg.add(&types);
       cfg.add(&tagger_cfg);
@@ -39,6 +46,7 @@ namespace NLP {
       Types types;
 
       config::OpAlias model(cfg, "model", "location of the model", false, tagger_cfg.model);
+      config::OpAlias threads(cfg, "threads", "number of threads to use for tagging", false, tagger_cfg.threads);
       config::Op<std::string> ifmt(cfg, "ifmt", "input file format", IFMT, false, true);
       config::Op<std::string> ofmt(cfg, "ofmt", "output file format", OFMT, false, true);
 
@@ -66,9 +74,10 @@ namespace NLP {
 
       config::OpAlias model(cfg, "model", "location to store the model", false, tagger_cfg.model);
       config::OpAlias sigma(cfg, "sigma", "sigma value for regularization", false, tagger_cfg.sigma);
+      config::OpAlias threads(cfg, "threads", "number of threads to use for training", false, tagger_cfg.threads);
       config::Op<std::string> chains(cfg, "chains", "input chains", CHAINS, false, true);
       config::Op<std::string> ifmt(cfg, "ifmt", "input file format", IFMT, false, true);
-      config::OpRestricted<std::string> trainer(cfg, "trainer", "training algorithm to use", TRAINER, "lbfgs|sgd|loopy_bp", false, '|');
+      config::OpRestricted<std::string> trainer(cfg, "trainer", "training algorithm to use", TRAINER, "lbfgs|sgd|loopy_bp|pl|piecewise", false, '|');
 
       tagger_cfg.add(&types);
       cfg.add(&tagger_cfg);
@@ -92,6 +101,7 @@ namespace NLP {
       Types types;
 
       config::OpAlias model(cfg, "model", "location of the model", false, tagger_cfg.model);
+      config::OpAlias threads(cfg, "threads", "number of threads to use for tagging", false, tagger_cfg.threads);
       config::Op<std::string> ifmt(cfg, "ifmt", "input file format", IFMT, false, true);
       config::Op<std::string> ofmt(cfg, "ofmt", "output file format", OFMT, false, true);
       config::Op<std::string> chains(cfg, "chains", "output chains", CHAINS, false, true);
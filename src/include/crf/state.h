@@ -5,11 +5,8 @@ namespace NLP {
         Lattice lattice;
         PDFs dist;
 
-        State(const size_t ntags)
-          : lattice(ntags), dist() {
-          for (size_t i = 0; i < ntags; ++i)
-            dist.push_back(PDF(ntags, 0.0));
-        }
+        State(const size_t ntags, const Util::simd::Kernels &kernels)
+          : lattice(ntags, kernels), dist(ntags, ntags) { }
 
         void reset(void) {
           lattice.reset();
@@ -17,8 +14,7 @@ namespace NLP {
         }
 
         void next_word(void) {
-          for (size_t i = 0; i < dist.size(); ++i)
-            std::fill(dist[i].begin(), dist[i].end(), 0.0);
+          dist.fill(0.0);
         }
     };
   }
@@ -152,13 +152,31 @@ namespace NLP {
             config::OpPath features;
             config::OpPath weights;
             config::OpPath log;
+            config::OpPath checkpoint;
             config::Op<lbfgsfloatval_t> sigma;
+            config::Op<lbfgsfloatval_t> l1;
             config::Op<lbfgsfloatval_t> eta;
             config::Op<lbfgsfloatval_t> delta;
 
             config::Op<uint64_t> batch;
+            config::OpFlag average;
             config::Op<uint64_t> period;
             config::Op<uint64_t> niterations;
+            config::Op<uint64_t> threads;
+            config::OpRestricted<std::string> simd;
+            config::OpFlag check_kernels;
+
+            config::Op<std::string> listen;
+            config::Op<std::string> connect;
+            config::Op<uint64_t> nworkers;
+
+            config::Op<uint64_t> checkpoint_every;
+            config::Op<double> checkpoint_minutes;
+            config::OpFlag resume;
+            config::Op<std::string> init_model;
+            config::Op<std::string> spool;
+            config::Op<uint64_t> sketch;
+            config::Op<uint64_t> hash_bits;
 
             config::Op<uint64_t> bp_iterations;
             config::Op<double> bp_convergence_threshold;
@@ -167,6 +185,7 @@ namespace NLP {
             config::Op<uint64_t> cutoff_words;
             config::Op<uint64_t> cutoff_attribs;
             config::Op<uint64_t> rare_cutoff;
+            config::Op<uint64_t> tagdict_cutoff;
 
             Config(const std::string &name, const std::string &desc,
                 lbfgsfloatval_t sigma, uint64_t niterations)
@@ -179,18 +198,35 @@ namespace NLP {
             features(*this, "features", "location to save the features file", "//features", true, &model),
             weights(*this, "weights", "location to save the weights file", "//weights", true, &model),
             log(*this, "log", "location to save the training log file", "//log", true, &model),
+            checkpoint(*this, "checkpoint", "location to save the training checkpoint files", "//checkpoint", true, &model),
             sigma(*this, "sigma", "sigma value for L2 regularization", sigma, true),
+            l1(*this, "l1", "coefficient for L1 regularization using OWL-QN, combined with L2 regularization from sigma (L-BFGS only)", 0.0, true, true),
             eta(*this, "eta", "eta calibration value for SGD (ignored for L-BFGS)", 0.1, true, true),
             delta(*this, "delta", "SGD optimization converges when log-likelihood improvement over the last (period) iterations is no larger than this value (ignored for L-BFGS)", 1e-6, true, true),
             batch(*this, "batch", "batch size for SGD optimization (ignored for L-BFGS)", 1, true, true),
+            average(*this, "average", "use the average of the iterates as the final weights (AdaGrad and Adam only)", true, false),
             period(*this, "period", "period size for checking SGD convergence (ignored for L-BFGS)", 10, true, true),
             niterations(*this, "niterations", "number of training iterations", niterations, true),
+            threads(*this, "threads", "number of threads to use for training and tagging", (uint64_t)1, true),
+            simd(*this, "simd", "instruction set for the training and tagging kernels", "auto", "auto|avx512|avx2|sse2|scalar", true, '|'),
+            check_kernels(*this, "check_kernels", "check that every instruction set supported by this CPU gives the same log Z as the scalar kernels before L-BFGS training, and fail if any differ", true),
+            listen(*this, "listen", "address (host:port or unix:path) to coordinate distributed L-BFGS training on", "", true, true),
+            connect(*this, "connect", "address (host:port or unix:path) of the coordinator to join as a distributed L-BFGS worker", "", true, true),
+            nworkers(*this, "nworkers", "number of worker processes to wait for when coordinating distributed L-BFGS training", (uint64_t)0, true, true),
+            checkpoint_every(*this, "checkpoint_every", "save a checkpoint every N L-BFGS iterations or SGD epochs (0 to disable)", (uint64_t)0, true, true),
+            checkpoint_minutes(*this, "checkpoint_minutes", "save a checkpoint at the end of an iteration once M minutes have passed since the last (0 to disable)", 0.0, true, true),
+            resume(*this, "resume", "resume L-BFGS or SGD training from the last checkpoint, without repeating feature extraction", true),
+            init_model(*this, "init_model", "directory of an existing model whose weights are used as the starting point for training", "", true, true),
+            spool(*this, "spool", "file to spool the parsed training data to during feature extraction, instead of keeping it in memory", "", true, true),
+            sketch(*this, "sketch", "count attributes in a count-min sketch with this many counters per row before pass 2, so that only attributes that can pass the cutoffs are stored (0 to disable)", (uint64_t)0, true, true),
+            hash_bits(*this, "hash_bits", "hash attributes into 2^k buckets instead of storing their strings, for a model of fixed size with no attributes file (0 to disable)", (uint64_t)0, true, true),
             bp_iterations(*this, "bp_iterations", "number of iterations to run belief propagation", 1000, true, true),
             bp_convergence_threshold(*this, "bp_convergence_threshold", "threshold value for checking belief propagation convergence", 0.0001, true, true),
             cutoff_default(*this, "cutoff_default", "minimum frequency cutoff for features", 1, true, true),
             cutoff_words(*this, "cutoff_words", "minimum frequency cutoff for word features", 1, true, true),
             cutoff_attribs(*this, "cutoff_attribs", "minimum frequency cutoff for attributes", 1, true, true),
-            rare_cutoff(*this, "rare_cutoff", "cutoff to apply rare word features", 5, true, true)
+            rare_cutoff(*this, "rare_cutoff", "cutoff to apply rare word features", 5, true, true),
+            tagdict_cutoff(*this, "tagdict_cutoff", "restrict words seen at least this many times in training to the tags they occurred with, in the training lattices (0 to disable). The cutoff is saved with the model and applied when tagging, where 0 uses the saved cutoff and any other value must match it", (uint64_t)0, true, true)
           { }
 
             virtual ~Config(void) { /* nothing */ }
@@ -205,11 +241,15 @@ namespace NLP {
             config::Op<uint64_t> nattributes;
             config::Op<uint64_t> nfeatures;
             config::Op<uint64_t> max_size;
+            config::Op<uint64_t> hash_bits;
+            config::Op<uint64_t> tagdict_cutoff;
             Model(const std::string &name, const std::string &desc, const config::OpPath &base)
               : config::Info(name, desc, base),
               nattributes(*this, "nattributes", "the number of attributes", 0),
               nfeatures(*this, "nfeatures", "the number of features", 0),
-              max_size(*this, "max_size", "the size of the largest sentence", 0)
+              max_size(*this, "max_size", "the size of the largest sentence", 0),
+              hash_bits(*this, "hash_bits", "the number of bits of the attribute hash (0 if not hashed)", (uint64_t)0, false),
+              tagdict_cutoff(*this, "tagdict_cutoff", "the tag dictionary cutoff the training lattices were pruned with (0 if not pruned)", (uint64_t)0, false)
           { }
 
             virtual ~Model(void) { }
@@ -228,52 +268,507 @@ namespace NLP {
      * Private implementation for the Tagger class.
      */
     class Tagger::Impl : public Util::Shared {
+      public:
+        /**
+         * Buffers.
+         * Working vectors for one pass of the forward-backward algorithm over
+         * a training instance
+         *
+         * alphas: an (nwords * ntags) matrix that stores the forward scores for
+         *         one pass of the forward-backward algorithm
+         * betas: an (nwords * ntags) matrix that stores the backward scores for
+         *        one pass of the forward-backward algorithm
+         *
+         * state_marginals: an (nwords * ntags) matrix that stores the model
+         *                  expectation of a tag t at position i
+         *
+         * trans_marginals: an (ntags * ntags) matrix that stores the model
+         *                  expectation of a transition between tag t and tag u
+         *
+         * trans: an (ntags * ntags) matrix that stores the exponentiated
+         *        transition activation score for each pair of tags. Transition
+         *        features do not depend on the context, so this is shared by
+         *        every position after the first
+         *
+         * trans_t: the transpose of trans, so that the forward pass can read
+         *          a column of trans with unit stride
+         *
+         * states: an (nwords * ntags) matrix that stores the exponentiated
+         *         state activation score for tag t at position i
+         *
+         * psis: an (nwords * ntags * ntags) matrix that stores the activation
+         *       score (psi) for a transition from tag t to tag u at position i.
+         *       State activations for features that do not rely on the
+         *       previous tag are stored with a previous tag of None. Only
+         *       allocated by init_psis for loopy belief propagation
+         *
+         * scale: an (nwords) vector that stores the scale factor for each
+         *        position i.
+         *
+         * exp: an (nfeatures) vector that accumulates the model expectation
+         *      of each feature, indexed in the same order as the lambdas
+         *
+         * log_z: the accumulated log partition function
+         *
+         * dstates, dalphas, dbetas, dtrans: the directional derivatives of
+         *         states, alphas, betas and trans along a search direction,
+         *         used for the Hessian-vector products of TRON. Only
+         *         allocated by init_hessian
+         *
+         * dpsi: dtrans plus the direction of the pair features active at
+         *       one position (restored to dtrans after each position)
+         */
+        class Buffers {
+          public:
+            PDFs alphas;
+            PDFs betas;
+            PDFs state_marginals;
+            PDFs trans_marginals;
+            PDFs trans;
+            PDFs trans_t;
+            PDFs states;
+            PSIs psis;
+            PDF scale;
+            PDF exp;
+            lbfgsfloatval_t log_z;
+            PDFs dstates;
+            PDFs dalphas;
+            PDFs dbetas;
+            PDFs dtrans;
+            PDFs dpsi;
+
+            Buffers(void)
+              : alphas(), betas(), state_marginals(), trans_marginals(),
+                trans(), trans_t(), states(), psis(), scale(), exp(),
+                log_z(0.0), dstates(), dalphas(), dbetas(), dtrans(), dpsi() { }
+
+            void init(const size_t ntags, const size_t max_size,
+                const size_t nfeatures);
+            void init_psis(const size_t ntags, const size_t max_size);
+            void init_hessian(const size_t ntags, const size_t max_size);
+            void reset(const size_t size);
+            void reset_expectations(void);
+        };
+
       protected:
-        typedef std::vector<Contexts *> InstancePtrs; //for SGD
+        typedef std::vector<Instance> InstanceRefs;
+
+        /**
+         * Worker.
+         * Computes the feature expectations and log partition function over
+         * a fixed partition of the training instances in its own set of
+         * working buffers. Used for multithreaded L-BFGS evaluation.
+         */
+        class Worker : public Util::Thread {
+          public:
+            Impl &impl;
+            InstanceRefs instances;
+            Buffers buffers;
+
+            Worker(Impl &impl) : Thread(), impl(impl), instances(), buffers() { }
+            virtual ~Worker(void) { }
+
+            virtual void run(void);
+        };
+
+        typedef std::vector<Worker *> Workers;
+
+        /**
+         * Schedule.
+         * The state of an SGD epoch shared by the SGD workers.
+         *
+         * Without batching, workers claim the next instance by atomically
+         * incrementing next, and the learning rate, decay and gain for
+         * update t are computed directly from t, so the schedule does not
+         * need a lock.
+         *
+         * With a batch size greater than one, each batch is divided between
+         * the workers, and the first worker applies the summed gradient and
+         * advances eta, decay and gain once all of the workers have reached
+         * the barrier.
+         */
+        class Schedule {
+          public:
+            InstanceRefs *refs;
+            size_t nsamples;
+            size_t batch;
+            volatile size_t next;
+            lbfgsfloatval_t t0;
+            lbfgsfloatval_t lambda;
+            lbfgsfloatval_t eta;
+            lbfgsfloatval_t decay;
+            lbfgsfloatval_t gain;
+            int t;
+            Util::Barrier *barrier;
+
+            Schedule(void) : refs(0), nsamples(0), batch(1), next(0), t0(0.0),
+              lambda(0.0), eta(0.0), decay(1.0), gain(0.0), t(0), barrier(0) { }
+
+            void advance(void) {
+              eta = 1 / (lambda * (t0 + t));
+              decay *= (1.0 - eta * lambda);
+              gain = eta / decay;
+              ++t;
+            }
+        };
+
+        /**
+         * SGDWorker.
+         * Without batching, performs stochastic gradient descent updates for
+         * the instances it claims from the shared schedule, writing to the
+         * shared lambdas without locking (Hogwild). Updates for a single
+         * instance are sparse, so conflicting writes are rare and are
+         * tolerated.
+         *
+         * With batching, accumulates the gradient of its share of each batch
+         * in buffers.exp, recording the ids of the features it has touched so
+         * that the batch update only visits those features.
+         */
+        class SGDWorker : public Util::Thread {
+          public:
+            Impl &impl;
+            const size_t id;
+            Buffers buffers;
+            std::vector<uint32_t> touched;
+            lbfgsfloatval_t loss;
+
+            SGDWorker(Impl &impl, const size_t id)
+              : Thread(), impl(impl), id(id), buffers(), touched(), loss(0.0) { }
+            virtual ~SGDWorker(void) { }
+
+            virtual void run(void);
+            void hogwild(void);
+            void batches(void);
+        };
+
+        typedef std::vector<SGDWorker *> SGDWorkers;
+        typedef std::vector<Sentence> Sentences;
+
+        /**
+         * Extractor.
+         * Runs the feature generators over a contiguous range of a block of
+         * sentences for parallel feature extraction. In pass 2, the
+         * attributes are counted in the extractor's own attributes object,
+         * which is merged into the shared attributes after the block. In
+         * pass 3, the contexts are built against the shared attributes,
+         * which are read-only by then, and stored in the extractor's own
+         * instances, which are appended to the training instances after the
+         * block. Errors are stored rather than thrown, and rethrown by the
+         * main thread.
+         */
+        class Extractor : public Util::Thread {
+          public:
+            Impl &impl;
+            Sentences &block;
+            const bool count;
+            size_t begin;
+            size_t end;
+            size_t offset;
+            Attributes *attributes;
+            Instances instances;
+            std::string error;
+
+            Extractor(Impl &impl, Sentences &block, const bool count)
+              : Thread(), impl(impl), block(block), count(count), begin(0),
+                end(0), offset(0), attributes(0), instances(), error() { }
+            virtual ~Extractor(void) { delete attributes; }
+
+            virtual void run(void);
+        };
+
+        typedef std::vector<Extractor *> Extractors;
+
+        /**
+         * Pipeline.
+         * The state shared by the stages of multithreaded tagging. Sentences
+         * pass through a ring of slots in input order: the reader fills the
+         * slot of sentence nread, the taggers claim sentences in order
+         * (next is the next to be claimed) and tag them concurrently, and
+         * the writer writes sentence nwritten once it is tagged and frees
+         * its slot. A stage only touches a slot while it owns it, so the
+         * mutex is held only to update the counters and statuses. Errors
+         * are stored and stop every stage, and are rethrown by the writer.
+         */
+        class Pipeline {
+          public:
+            enum Status { FREE, READ, TAGGED };
+
+            Sentences sents;
+            std::vector<Status> status;
+            uint64_t nread;
+            uint64_t next;
+            uint64_t nwritten;
+            bool eof;
+            std::string error;
+            Util::Mutex mutex;
+            Util::Condition changed;
+
+            Pipeline(const size_t nslots)
+              : sents(nslots), status(nslots, FREE), nread(0), next(0),
+                nwritten(0), eof(false), error(), mutex(), changed() { }
+
+            void fail(const std::string &msg);
+        };
+
+        /**
+         * PipelineReader.
+         * The reader stage of multithreaded tagging.
+         */
+        class PipelineReader : public Util::Thread {
+          public:
+            Pipeline &pipeline;
+            Reader &reader;
+
+            PipelineReader(Pipeline &pipeline, Reader &reader)
+              : Thread(), pipeline(pipeline), reader(reader) { }
+            virtual ~PipelineReader(void) { }
+
+            virtual void run(void);
+        };
+
+        /**
+         * PipelineTagger.
+         * A tagger stage of multithreaded tagging, with its own lattice and
+         * distribution, sharing the read-only model with the other taggers.
+         */
+        class PipelineTagger : public Util::Thread {
+          public:
+            Impl &impl;
+            Pipeline &pipeline;
+            State state;
+
+            PipelineTagger(Impl &impl, Pipeline &pipeline)
+              : Thread(), impl(impl), pipeline(pipeline),
+                state(impl.tags.size(), *impl.kernels) { }
+            virtual ~PipelineTagger(void) { }
+
+            virtual void run(void);
+        };
+
+        typedef std::vector<PipelineTagger *> PipelineTaggers;
+        typedef std::vector<Util::Socket *> Sockets;
+
+        /**
+         * Checkpoint.
+         * A snapshot of the optimization state at the end of an L-BFGS
+         * iteration or SGD epoch. For SGD, this includes the update count t,
+         * the calibrated t0, and the losses of recent epochs used by the
+         * convergence check.
+         */
+        class Checkpoint {
+          public:
+            std::string trainer;
+            uint64_t iteration;
+            int64_t t;
+            lbfgsfloatval_t t0;
+            lbfgsfloatval_t best_loss;
+            PDF losses;
+            PDF weights;
+
+            Checkpoint(void) : trainer(), iteration(0), t(0), t0(0.0),
+              best_loss(0.0), losses(), weights() { }
+
+            void save(const std::string &filename) const;
+            void load(const std::string &filename);
+        };
+
+        /**
+         * CheckpointWriter.
+         * Writes a copy of the latest checkpoint on a background thread, so
+         * that training does not wait for the disk. The extraction
+         * artifacts are written along with the first checkpoint. Errors
+         * are stored rather than thrown, and reported by the training
+         * thread.
+         */
+        class CheckpointWriter : public Util::Thread {
+          public:
+            Impl &impl;
+            Checkpoint checkpoint;
+            bool save_extraction;
+            std::string error;
+
+            CheckpointWriter(Impl &impl, const bool save_extraction)
+              : Thread(), impl(impl), checkpoint(),
+                save_extraction(save_extraction), error() { }
+            virtual ~CheckpointWriter(void) { }
+
+            virtual void run(void);
+        };
+
+        /**
+         * Adaptive.
+         * Per-feature state for the adaptive learning rate SGD methods.
+         *
+         * AdaGrad divides the learning rate for each feature by the root of
+         * its summed squared gradients (v). Adam keeps exponentially decaying
+         * averages of the gradient (m) and squared gradient (v), with bias
+         * corrections for the early updates.
+         *
+         * The state of a feature is only updated when the feature is active
+         * on an instance. The L2 regularization that a feature missed since
+         * its last update (recorded in last) is added to its gradient at that
+         * point. sums accumulates (t - 1) * update for each feature, so that
+         * the average of the iterates over t updates is lambda - sums / t.
+         */
+        class Adaptive {
+          public:
+            enum Method { ADAGRAD, ADAM };
+
+            const Method method;
+            const bool average;
+            const lbfgsfloatval_t eta;
+            const lbfgsfloatval_t beta1;
+            const lbfgsfloatval_t beta2;
+            const lbfgsfloatval_t epsilon;
+            uint64_t t;
+            lbfgsfloatval_t bias1;
+            lbfgsfloatval_t bias2;
+            PDF m;
+            PDF v;
+            PDF sums;
+            std::vector<uint64_t> last;
+
+            Adaptive(const Method method, const size_t nfeatures,
+                const lbfgsfloatval_t eta, const bool average)
+              : method(method), average(average), eta(eta), beta1(0.9),
+                beta2(0.999), epsilon(1e-8), t(0), bias1(1.0), bias2(1.0),
+                m(method == ADAM ? nfeatures : 0, 0.0), v(nfeatures, 0.0),
+                sums(average ? nfeatures : 0, 0.0), last(nfeatures, 0) { }
+        };
         typedef std::string Chains;
 
         lbfgsfloatval_t duration_s(void);
         lbfgsfloatval_t duration_m(void);
 
-        virtual void reset(const size_t size);
-
-        void compute_psis(Context &context, PDFs &dist, lbfgsfloatval_t decay=1.0);
-        void compute_psis(Contexts &contexts, PSIs &psis, lbfgsfloatval_t decay=1.0);
-        void compute_expectations(Contexts &c);
-        void compute_expectations_from_marginals(Contexts &c);
-        void forward(Contexts &contexts, PDFs &alphas, PSIs &psis, PDF &scale);
-        void forward_noscale(Contexts &contexts, PDFs &alphas, PSIs &psis);
-        void backward(Contexts &contexts, PDFs &betas, PSIs &psis, PDF &scale);
-        void backward_noscale(Contexts &contexts, PDFs &betas, PSIs &psis);
-        lbfgsfloatval_t sum_llhood(Contexts &contexts, lbfgsfloatval_t decay=1.0);
+        void compute_psis(const Instance &instance, const size_t i, PDFs &dist, lbfgsfloatval_t decay=1.0);
+        void compute_psis(const Instance &instance, PSIs &psis, lbfgsfloatval_t decay=1.0);
+        void compute_states(const Instance &instance, const size_t i, lbfgsfloatval_t *dist, const lbfgsfloatval_t *weights, lbfgsfloatval_t decay=1.0);
+        void compute_states(const Instance &instance, PDFs &states, const lbfgsfloatval_t *weights, lbfgsfloatval_t decay=1.0);
+        void compute_states(const Instance &instance, PDFs &states, lbfgsfloatval_t decay=1.0);
+        void compute_trans(Buffers &b, const lbfgsfloatval_t *weights, lbfgsfloatval_t decay=1.0);
+        void compute_trans(Buffers &b, lbfgsfloatval_t decay=1.0);
+        void compute_expectations(const Instance &c, Buffers &b);
+        void compute_expectations_from_marginals(const Instance &c, Buffers &b);
+        lbfgsfloatval_t forward(const Instance &instance, Buffers &b);
+        void forward_noscale(const Instance &instance, Buffers &b);
+        void backward(const Instance &instance, Buffers &b);
+        void backward_noscale(const Instance &instance, Buffers &b);
+        lbfgsfloatval_t sum_llhood(const Instance &instance, lbfgsfloatval_t decay=1.0);
         lbfgsfloatval_t regularised_llhood(void);
+        lbfgsfloatval_t regularised_llhood(const lbfgsfloatval_t llhood);
+        void accumulate(const Instance &instance, Buffers &b);
+        void accumulate_pl(const Instance &instance, Buffers &b);
+        void accumulate_piecewise(const Instance &instance, Buffers &b);
+        void compute_dtrans(Buffers &b);
+        void add_pair_directions(const Instance &instance, const size_t i,
+            Buffers &b, const bool add);
+        lbfgsfloatval_t pair_tangent(Buffers &b, const size_t i, const Tag prev,
+            const Tag curr, const lbfgsfloatval_t eg);
+        void hessian_vector(const Instance &instance, Buffers &b);
+        void partition(const size_t nthreads);
+        void run_workers(void);
         lbfgsfloatval_t _lbfgs_evaluate(const lbfgsfloatval_t *x,
             lbfgsfloatval_t *g, const int n, const lbfgsfloatval_t step);
+        void _hessian_vector(const lbfgsfloatval_t *v, lbfgsfloatval_t *hv,
+            const int n);
         lbfgsfloatval_t _lbfgs_bp_evaluate(const lbfgsfloatval_t *x,
             lbfgsfloatval_t *g, const int n, const lbfgsfloatval_t step);
+        lbfgsfloatval_t _lbfgs_remote_evaluate(const lbfgsfloatval_t *x,
+            lbfgsfloatval_t *g, const int n, const lbfgsfloatval_t step);
+
+        /**
+         * in_shard.
+         * Returns true if the ith training instance belongs to the shard
+         * stored by this process. The coordinator of distributed training
+         * has shard == nshards, so it stores no instances.
+         */
+        bool in_shard(const size_t i) const {
+          return nshards == 0 || i % nshards == shard;
+        }
+
+        void generate(Reader &reader, Instances *instances);
+        void count_attributes(Reader &reader) { generate(reader, 0); }
+        void build_instances(Reader &reader, Instances &instances) { generate(reader, &instances); }
+        void add_instance(Instances &instances, const Sentence &sent, const Contexts &contexts);
+
+        /**
+         * add_features.
+         * Adds the lambdas of the active features at position i of the
+         * sentence to dist, using the feature dictionaries, or the hashed
+         * attributes for a hashed model.
+         */
+        void add_features(Sentence &sent, PDFs &dist, const size_t i) {
+          if (model.hash_bits())
+            registry.add_features(attributes, lexicon, sent, dist, i);
+          else
+            registry.add_features(lexicon, sent, dist, i);
+        }
 
-        void print_psis(Contexts &contexts, PSIs &psis);
-        void print_fwd_bwd(Contexts &contexts, PDFs &pdfs, PDF &scale);
-        void print_state_marginals(Contexts &contexts, PDFs &state_marginals);
+        /**
+         * candidates.
+         * Returns the tags that word i of the sentence may take under the
+         * tag dictionary, or an empty range if the word is not restricted
+         * (or the model was not trained with the tag dictionary).
+         */
+        TagDict::Candidates candidates(const Sentence &sent, const size_t i) const {
+          if (!model.tagdict_cutoff())
+            return TagDict::Candidates();
+          return tagdict.get(sent.words[i]);
+        }
+
+        void save_extraction(const std::string &filename) const;
+        void load_extraction(const std::string &filename);
+        void resume(const std::string &trainer);
+        void checkpoint(const lbfgsfloatval_t *weights, const uint64_t iteration);
+        void init_from_model(const std::string &dir);
+        void reset_weights(lbfgsfloatval_t *weights);
+
+        void accept_workers(void);
+        void connect_coordinator(void);
+        void check_workers(void);
+        void serve(void);
+
+        void print_psis(const Instance &instance, PSIs &psis);
+        void print_fwd_bwd(const Instance &instance, PDFs &pdfs, PDF &scale);
+        void print_state_marginals(const Instance &instance, PDFs &state_marginals);
         void print_trans_marginals(PDFs &trans_marginals);
 
         void finite_differences(lbfgsfloatval_t *g, bool overwrite=false);
+        void check_kernels(void);
 
-        lbfgsfloatval_t calibrate(InstancePtrs &instance_ptrs, lbfgsfloatval_t *weights,
+        lbfgsfloatval_t calibrate(InstanceRefs &refs, lbfgsfloatval_t *weights,
             lbfgsfloatval_t lambda, lbfgsfloatval_t initial_eta, const int nfeatures);
-        lbfgsfloatval_t sgd_epoch(InstancePtrs &instance_ptrs, lbfgsfloatval_t *weights,
+        lbfgsfloatval_t sgd_epoch(InstanceRefs &refs, lbfgsfloatval_t *weights,
             const int nfeatures, const int nsamples, const lbfgsfloatval_t lambda,
             const int t0, int &t, const bool log=false);
-        lbfgsfloatval_t sgd_iterate_calibrate(InstancePtrs &instance_ptrs,
+        lbfgsfloatval_t sgd_iterate_calibrate(InstanceRefs &refs,
             lbfgsfloatval_t *weights, const int nfeatures, const int nsamples,
             const lbfgsfloatval_t t0, const lbfgsfloatval_t lambda);
-        lbfgsfloatval_t sgd_iterate(InstancePtrs &instance_ptrs, lbfgsfloatval_t *weights,
+        lbfgsfloatval_t sgd_iterate(InstanceRefs &refs, lbfgsfloatval_t *weights,
             const int nfeatures, const int nsamples, const lbfgsfloatval_t t0,
             const lbfgsfloatval_t lambda, const int nepochs, const int period);
-        void compute_marginals(Contexts &c);
-        void compute_weights(Contexts &c, lbfgsfloatval_t gain);
-        lbfgsfloatval_t score(Contexts &contexts, lbfgsfloatval_t decay=1.0);
-        lbfgsfloatval_t score_instance(Contexts &contexts, lbfgsfloatval_t decay=1.0,
+        void compute_marginals(const Instance &c, Buffers &b);
+        void compute_weights(const Instance &c, Buffers &b, lbfgsfloatval_t gain,
+            lbfgsfloatval_t *weights);
+        lbfgsfloatval_t score_gradient(const Instance &instance, Buffers &b,
+            lbfgsfloatval_t decay);
+        void apply_batch(const bool advance);
+        lbfgsfloatval_t adaptive_epoch(InstanceRefs &refs, const int nsamples,
+            const lbfgsfloatval_t lambda);
+        void adaptive_update(const uint32_t f, const lbfgsfloatval_t lambda);
+        void adaptive_step(const uint32_t f, const lbfgsfloatval_t g);
+        void adaptive_flush(const size_t nfeatures, const lbfgsfloatval_t lambda);
+        void svrg_epoch(InstanceRefs &refs, lbfgsfloatval_t *weights,
+            const lbfgsfloatval_t *snapshot, const lbfgsfloatval_t *target,
+            Buffers &snap, const lbfgsfloatval_t eta, const int nfeatures);
+
+        void perceptron_decode(const Instance &instance, Buffers &b, Tags &path,
+            std::vector<uint16_t> &backpointers);
+        size_t perceptron_update(const Instance &instance, Buffers &b,
+            const Tags &path, const std::vector<int64_t> &pair_ids,
+            lbfgsfloatval_t *sums, const lbfgsfloatval_t c);
+        lbfgsfloatval_t score(const Instance &instance, Buffers &b, lbfgsfloatval_t decay=1.0);
+        lbfgsfloatval_t score_instance(const Instance &instance, Buffers &b, lbfgsfloatval_t decay=1.0,
             lbfgsfloatval_t gain=1.0);
 
         virtual void _pass1(Reader &reader) = 0;
@@ -281,7 +776,12 @@ namespace NLP {
         virtual void _pass3(Reader &reader, Instances &instances) = 0;
 
         void train_lbfgs(Reader &reader, lbfgsfloatval_t *weights);
+        void train_tron(Reader &reader, lbfgsfloatval_t *weights);
+        void train_svrg(Reader &reader, lbfgsfloatval_t *weights);
         void train_sgd(Reader &reader, lbfgsfloatval_t *weights);
+        void train_perceptron(Reader &reader, lbfgsfloatval_t *weights);
+        void train_adaptive(Reader &reader, lbfgsfloatval_t *weights,
+            const Adaptive::Method method);
 
         void train_loopy_bp(Reader &reader, lbfgsfloatval_t *weights);
 
@@ -303,6 +803,7 @@ namespace NLP {
         TagSet tags;
         TagLimits limits;
         Lexicon words2tags;
+        TagDict tagdict;
         Attributes attributes;
         Instances instances;
         Weights weights;
@@ -322,32 +823,84 @@ namespace NLP {
         clock_t clock_begin;
 
         /**
-         * working vectors for training
-         * alphas: an (nwords * ntags) matrix that stores the forward scores for
-         *         one pass of the forward-backward algorithm
-         * betas: an (nwords * ntags) matrix that stores the backward scores for
-         *        one pass of the forward-backward algorithm
-         *
-         * state_marginals: an (nwords * ntags) matrix that stores the model
-         *                  expectation of a tag t at position i
-         *
-         * trans_marginals: an (ntags * ntags) matrix that stores the model
-         *                  expectation of a transition between tag t and tag u
-         *
-         * psis: an (nwords * ntags * ntags) matrix that stores the activation
-         *       score (psi) for a transition from tag t to tag u at position i.
-         *       State activations for features that do not rely on the
-         *       previous tag are stored with a previous tag of None
-         *
-         * scale: an (nwords) vector that stores the scale factor for each
-         *        position i.
+         * working buffers for single threaded training, and the workers
+         * (each with their own buffers) for multithreaded L-BFGS and SGD
+         * training
+         */
+        Buffers buffers;
+        Workers workers;
+        SGDWorkers sgd_workers;
+        Schedule schedule;
+        Adaptive *adaptive;
+        lbfgsfloatval_t *lambdas;
+
+        /**
+         * the connections to the worker processes (on the coordinator) or to
+         * the coordinator (on a worker) for distributed L-BFGS training, and
+         * the shard of the training instances stored by this process
+         */
+        Sockets remotes;
+        Util::Socket *coordinator;
+        uint64_t shard;
+        uint64_t nshards;
+
+        /**
+         * the optimization state kept up to date by the trainer, the
+         * background checkpoint writer (if checkpoints are enabled), the
+         * time of the last checkpoint, and the checkpoint that training
+         * resumed from (if any)
+         */
+        Checkpoint progress;
+        CheckpointWriter *checkpointer;
+        time_t checkpoint_time;
+        Checkpoint *resumed;
+
+        /**
+         * the starting weights mapped from an existing model with
+         * init_model, indexed in the same order as the lambdas (empty to
+         * start from zero)
          */
-        PDFs alphas;
-        PDFs betas;
-        PDFs state_marginals;
-        PDFs trans_marginals;
-        PSIs psis;
-        PDF scale;
+        PDF initial;
+
+        /**
+         * the tagpair of each feature and the ids of the transition features,
+         * indexed in the same order as the lambdas
+         */
+        TagPairs feature_klasses;
+        std::vector<uint32_t> trans_ids;
+
+        /**
+         * the id of the transition feature of each tagpair (-1 if there is
+         * none), so that the transition expectations of a pruned lattice
+         * can be added for the candidate tagpairs only, and the real tags
+         * (all but None and Sentinel), which are the candidates of an
+         * unrestricted position. Only built when the instances are pruned
+         */
+        std::vector<int64_t> trans_index;
+        std::vector<uint16_t> all_klasses;
+
+        /**
+         * vectorized kernels used in the forward-backward algorithm and in
+         * Viterbi decoding, selected at the start of training or tagging
+         */
+        const Util::simd::Kernels *kernels;
+
+        /**
+         * the objective optimized by L-BFGS: the likelihood, or one of the
+         * local approximations to it used by the pl and piecewise trainers
+         */
+        enum Objective { LIKELIHOOD, PSEUDO_LIKELIHOOD, PIECEWISE };
+        Objective objective;
+
+        /**
+         * the direction of the Hessian-vector product computed by the
+         * workers for TRON (null for an ordinary evaluation), and the number
+         * of evaluations and Hessian-vector products made by the current
+         * trainer, each of which is a pass over the training data
+         */
+        const lbfgsfloatval_t *direction;
+        uint64_t nevaluations;
+        uint64_t nproducts;
 
         Impl(Config &cfg, Types &types, const std::string &chains,
             const std::string &preface)
@@ -356,13 +909,32 @@ namespace NLP {
             registry(cfg.rare_cutoff()), logger(cfg.log(), std::cout),
             chains(Format(chains, true).fields), lexicon(cfg.lexicon()),
             tags(cfg.tags()), limits(tags), words2tags(cfg.tagdict()),
-            attributes(), instances(), weights(), attribs2weights(),
+            tagdict(cfg.tagdict()), attributes(), instances(), weights(), attribs2weights(),
             graph(limits), w_dict(lexicon), ww_dict(lexicon), a_dict(),
             t_dict(), preface(preface), inv_sigma_sq(), log_z(0.0), ntags(),
-            clock_begin(), alphas(), betas(), state_marginals(),
-            trans_marginals(), psis(), scale() { }
-
-        virtual ~Impl(void) { /* nothing */ }
+            clock_begin(), buffers(), workers(), sgd_workers(), schedule(), adaptive(0),
+            lambdas(0), remotes(), coordinator(0), shard(0), nshards(0),
+            progress(), checkpointer(0), checkpoint_time(0), resumed(0),
+            initial(), feature_klasses(), trans_ids(), trans_index(),
+            all_klasses(), kernels(0),
+            objective(LIKELIHOOD), direction(0), nevaluations(0),
+            nproducts(0) { }
+
+        virtual ~Impl(void) {
+          if (checkpointer)
+            checkpointer->join();
+          for (Workers::iterator i = workers.begin(); i != workers.end(); ++i)
+            delete *i;
+          for (SGDWorkers::iterator i = sgd_workers.begin(); i != sgd_workers.end(); ++i)
+            delete *i;
+          delete schedule.barrier;
+          delete adaptive;
+          for (Sockets::iterator i = remotes.begin(); i != remotes.end(); ++i)
+            delete *i;
+          delete coordinator;
+          delete checkpointer;
+          delete resumed;
+        }
 
         void extract(Reader &reader, Instances &instances);
         void train(Reader &reader, const std::string &trainer);
@@ -375,12 +947,16 @@ namespace NLP {
             const lbfgsfloatval_t *x, lbfgsfloatval_t *g, const int n,
             const lbfgsfloatval_t step);
 
+        static lbfgsfloatval_t lbfgs_remote_evaluate(void *instance,
+            const lbfgsfloatval_t *x, lbfgsfloatval_t *g, const int n,
+            const lbfgsfloatval_t step);
+
         static int lbfgs_progress(void *instance, const lbfgsfloatval_t *x,
             const lbfgsfloatval_t *g, const lbfgsfloatval_t fx,
             const lbfgsfloatval_t xnorm, const lbfgsfloatval_t gnorm,
             const lbfgsfloatval_t step, int n, int k, int ls);
 
-        virtual void run_tag(Reader &reader, Writer &writer) = 0;
+        virtual void run_tag(Reader &reader, Writer &writer);
         virtual void tag(State &state, Sentence &sent) = 0;
 
     };
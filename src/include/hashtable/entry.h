@@ -30,7 +30,7 @@ namespace Util {
         }
 
         bool equal(const Hash hash, const std::string &str) {
-          return hash == hash && str == str;
+          return this->hash == hash && str == this->str;
         }
 
         bool equal(const char c) {
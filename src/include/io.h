@@ -8,6 +8,7 @@
 #include "io/reader_factory.h"
 #include "io/reader_format.h"
 #include "io/reader_conll.h"
+#include "io/reader_spool.h"
 
 #include "io/writer.h"
 #include "io/writer_factory.h"
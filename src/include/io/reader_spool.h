@@ -0,0 +1,46 @@
+/**
+ * reader_spool.h
+ * A reader that spools the sentences read from another reader so that they
+ * can be read again without re-parsing the input. The first pass reads from
+ * the source reader, and each field of each sentence is stored as a length
+ * prefixed list of interned string ids, either in memory or in a binary
+ * spool file. After reset(), sentences are replayed from the spool, so the
+ * source is read exactly once and need not be seekable (e.g. stdin).
+ *
+ * Only the word, POS, chunk and entity fields are spooled, since these are
+ * the only fields filled in by the readers.
+ */
+namespace NLP {
+  class SpoolReader : public Reader {
+    private:
+      typedef std::map<std::string, uint32_t> Ids;
+      typedef std::vector<uint32_t> Buffer;
+
+      Reader &_source;
+      const std::string _filename;
+      Ids _ids;
+      Raws _strings;
+      Buffer _buffer;
+      Buffer _scratch;
+      std::ofstream _out;
+      std::ifstream _in;
+      uint64_t _nsents;
+      size_t _position;
+      bool _recording;
+
+      void record(const Raws &raws);
+      bool replay(Raws &raws, const bool first);
+
+    public:
+      SpoolReader(Reader &source, const std::string &filename="");
+
+      virtual ~SpoolReader(void);
+
+      virtual bool next(Sentence &sent);
+
+      virtual void reset(void);
+
+      uint64_t nsents(void) const { return _nsents; }
+      size_t nstrings(void) const { return _strings.size(); }
+  };
+}
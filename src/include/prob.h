@@ -1,8 +1,160 @@
 namespace NLP {
 
   typedef std::vector<lbfgsfloatval_t> PDF;
-  typedef std::vector<PDF> PDFs;
-  typedef std::vector<PDFs> PSIs;
+
+  /**
+   * PDFs.
+   * A contiguous, row-major (nrows * ncols) matrix of probabilities or
+   * activation scores, indexed as m[row][col].
+   *
+   * The storage is allocated as a single cache line aligned block, and the
+   * stride between rows is padded up to a whole number of cache lines, so
+   * every row starts on a cache line boundary. Iterating over the rows in
+   * order streams through memory rather than chasing a pointer per row.
+   *
+   * A matrix either owns its storage, or is a view onto a slice of the
+   * storage of a PSIs tensor.
+   */
+  class PDFs {
+    public:
+      const static size_t ALIGN = 64;
+
+    private:
+      lbfgsfloatval_t *_data;
+      size_t _rows;
+      size_t _cols;
+      size_t _stride;
+      bool _owner;
+
+      static size_t _padded(const size_t cols) {
+        const size_t n = ALIGN / sizeof(lbfgsfloatval_t);
+        return ((cols + n - 1) / n) * n;
+      }
+
+      static lbfgsfloatval_t *_alloc(const size_t size) {
+        void *mem = 0;
+        if (size && posix_memalign(&mem, ALIGN, size * sizeof(lbfgsfloatval_t)))
+          throw std::bad_alloc();
+        return static_cast<lbfgsfloatval_t *>(mem);
+      }
+
+      void _release(void) {
+        if (_owner)
+          free(_data);
+        _data = 0;
+        _rows = _cols = _stride = 0;
+        _owner = true;
+      }
+
+      friend class PSIs;
+
+    public:
+      PDFs(void) : _data(0), _rows(0), _cols(0), _stride(0), _owner(true) { }
+
+      PDFs(const size_t rows, const size_t cols, const lbfgsfloatval_t value=0.0)
+        : _data(0), _rows(0), _cols(0), _stride(0), _owner(true) {
+        resize(rows, cols, value);
+      }
+
+      PDFs(const PDFs &other)
+        : _data(0), _rows(0), _cols(0), _stride(0), _owner(true) {
+        *this = other;
+      }
+
+      ~PDFs(void) { _release(); }
+
+      PDFs &operator=(const PDFs &other) {
+        if (this != &other) {
+          resize(other._rows, other._cols);
+          std::copy(other._data, other._data + other._rows * other._stride, _data);
+        }
+        return *this;
+      }
+
+      /**
+       * resize.
+       * Reallocates the matrix to (rows * cols), with every element set to
+       * value. Any existing values are discarded.
+       */
+      void resize(const size_t rows, const size_t cols, const lbfgsfloatval_t value=0.0) {
+        _release();
+        _rows = rows;
+        _cols = cols;
+        _stride = _padded(cols);
+        _data = _alloc(_rows * _stride);
+        fill(value);
+      }
+
+      lbfgsfloatval_t *operator[](const size_t row) { return _data + row * _stride; }
+      const lbfgsfloatval_t *operator[](const size_t row) const { return _data + row * _stride; }
+
+      lbfgsfloatval_t *data(void) { return _data; }
+      size_t size(void) const { return _rows; }
+      size_t cols(void) const { return _cols; }
+      size_t stride(void) const { return _stride; }
+
+      void fill(const lbfgsfloatval_t value) { fill(_rows, value); }
+
+      /**
+       * fill.
+       * Sets every element in the first rows rows of the matrix to value.
+       * The rows are contiguous, so this is a single pass over memory.
+       */
+      void fill(const size_t rows, const lbfgsfloatval_t value) {
+        std::fill(_data, _data + rows * _stride, value);
+      }
+  };
+
+  /**
+   * PSIs.
+   * A contiguous (nslices * nrows * ncols) tensor of activation scores,
+   * indexed as t[slice][row][col]. Each slice is an (nrows * ncols) PDFs
+   * view onto a single cache line aligned block of storage.
+   */
+  class PSIs {
+    private:
+      PDFs _storage;
+      std::vector<PDFs> _slices;
+
+      PSIs(const PSIs &other);
+      PSIs &operator=(const PSIs &other);
+
+    public:
+      PSIs(void) : _storage(), _slices() { }
+
+      /**
+       * resize.
+       * Reallocates the tensor to (slices * rows * cols), with every element
+       * set to value. Any existing values are discarded.
+       */
+      void resize(const size_t slices, const size_t rows, const size_t cols, const lbfgsfloatval_t value=0.0) {
+        _slices.clear();
+        _storage.resize(slices * rows, cols, value);
+        _slices.resize(slices);
+        for (size_t i = 0; i < slices; ++i) {
+          PDFs &slice = _slices[i];
+          slice._data = _storage[i * rows];
+          slice._rows = rows;
+          slice._cols = cols;
+          slice._stride = _storage.stride();
+          slice._owner = false;
+        }
+      }
+
+      PDFs &operator[](const size_t slice) { return _slices[slice]; }
+      const PDFs &operator[](const size_t slice) const { return _slices[slice]; }
+
+      size_t size(void) const { return _slices.size(); }
+
+      /**
+       * fill.
+       * Sets every element in the first slices slices of the tensor to value.
+       */
+      void fill(const size_t slices, const lbfgsfloatval_t value) {
+        if (slices)
+          _storage.fill(slices * _slices[0].size(), value);
+      }
+  };
 
   template <typename T>
   inline bool isinf(T value) {
@@ -10,8 +10,10 @@ namespace Util {
       Shared(void): _nrefs(1) { };
       ~Shared(void) { }
 
-      void inc_ref(void) { ++_nrefs; }
-      bool dec_ref(void) { return --_nrefs == 0; }
+      // atomic, since objects such as the lexicon are copied by value
+      // on several threads during parallel feature extraction
+      void inc_ref(void) { __sync_add_and_fetch(&_nrefs, 1); }
+      bool dec_ref(void) { return __sync_sub_and_fetch(&_nrefs, 1) == 0; }
   };
 }
 
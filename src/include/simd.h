@@ -0,0 +1,92 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+/**
+ * simd.h
+ * Vectorized kernels for the dense loops in forward-backward training and
+ * Viterbi decoding. Each kernel has a scalar reference implementation, plus
+ * SSE2, AVX2 and AVX-512 implementations compiled with per-function target
+ * attributes. The best set supported by the CPU is chosen at runtime with
+ * cpuid, so the binaries do not need to be built for a particular
+ * instruction set.
+ *
+ * The SIMD implementations sum in a different order to the scalar
+ * implementation, so results can differ in the last few bits.
+ */
+namespace Util {
+  namespace simd {
+
+    enum Level { SCALAR, SSE2, AVX2, AVX512 };
+
+    struct Kernels {
+      Level level;
+      const char *name;
+
+      /**
+       * dot.
+       * Returns the sum over i of a[i] * b[i].
+       */
+      double (*dot)(const double *a, const double *b, const size_t n);
+
+      /**
+       * dot3.
+       * Returns the sum over i of a[i] * b[i] * c[i].
+       */
+      double (*dot3)(const double *a, const double *b, const double *c, const size_t n);
+
+      /**
+       * mul_sum.
+       * Sets y[i] = y[i] * x[i] and returns the sum over i of the new y[i].
+       */
+      double (*mul_sum)(double *y, const double *x, const size_t n);
+
+      /**
+       * scale.
+       * Sets y[i] = y[i] * s.
+       */
+      void (*scale)(double *y, const double s, const size_t n);
+
+      /**
+       * axpy_mul.
+       * Sets y[i] = y[i] + s * a[i] * b[i].
+       */
+      void (*axpy_mul)(double *y, const double s, const double *a, const double *b, const size_t n);
+
+      /**
+       * axpy_mul3.
+       * Sets y[i] = y[i] + s * a[i] * b[i] * c[i].
+       */
+      void (*axpy_mul3)(double *y, const double s, const double *a, const double *b, const double *c, const size_t n);
+
+      /**
+       * max_plus.
+       * For each i where s + a[i] > y[i], sets y[i] = s + a[i] and
+       * idx[i] = k. There is no summation, so every implementation gives
+       * the same result, and ties keep the earlier k.
+       */
+      void (*max_plus)(double *y, uint16_t *idx, const double s, const double *a, const uint16_t k, const size_t n);
+    };
+
+    /**
+     * detect.
+     * Returns the widest instruction set supported by the running CPU.
+     */
+    Level detect(void);
+
+    /**
+     * kernels.
+     * Returns the kernels for the given instruction set. Throws an exception
+     * if the instruction set is not supported by the running CPU.
+     */
+    const Kernels &kernels(const Level level);
+
+    /**
+     * kernels.
+     * Returns the kernels by name: auto (the widest supported instruction
+     * set), avx512, avx2, sse2 or scalar.
+     */
+    const Kernels &kernels(const std::string &name);
+  }
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef _SKETCH_H
+#define _SKETCH_H
+
+/**
+ * sketch.h
+ * A count-min sketch, which counts the occurrences of a large number of
+ * keys in a fixed amount of memory. Each key is counted in one counter in
+ * each of depth rows, chosen by hashing the key. Colliding keys share
+ * counters, so the estimated count of a key (the smallest of its counters)
+ * is never less than its true count, but may be greater.
+ *
+ * Keys are given as 64 bit hash values, which are remixed for each row.
+ * Counters are incremented atomically, so several threads may count into
+ * the same sketch.
+ */
+namespace Util {
+
+  class CountMinSketch {
+    private:
+      const size_t _width;
+      const size_t _depth;
+      std::vector<uint32_t> _counts;
+
+      CountMinSketch(const CountMinSketch &other);
+      CountMinSketch &operator=(const CountMinSketch &other);
+
+      /**
+       * index.
+       * Returns the position of the counter for a key in a row, using the
+       * finalizer of the MurmurHash3 64 bit hash on the key and row.
+       */
+      size_t index(uint64_t hash, const size_t row) const {
+        hash += (row + 1) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+        return row * _width + hash % _width;
+      }
+
+    public:
+      CountMinSketch(const size_t width, const size_t depth=4)
+        : _width(width), _depth(depth), _counts(width * depth, 0) { }
+
+      void add(const uint64_t hash) {
+        for (size_t row = 0; row < _depth; ++row)
+          __sync_fetch_and_add(&_counts[index(hash, row)], 1);
+      }
+
+      uint32_t estimate(const uint64_t hash) const {
+        uint32_t count = _counts[index(hash, 0)];
+        for (size_t row = 1; row < _depth; ++row)
+          count = std::min(count, _counts[index(hash, row)]);
+        return count;
+      }
+
+      size_t bytes(void) const { return _counts.size() * sizeof(uint32_t); }
+  };
+}
+
+#endif
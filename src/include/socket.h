@@ -0,0 +1,76 @@
+#ifndef _SOCKET_H
+#define _SOCKET_H
+
+/**
+ * socket.h
+ * Thin wrappers around blocking stream sockets, used to connect the
+ * processes of distributed training. An address is either host:port for
+ * TCP, or unix:path for a Unix domain socket.
+ *
+ * Values are sent in the native byte order, so every process must run on
+ * the same architecture.
+ */
+namespace Util {
+
+  /**
+   * Socket.
+   * A connected stream socket. send() and recv() transfer exactly the
+   * given number of bytes, and throw an IOException if the connection
+   * fails or is closed by the other end.
+   */
+  class Socket {
+    private:
+      int _fd;
+      std::string _address;
+
+      Socket(const Socket &other);
+      Socket &operator=(const Socket &other);
+
+    public:
+      Socket(const int fd, const std::string &address) : _fd(fd), _address(address) { }
+      ~Socket(void);
+
+      const std::string &address(void) const { return _address; }
+
+      void send(const void *buffer, const size_t size);
+      void recv(void *buffer, const size_t size);
+
+      template <typename T>
+      void send(const T &value) { send(&value, sizeof(T)); }
+
+      template <typename T>
+      void recv(T &value) { recv(&value, sizeof(T)); }
+  };
+
+  /**
+   * Listener.
+   * A socket bound and listening on an address. accept() blocks until a
+   * connection arrives, and returns a new Socket owned by the caller. The
+   * socket file of a Unix domain listener is removed when it is destroyed.
+   */
+  class Listener {
+    private:
+      int _fd;
+      std::string _address;
+      std::string _path;
+
+      Listener(const Listener &other);
+      Listener &operator=(const Listener &other);
+
+    public:
+      Listener(const std::string &address);
+      ~Listener(void);
+
+      Socket *accept(void);
+  };
+
+  /**
+   * connect.
+   * Connects to the listener at address, and returns a new Socket owned by
+   * the caller. The connection is retried once a second for up to timeout
+   * seconds, so the processes may be started in any order.
+   */
+  Socket *connect(const std::string &address, const unsigned int timeout);
+}
+
+#endif
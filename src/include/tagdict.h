@@ -0,0 +1,51 @@
+/**
+ * tagdict.h
+ * Defines the tag dictionary, which maps each word seen in training to the
+ * tags it occurred with. Words seen at least a cutoff number of times are
+ * restricted to those tags, so that decoding only considers the tags that a
+ * frequent word can plausibly take.
+ */
+namespace NLP {
+  namespace HT = Util::hashtable;
+
+  class TagDict {
+    private:
+      class Impl;
+      Impl *_impl;
+
+    public:
+      /**
+       * Candidates.
+       * The ids of the tags that a word may take, in ascending order. An
+       * empty range places no restriction on the word.
+       */
+      struct Candidates {
+        const uint16_t *begin;
+        const uint16_t *end;
+
+        Candidates(void) : begin(0), end(0) { }
+        Candidates(const uint16_t *begin, const uint16_t *end)
+          : begin(begin), end(end) { }
+
+        bool empty(void) const { return begin == end; }
+        size_t size(void) const { return end - begin; }
+      };
+
+      TagDict(const std::string &filename, const size_t nbuckets=HT::MEDIUM,
+          const size_t pool_size=HT::LARGE);
+      TagDict(const TagDict &other);
+
+      ~TagDict(void);
+
+      void load(const TagSet &tags, const uint64_t cutoff);
+      void load(const std::string &filename, std::istream &input,
+          const TagSet &tags, const uint64_t cutoff);
+
+      Candidates get(const std::string &word) const;
+      Candidates operator[](const std::string &word) const { return get(word); }
+
+      size_t size(void) const;
+      size_t nrestricted(void) const;
+  };
+
+}
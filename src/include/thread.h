@@ -0,0 +1,155 @@
+#ifndef _THREAD_H
+#define _THREAD_H
+
+#include <pthread.h>
+
+/**
+ * thread.h
+ * Thin wrappers around POSIX threads. Only the standard C++ library is used
+ * elsewhere in the code, so these provide the handful of threading
+ * primitives that the parallel training and tagging routines need.
+ */
+namespace Util {
+
+  /**
+   * Thread.
+   * Abstract base class for a joinable thread. Subclasses implement run(),
+   * which is executed on a new thread when start() is called.
+   */
+  class Thread {
+    private:
+      pthread_t _thread;
+      bool _running;
+
+      static void *_run(void *thread) {
+        static_cast<Thread *>(thread)->run();
+        return 0;
+      }
+
+      Thread(const Thread &other);
+      Thread &operator=(const Thread &other);
+
+    public:
+      Thread(void) : _thread(), _running(false) { }
+      virtual ~Thread(void) { join(); }
+
+      virtual void run(void) = 0;
+
+      void start(void) {
+        if (pthread_create(&_thread, 0, _run, this))
+          throw Exception("could not create thread");
+        _running = true;
+      }
+
+      void join(void) {
+        if (_running)
+          pthread_join(_thread, 0);
+        _running = false;
+      }
+  };
+
+  /**
+   * Barrier.
+   * Blocks each of a fixed number of threads in wait() until all of them
+   * have reached it.
+   */
+  class Barrier {
+    private:
+      pthread_barrier_t _barrier;
+
+      Barrier(const Barrier &other);
+      Barrier &operator=(const Barrier &other);
+
+    public:
+      Barrier(const unsigned count) : _barrier() {
+        if (pthread_barrier_init(&_barrier, 0, count))
+          throw Exception("could not create barrier");
+      }
+      ~Barrier(void) { pthread_barrier_destroy(&_barrier); }
+
+      void wait(void) { pthread_barrier_wait(&_barrier); }
+  };
+
+  /**
+   * Mutex.
+   * A mutual exclusion lock, normally held with a Lock.
+   */
+  class Mutex {
+    private:
+      pthread_mutex_t _mutex;
+
+      Mutex(const Mutex &other);
+      Mutex &operator=(const Mutex &other);
+
+      friend class Condition;
+
+    public:
+      Mutex(void) : _mutex() {
+        if (pthread_mutex_init(&_mutex, 0))
+          throw Exception("could not create mutex");
+      }
+      ~Mutex(void) { pthread_mutex_destroy(&_mutex); }
+
+      void lock(void) { pthread_mutex_lock(&_mutex); }
+      void unlock(void) { pthread_mutex_unlock(&_mutex); }
+  };
+
+  /**
+   * Lock.
+   * Holds a mutex for the lifetime of the lock.
+   */
+  class Lock {
+    private:
+      Mutex &_mutex;
+
+      Lock(const Lock &other);
+      Lock &operator=(const Lock &other);
+
+    public:
+      Lock(Mutex &mutex) : _mutex(mutex) { _mutex.lock(); }
+      ~Lock(void) { _mutex.unlock(); }
+  };
+
+  /**
+   * Condition.
+   * A condition variable. wait() must be called with the mutex held, and
+   * holds it again on return.
+   */
+  class Condition {
+    private:
+      pthread_cond_t _cond;
+
+      Condition(const Condition &other);
+      Condition &operator=(const Condition &other);
+
+    public:
+      Condition(void) : _cond() {
+        if (pthread_cond_init(&_cond, 0))
+          throw Exception("could not create condition variable");
+      }
+      ~Condition(void) { pthread_cond_destroy(&_cond); }
+
+      void wait(Mutex &mutex) { pthread_cond_wait(&_cond, &mutex._mutex); }
+      void broadcast(void) { pthread_cond_broadcast(&_cond); }
+  };
+
+  /**
+   * fetch_and_add.
+   * Atomically adds inc to value and returns the previous value.
+   */
+  inline size_t fetch_and_add(volatile size_t &value, const size_t inc) {
+    return __sync_fetch_and_add(&value, inc);
+  }
+
+  /**
+   * compare_and_swap.
+   * Atomically sets value to replacement if it is equal to expected, and
+   * returns true if it was set.
+   */
+  template <typename T>
+  inline bool compare_and_swap(volatile T &value, const T expected, const T replacement) {
+    return __sync_bool_compare_and_swap(&value, expected, replacement);
+  }
+}
+
+#endif
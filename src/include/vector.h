@@ -24,6 +24,13 @@ namespace NLP {
     return sum;
   }
 
+  inline lbfgsfloatval_t vector_dot(const lbfgsfloatval_t *a, const lbfgsfloatval_t *b, const size_t size) {
+    lbfgsfloatval_t sum = 0.0;
+    for (size_t i = 0; i < size; ++i)
+      sum += a[i] * b[i];
+    return sum;
+  }
+
   inline void vector_print(PDF &vec, const size_t size) {
     for (size_t i = 0; i < size; ++i)
       printf("%f ", vec[i]);
@@ -110,10 +110,49 @@ namespace NLP {
           insert(tp);
         }
 
+        /**
+         * merge.
+         * Adds the frequency of another attribute and of each of its
+         * features to this attribute. Features that have not been seen on
+         * this attribute are appended in the order of the other attribute.
+         */
+        void merge(const AttribEntry &other) {
+          value += other.value;
+          for (Features::const_iterator i = other.features.begin(); i != other.features.end(); ++i) {
+            Features::iterator j = features.begin();
+            while (j != features.end() && !(j->klasses == i->klasses))
+              ++j;
+            if (j == features.end())
+              features.push_back(Feature(i->klasses, i->freq));
+            else
+              j->freq += i->freq;
+          }
+        }
+
         bool equal(const char *type, const std::string &str) const {
           return this->type == type && this->str == str;
         }
 
+        /**
+         * find_lambda.
+         * Searches the chain for the attribute with the given type name and
+         * text value, and returns the lambda of its feature with the given
+         * tagpair. The type is compared by name rather than by pointer,
+         * since it comes from a saved model. Returns NULL if there is no
+         * such feature, or it has no lambda.
+         */
+        lbfgsfloatval_t *find_lambda(const std::string &type, const std::string &str, const TagPair &klasses) {
+          for (AttribEntry *l = this; l != NULL; l = l->next) {
+            if (l->type == type && l->str == str && l->value > 0) {
+              for (Features::iterator i = l->features.begin(); i != l->features.end(); ++i)
+                if (i->klasses == klasses)
+                  return i->lambda;
+              return NULL;
+            }
+          }
+          return NULL;
+        }
+
         AttribEntry *find(const Hash::Hash hash, const std::string &str) {
           return NULL;
         }
@@ -129,20 +168,31 @@ namespace NLP {
          * find.
          * Given a context, a feature type, and the text value extracted by
          * the feature generator for that feature type, add all features on
-         * attributes which match the text value to the context
+         * attributes which match the text value to the context. Features that
+         * have been removed by a frequency cutoff are skipped
          */
         bool find(const char *type, const std::string &str, Context &c) {
           for (AttribEntry *l = this; l != NULL; l = l->next) {
             if (l->equal(type, str) && l->value > 0) {
-              c.features.reserve(c.features.size() + l->features.size());
-              for (Features::iterator i = l->features.begin(); i != l->features.end(); ++i)
-                c.features.push_back(&(*i));
+              l->add_features(c);
               return true;
             }
           }
           return false;
         }
 
+        /**
+         * add_features.
+         * Adds the features on this attribute that have not been removed by
+         * a frequency cutoff to the context.
+         */
+        void add_features(Context &c) {
+          c.features.reserve(c.features.size() + features.size());
+          for (Features::iterator i = features.begin(); i != features.end(); ++i)
+            if (i->freq)
+              c.features.push_back(&(*i));
+        }
+
         /**
          * cutoff.
          * Eliminates features with a frequency less than cutoff.
@@ -176,15 +226,31 @@ namespace NLP {
          * output format is:
          * attr_index prev_klass curr_klass freq lambda
          *
-         * where attr index is the index of this attribute. This index value
-         * is set when the attributes hash table is sorted by decreasing
-         * frequency.
+         * where attr index is the position of this attribute in the saved
+         * attributes file. Features removed by a cutoff or with a lambda of
+         * zero are not saved. Returns the number of features saved.
          */
-        void save_features(std::ostream &out) const {
-          assert(index != 0);
+        uint64_t save_features(std::ostream &out, const uint64_t id) const {
+          uint64_t nsaved = 0;
           for (Features::const_iterator i = features.begin(); i != features.end(); ++i)
-            if (i->freq)
-              out << index << ' ' << i->klasses.prev_id() << ' ' << i->klasses.curr_id() << ' ' << i->freq << ' ' << *(i->lambda) << '\n';
+            if (i->freq && *(i->lambda) != 0.0) {
+              out << id << ' ' << i->klasses.prev_id() << ' ' << i->klasses.curr_id() << ' ' << i->freq << ' ' << *(i->lambda) << '\n';
+              ++nsaved;
+            }
+          return nsaved;
+        }
+
+        /**
+         * nsaved.
+         * Returns the number of features on this attribute that will be
+         * saved, i.e. those with a non-zero frequency and lambda.
+         */
+        uint64_t nsaved(void) const {
+          uint64_t total = 0;
+          for (Features::const_iterator i = features.begin(); i != features.end(); ++i)
+            if (i->freq && *(i->lambda) != 0.0)
+              ++total;
+          return total;
         }
 
         /**
@@ -213,6 +279,18 @@ namespace NLP {
             i->exp = 0.0;
         }
 
+        /**
+         * add_expectations.
+         * Adds the model expected feature counts accumulated in an array of
+         * doubles to each feature attached to this attribute. The array is
+         * indexed in the same order as assign_lambdas.
+         */
+        void add_expectations(const lbfgsfloatval_t *exp, size_t &index) {
+          for (Features::iterator i = features.begin(); i != features.end(); ++i)
+            if (i->freq)
+              i->exp += exp[index++];
+        }
+
         /**
          * sum_lambda_sq.
          * Returns the sum of the squared lambda values of each feature
@@ -221,7 +299,8 @@ namespace NLP {
         lbfgsfloatval_t sum_lambda_sq(void) {
           lbfgsfloatval_t lambda_sq = 0.0;
           for (Features::iterator i = features.begin(); i != features.end(); ++i)
-            lambda_sq += (*(i->lambda) * *(i->lambda));
+            if (i->freq)
+              lambda_sq += (*(i->lambda) * *(i->lambda));
           return lambda_sq;
         }
 
@@ -233,10 +312,24 @@ namespace NLP {
          * for each feature. It is assumed that the array and index are
          * correctly sized as this function is called for each attribute and
          * does not do any bounds checking.
+         *
+         * Features removed by a frequency cutoff are not counted by
+         * nfeatures, so they are not given a lambda.
          */
         void assign_lambdas(lbfgsfloatval_t *x, size_t &index) {
           for (Features::iterator i = features.begin(); i != features.end(); ++i)
-            i->lambda = &x[index++];
+            i->lambda = i->freq ? &x[index++] : NULL;
+        }
+
+        /**
+         * copy_klasses.
+         * Copies the tagpair of each feature with a lambda to the supplied
+         * array, indexed in the same order as assign_lambdas.
+         */
+        void copy_klasses(TagPair *x, size_t &index) const {
+          for (Features::const_iterator i = features.begin(); i != features.end(); ++i)
+            if (i->freq)
+              x[index++] = i->klasses;
         }
 
         /**
@@ -255,7 +348,8 @@ namespace NLP {
          */
         void copy_gradients(lbfgsfloatval_t *x, lbfgsfloatval_t inv_sigma_sq, size_t &index) {
           for (Features::iterator i = features.begin(); i != features.end(); ++i)
-            x[index++] = i->gradient(inv_sigma_sq);
+            if (i->freq)
+              x[index++] = i->gradient(inv_sigma_sq);
         }
 
         /**
@@ -265,12 +359,16 @@ namespace NLP {
          */
         void print(lbfgsfloatval_t inv_sigma_sq) {
           for (Features::iterator i = features.begin(); i != features.end(); ++i)
-            std::cout << "gradient: " << i->gradient(inv_sigma_sq) << " lambda: " << *(i->lambda) << std::endl;
+            if (i->freq)
+              std::cout << "gradient: " << i->gradient(inv_sigma_sq) << " lambda: " << *(i->lambda) << std::endl;
         }
     };
 
     typedef HT::OrderedHashTable<AttribEntry, std::string> ImplBase;
 
+    // the type of the entries of a hashed model loaded for tagging
+    const char *const HASHED = "hashed";
+
     /**
      * Attributes::Impl.
      * Private hashtable implementation of the attributes object.
@@ -278,22 +376,46 @@ namespace NLP {
     class Attributes::Impl : public ImplBase, public Util::Shared {
       private:
         std::string preface;
+        std::set<std::string> type_names; //canonical type names for load_binary
         Entries::iterator e; //used for finite differences gradient checking
         Features::iterator f; //used for finite differences gradient checking
+        Feature *current; //used for finite differences gradient checking
         lbfgsfloatval_t prev_lambda; //used for finite differences gradient checking
 
+        // when set, adds only count keys in the sketch (counting), or skip
+        // keys whose estimated count is below the minimum for their type
+        const Util::CountMinSketch *sketch;
+        Util::CountMinSketch *counts;
+        const char *sketch_type;
+        uint64_t sketch_type_min;
+        uint64_t sketch_min;
+
+        // with feature hashing, the attribute entry for each of the 2^bits
+        // buckets (and one more for the transition features), and the
+        // lambdas of a hashed model loaded for tagging. The index of each
+        // entry is its bucket
+        uint64_t bits;
+        std::vector<AttribEntry *> table;
+        std::vector<lbfgsfloatval_t> lambdas;
+
       public:
         Impl(const size_t nbuckets, const size_t pool_size)
-          : ImplBase(nbuckets, pool_size), Shared(), preface(), trans_features() { }
+          : ImplBase(nbuckets, pool_size), Shared(), preface(), current(0),
+          sketch(0), counts(0), sketch_type(0), sketch_type_min(0), sketch_min(0),
+          bits(0), table(), lambdas(), trans_features() { }
         Impl(const std::string &filename, const size_t nbuckets,
             const size_t pool_size)
-          : ImplBase(nbuckets, pool_size), Shared(), preface(), trans_features() {
+          : ImplBase(nbuckets, pool_size), Shared(), preface(), current(0),
+          sketch(0), counts(0), sketch_type(0), sketch_type_min(0), sketch_min(0),
+          bits(0), table(), lambdas(), trans_features() {
           load(filename);
         }
 
         Impl(const std::string &filename, std::istream &input,
             const size_t nbuckets, const size_t pool_size) :
-          ImplBase(nbuckets, pool_size), Shared(), preface(), trans_features() {
+          ImplBase(nbuckets, pool_size), Shared(), preface(), current(0),
+          sketch(0), counts(0), sketch_type(0), sketch_type_min(0), sketch_min(0),
+          bits(0), table(), lambdas(), trans_features() {
             load(filename, input);
         }
 
@@ -312,7 +434,7 @@ namespace NLP {
         using ImplBase::find;
 
         void load_trans_features(const char *type, const std::string &str) {
-          AttribEntry *e = Base::_buckets[AttribEntry::hash(type, str).value() % Base::_nbuckets]->find(type, str);
+          AttribEntry *e = bits ? table.back() : Base::_buckets[AttribEntry::hash(type, str).value() % Base::_nbuckets]->find(type, str);
           if (e) {
             for (Features::iterator i = e->features.begin(); i != e->features.end(); ++i)
               trans_features.push_back(&(*i));
@@ -336,6 +458,84 @@ namespace NLP {
           }
         }
 
+        /**
+         * hash_keys.
+         * Switches to feature hashing, where each attribute is identified
+         * only by a hash of its type and text value into one of 2^bits
+         * buckets. No strings are stored, and the entry for a bucket is
+         * found by indexing rather than a lookup, so attributes that collide
+         * share their features. The transition features have a bucket of
+         * their own, since they are added to every context.
+         */
+        void hash_keys(const uint64_t bits) {
+          if (bits == 0 || bits > 32)
+            throw Exception("number of hash bits must be between 1 and 32");
+          this->bits = bits;
+          table.assign((1ULL << bits) + 1, static_cast<AttribEntry *>(0));
+        }
+
+        bool hashed(void) const { return bits != 0; }
+
+        uint64_t bucket(const char *type, const uint64_t hash) const {
+          if (type == Types::trans.name)
+            return table.size() - 1;
+          return (hash * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+        }
+
+        /**
+         * hashed.
+         * Returns the entry for a bucket, creating it if it does not exist.
+         */
+        AttribEntry *hashed(const uint64_t bucket, const char *type) {
+          AttribEntry *&entry = table[bucket];
+          if (!entry) {
+            entry = AttribEntry::create(Base::_pool, type, "", 0);
+            entry->index = bucket;
+            _entries.push_back(entry);
+            ++_size;
+          }
+          return entry;
+        }
+
+        /**
+         * count_keys.
+         * Makes subsequent adds count the attribute of each observation in
+         * the sketch, without storing it. NULL restores normal adds.
+         */
+        void count_keys(Util::CountMinSketch *sketch) {
+          counts = sketch;
+        }
+
+        /**
+         * filter_keys.
+         * Makes subsequent adds skip attributes whose count estimated by the
+         * sketch is less than freq for the given type, or def for any other
+         * type. Since the estimate is never below the true count, only
+         * attributes that cannot pass the same cutoffs are skipped. NULL
+         * restores normal adds.
+         */
+        void filter_keys(const Util::CountMinSketch *sketch, const char *type,
+            const uint64_t freq, const uint64_t def) {
+          this->sketch = sketch;
+          sketch_type = type;
+          sketch_type_min = freq;
+          sketch_min = def;
+        }
+
+        /**
+         * copy_key_filter.
+         * Makes subsequent adds count, filter and hash keys in the same way
+         * as another attributes object, so that a per-thread object counts
+         * exactly what the other would (and, with feature hashing, never
+         * stores the attribute strings).
+         */
+        void copy_key_filter(const Impl &other) {
+          counts = other.counts;
+          filter_keys(other.sketch, other.sketch_type, other.sketch_type_min, other.sketch_min);
+          if (other.bits && bits != other.bits)
+            hash_keys(other.bits);
+        }
+
         /**
          * _add.
          * Adds a feature to the attributes hash table.
@@ -348,7 +548,15 @@ namespace NLP {
          * that collides with the computed hash value has been added yet)
          */
         void _add(const char *type, const std::string &str, TagPair &tp) {
-          size_t bucket = AttribEntry::hash(type, str).value() % _nbuckets;
+          const uint64_t hash = AttribEntry::hash(type, str).value();
+          if (counts)
+            return counts->add(hash);
+          if (sketch && sketch->estimate(hash) < (type == sketch_type ? sketch_type_min : sketch_min))
+            return;
+          if (bits)
+            return hashed(bucket(type, hash), type)->increment(tp);
+
+          size_t bucket = hash % _nbuckets;
           AttribEntry *entry = _buckets[bucket]->find(type, str);
           if (entry)
             return entry->increment(tp);
@@ -360,6 +568,37 @@ namespace NLP {
           entry->increment(tp);
         }
 
+        /**
+         * merge.
+         * Adds the attributes and feature frequencies counted by another
+         * attributes object. New attributes are appended in the order of the
+         * other object, so merging the counts of consecutive parts of a
+         * corpus in order gives the same attributes in the same order as
+         * counting the whole corpus at once. With feature hashing, the
+         * entries are combined by bucket, which is the index of each entry
+         * of a hashed object.
+         */
+        void merge(const Impl &other) {
+          if (bits && other.bits != bits)
+            throw Exception("cannot merge attributes with a different number of hash bits");
+          for (Entries::const_iterator i = other._entries.begin(); i != other._entries.end(); ++i) {
+            const AttribEntry &src = **i;
+            if (bits) {
+              hashed(src.index, src.type)->merge(src);
+              continue;
+            }
+            size_t bucket = AttribEntry::hash(src.type, src.str).value() % _nbuckets;
+            AttribEntry *entry = _buckets[bucket]->find(src.type, src.str);
+            if (!entry) {
+              entry = AttribEntry::create(Base::_pool, src.type, src.str, _buckets[bucket]);
+              _buckets[bucket] = entry;
+              _entries.push_back(entry);
+              ++_size;
+            }
+            entry->merge(src);
+          }
+        }
+
         /**
          * add.
          * Adds an observation of a tagpair to the features on the attribute
@@ -390,9 +629,21 @@ namespace NLP {
          * that match the feature type and feature value to the context
          */
         bool find(const char *type, const std::string &str, Context &c) {
+          if (bits) {
+            AttribEntry *entry = table[bucket(type, AttribEntry::hash(type, str).value())];
+            if (!entry || entry->value == 0)
+              return false;
+            entry->add_features(c);
+            return true;
+          }
           return Base::_buckets[AttribEntry::hash(type, str).value() % Base::_nbuckets]->find(type, str, c);
         }
 
+        lbfgsfloatval_t *find_lambda(const std::string &type, const std::string &str, const TagPair &klasses) {
+          AttribEntry *entry = Base::_buckets[AttribEntry::hash(type.c_str(), str).value() % Base::_nbuckets];
+          return entry ? entry->find_lambda(type, str, klasses) : NULL;
+        }
+
         void load(const std::string &filename) {
           std::ifstream input(filename.c_str());
           if (!input)
@@ -433,15 +684,132 @@ namespace NLP {
         }
 
         /**
-         * save_features.
-         * Dumps the features to disk, sorted by attributes in decreasing
-         * frequency
+         * save_hashed.
+         * Dumps the trained features of a hashed model to disk, in order of
+         * bucket. The features file has the same format as for an ordinary
+         * model, except that the attribute id is the bucket, and there is no
+         * attributes file.
          */
-        void save_features(std::ostream &out, const std::string &preface) {
-          out << preface << '\n';
+        void save_hashed(std::ostream &features_out, const std::string &preface,
+            uint64_t &nattributes, uint64_t &nfeatures) const {
+          nattributes = nfeatures = 0;
+          features_out << preface << '\n';
+          for (size_t i = 0; i != table.size(); ++i)
+            if (table[i] && table[i]->value && table[i]->nsaved()) {
+              nfeatures += table[i]->save_features(features_out, i);
+              ++nattributes;
+            }
+        }
+
+        /**
+         * load_hashed.
+         * Loads the features of a hashed model saved by save_hashed for
+         * tagging, pointing each feature at its lambda.
+         */
+        void load_hashed(const std::string &filename, std::istream &input) {
+          uint64_t nlines = 0;
+          read_preface(filename, input, preface, nlines);
+
+          uint64_t bucket, prev, curr, freq;
+          lbfgsfloatval_t lambda;
+          while (input >> bucket >> prev >> curr >> freq >> lambda) {
+            ++nlines;
+            if (bucket >= table.size())
+              throw IOException("feature bucket is out of range for the number of hash bits", filename, nlines);
+            TagPair klasses;
+            klasses.prev = Tag(static_cast<uint16_t>(prev));
+            klasses.curr = Tag(static_cast<uint16_t>(curr));
+            AttribEntry *entry = hashed(bucket, HASHED);
+            entry->features.push_back(Feature(klasses, freq));
+            entry->value += freq;
+            lambdas.push_back(lambda);
+          }
+          if (!input.eof())
+            throw IOException("could not parse weight tuple", filename, nlines);
+
+          if (!lambdas.empty())
+            assign_lambdas(&lambdas[0]);
+        }
+
+        /**
+         * save.
+         * Dumps the trained attributes and features to disk, sorted by
+         * attributes in decreasing frequency. Only features with a non-zero
+         * lambda are saved, and attributes left without any saved features
+         * are dropped, so the attributes are renumbered as they are written.
+         * This overwrites the attributes file saved during extraction.
+         */
+        void save(std::ostream &attribs_out, std::ostream &features_out,
+            const std::string &preface, uint64_t &nattributes, uint64_t &nfeatures) const {
+          nattributes = nfeatures = 0;
+          attribs_out << preface << '\n';
+          features_out << preface << '\n';
           for (Entries::const_iterator i = _entries.begin(); i != _entries.end(); ++i)
-            if ((*i)->value)
-              (*i)->save_features(out);
+            if ((*i)->value && (*i)->nsaved()) {
+              (*i)->save_attribute(attribs_out);
+              nfeatures += (*i)->save_features(features_out, nattributes++);
+            }
+        }
+
+        /**
+         * save_binary.
+         * Writes the attributes and their features to a binary stream, in
+         * the same order as assign_lambdas. Features removed by a cutoff,
+         * and attributes without any remaining features, do not have a
+         * lambda, so they are not written.
+         */
+        void save_binary(std::ostream &out) const {
+          uint64_t nentries = 0;
+          for (Entries::const_iterator i = _entries.begin(); i != _entries.end(); ++i)
+            if ((*i)->nfeatures())
+              ++nentries;
+
+          Util::binary::write(out, nentries);
+          for (Entries::const_iterator i = _entries.begin(); i != _entries.end(); ++i) {
+            const AttribEntry &entry = **i;
+            if (!entry.nfeatures())
+              continue;
+            Util::binary::write(out, std::string(entry.type));
+            Util::binary::write(out, std::string(entry.str));
+            Util::binary::write(out, entry.value);
+            Util::binary::write(out, entry.nfeatures());
+            for (Features::const_iterator f = entry.features.begin(); f != entry.features.end(); ++f)
+              if (f->freq) {
+                Util::binary::write(out, f->klasses);
+                Util::binary::write(out, f->freq);
+              }
+          }
+        }
+
+        /**
+         * load_binary.
+         * Reads attributes and features written by save_binary. The type
+         * of each attribute is stored as a pointer to a string, so the type
+         * names are kept in a set for the lifetime of the attributes.
+         */
+        void load_binary(std::istream &in) {
+          uint64_t nentries;
+          Util::binary::read(in, nentries);
+          for (uint64_t i = 0; i < nentries; ++i) {
+            std::string type, str;
+            uint64_t value, nfeatures;
+            Util::binary::read(in, type);
+            Util::binary::read(in, str);
+            Util::binary::read(in, value);
+            Util::binary::read(in, nfeatures);
+
+            insert(type_names.insert(type).first->c_str(), str, value);
+            Features &features = _entries.back()->features;
+            features.reserve(nfeatures);
+            for (uint64_t j = 0; j < nfeatures; ++j) {
+              TagPair klasses;
+              uint64_t freq;
+              Util::binary::read(in, klasses);
+              Util::binary::read(in, freq);
+              features.push_back(Feature(klasses, freq));
+            }
+          }
+          renumber();
         }
 
         /**
@@ -504,6 +872,12 @@ namespace NLP {
             (*i)->reset_expectations();
         }
 
+        void add_expectations(const lbfgsfloatval_t *exp) {
+          size_t index = 0;
+          for (Entries::iterator i = _entries.begin(); i != _entries.end(); ++i)
+            (*i)->add_expectations(exp, index);
+        }
+
         lbfgsfloatval_t sum_lambda_sq(void) {
           lbfgsfloatval_t lambda_sq = 0.0;
           for (Entries::iterator i = _entries.begin(); i != _entries.end(); ++i)
@@ -528,6 +902,12 @@ namespace NLP {
             (*i)->copy_gradients(x, inv_sigma_sq, index);
         }
 
+        void copy_klasses(TagPair *x) const {
+          size_t index = 0;
+          for (Entries::const_iterator i = _entries.begin(); i != _entries.end(); ++i)
+            (*i)->copy_klasses(x, index);
+        }
+
         /**
          * inc_next_lambda.
          * Increments the next feature lambda by val. Restores the previously
@@ -535,21 +915,25 @@ namespace NLP {
          * difference empirical gradient check.
          */
         bool inc_next_lambda(lbfgsfloatval_t val) {
-          if (e == _entries.end() && (f+1) == (*e)->features.end()) {
-            *(f->lambda) = prev_lambda;
-            return false;
-          }
-          else if (++f != (*e)->features.begin()) {
-            *((f-1)->lambda) = prev_lambda;
+          if (current)
+            *(current->lambda) = prev_lambda;
+          current = 0;
+
+          while (e != _entries.end()) {
             if (f == (*e)->features.end()) {
-              if (++e == _entries.end())
-                return false;
-              f = (*e)->features.begin();
+              if (++e != _entries.end())
+                f = (*e)->features.begin();
+              continue;
+            }
+            Feature &next = *f++;
+            if (next.lambda) {
+              current = &next;
+              prev_lambda = *(current->lambda);
+              *(current->lambda) += val;
+              return true;
             }
           }
-          prev_lambda = *(f->lambda);
-          *(f->lambda) += val;
-          return true;
+          return false;
         }
 
         /**
@@ -559,7 +943,8 @@ namespace NLP {
          */
         void prep_finite_differences(void) {
           e = _entries.begin();
-          f = (*e)->features.begin() - 1;
+          f = (*e)->features.begin();
+          current = 0;
         }
 
         /**
@@ -568,11 +953,11 @@ namespace NLP {
          * checked.
          */
         void print_current_gradient(lbfgsfloatval_t val, lbfgsfloatval_t inv_sigma_sq) {
-          lbfgsfloatval_t gradient = f->gradient(inv_sigma_sq);
+          lbfgsfloatval_t gradient = current->gradient(inv_sigma_sq);
           if (std::abs(gradient - val) >= 1.0e-2) {
-            std::cout << "freq: " << f->freq << " exp: " << f->exp;
-            std::cout << " lambda: " << prev_lambda << " gradient: " << f->gradient(inv_sigma_sq);
-            std::cout << " estimated gradient: " << val << " <" << f->klasses.prev << ' ' << f->klasses.curr << "> " << (*e)->str <<  std::endl;
+            std::cout << "freq: " << current->freq << " exp: " << current->exp;
+            std::cout << " lambda: " << prev_lambda << " gradient: " << current->gradient(inv_sigma_sq);
+            std::cout << " estimated gradient: " << val << " <" << current->klasses.prev << ' ' << current->klasses.curr << "> " << (*e)->str <<  std::endl;
           }
         }
 
@@ -604,27 +989,60 @@ namespace NLP {
     void Attributes::load(const std::string &filename, std::istream &input) { _impl->load(filename, input); }
 
     void Attributes::save_attributes(const std::string &filename, const std::string &preface) {
+      if (hashed())
+        return;
       std::ofstream out(filename.c_str());
       if (!out)
         throw IOException("unable to open file for writing", filename);
       _impl->save_attributes(out, preface);
     }
 
-    void Attributes::save_features(const std::string &filename, const std::string &preface) {
-      std::ofstream out(filename.c_str());
-      if (!out)
-        throw IOException("unable to open file for writing", filename);
-      _impl->save_features(out, preface);
+    void Attributes::save(const std::string &attribs_file, const std::string &features_file,
+        const std::string &preface, uint64_t &nattributes, uint64_t &nfeatures) {
+      if (hashed()) {
+        std::ofstream features_out(features_file.c_str());
+        if (!features_out)
+          throw IOException("unable to open file for writing", features_file);
+        return _impl->save_hashed(features_out, preface, nattributes, nfeatures);
+      }
+      std::ofstream attribs_out(attribs_file.c_str());
+      if (!attribs_out)
+        throw IOException("unable to open file for writing", attribs_file);
+      std::ofstream features_out(features_file.c_str());
+      if (!features_out)
+        throw IOException("unable to open file for writing", features_file);
+      _impl->save(attribs_out, features_out, preface, nattributes, nfeatures);
     }
 
-    void Attributes::save_attributes(std::ostream &out, const std::string &preface) { _impl->save_attributes(out, preface); }
-    void Attributes::save_features(std::ostream &out, const std::string &preface) { _impl->save_features(out, preface); }
+    void Attributes::save_attributes(std::ostream &out, const std::string &preface) {
+      if (!hashed())
+        _impl->save_attributes(out, preface);
+    }
+    void Attributes::save_binary(std::ostream &out) const { _impl->save_binary(out); }
+    void Attributes::load_binary(std::istream &in) { _impl->load_binary(in); }
 
     void Attributes::operator()(const char *type, const std::string &str, TagPair &tp, const bool add_state_feature, const bool add_trans_feature) { _impl->add(type, str, tp, add_state_feature, add_trans_feature); }
     void Attributes::operator()(const char *type, const std::string &str, Context &c) { _impl->find(type, str, c); }
+    void Attributes::merge(const Attributes &other) { _impl->merge(*other._impl); }
+    void Attributes::hash_keys(const uint64_t bits) { _impl->hash_keys(bits); }
+    bool Attributes::hashed(void) const { return _impl->hashed(); }
+
+    void Attributes::load_hashed(const std::string &filename) {
+      std::ifstream in(filename.c_str());
+      if (!in)
+        throw IOException("could not open file", filename);
+      _impl->load_hashed(filename, in);
+    }
+
+    void Attributes::count_keys(Util::CountMinSketch *sketch) { _impl->count_keys(sketch); }
+    void Attributes::filter_keys(const Util::CountMinSketch *sketch, const Type &type, const uint64_t freq, const uint64_t def) { _impl->filter_keys(sketch, type.name, freq, def); }
+    void Attributes::copy_key_filter(const Attributes &other) { _impl->copy_key_filter(*other._impl); }
+    lbfgsfloatval_t *Attributes::find_lambda(const std::string &type, const std::string &str, const TagPair &klasses) { return _impl->find_lambda(type, str, klasses); }
 
     void Attributes::sort_by_freq(void) { _impl->sort_by_rev_value(); }
     void Attributes::reset_expectations(void) { _impl->reset_expectations(); }
+    void Attributes::add_expectations(const lbfgsfloatval_t *exp) { _impl->add_expectations(exp); }
+    void Attributes::copy_klasses(TagPair *x) const { _impl->copy_klasses(x); }
 
     uint64_t Attributes::nfeatures(void) const { return _impl->nfeatures(); }
 
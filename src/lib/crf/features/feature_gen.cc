@@ -41,11 +41,10 @@ void TransGen::operator()(const Type &type, Attributes &attributes, Sentence &se
 
 void TransGen::operator()(const Type &type, Attributes &attributes, Sentence &sent, Context &c, int i) {
   // load the trans features into one vector in attributes rather than
-  // wastefully add feature pointers to every single context
-  if (!trans_loaded) {
+  // wastefully add feature pointers to every single context. Contexts may
+  // be built on several threads, so only the first caller loads them
+  if (!trans_loaded && Util::compare_and_swap(trans_loaded, false, true))
     attributes.load_trans_features(type.name, name);
-    trans_loaded = true;
-  }
 }
 
 void TransGen::operator()(const Type &type, Sentence &sent, PDFs &dist, int i) {
@@ -182,26 +181,28 @@ void SuffixGen::operator()(const Type &type, Sentence &sent, PDFs &dist, int i)
 }
 
 ShapeGen::ShapeGen(AffixDict &dict, const bool add_state, const bool add_trans)
-  : FeatureGen(add_state, add_trans), dict(dict), shape() { }
+  : FeatureGen(add_state, add_trans), dict(dict) { }
 
 Attribute &ShapeGen::load(const Type &type, std::istream &in) {
   return dict.load(type, in);
 }
 
+// feature extraction and tagging may run on several threads, so each call
+// uses a temporary Shape rather than a buffer shared between threads
 void ShapeGen::operator()(const Type &type, Attributes &attributes, Sentence &sent, TagPair tp, int i) {
-  attributes(type.name, shape(sent.words[i]), tp, _add_state, _add_trans);
+  attributes(type.name, Shape()(sent.words[i]), tp, _add_state, _add_trans);
 }
 
 void ShapeGen::operator()(const Type &type, Attributes &attributes, Sentence &sent, Context &c, int i) {
-  attributes(type.name, shape(sent.words[i]), c);
+  attributes(type.name, Shape()(sent.words[i]), c);
 }
 
 void ShapeGen::operator()(const Type &type, Sentence &sent, PDFs &dist, int i) {
-  _add_features(dict.get(type, shape(sent.words[i])), dist);
+  _add_features(dict.get(type, Shape()(sent.words[i])), dist);
 }
 
 OffsetShapeGen::OffsetShapeGen(AffixDict &dict, const int offset, const bool add_state, const bool add_trans)
-  : OffsetGen(offset, add_state, add_trans), dict(dict), shape() { }
+  : OffsetGen(offset, add_state, add_trans), dict(dict) { }
 
 Attribute &OffsetShapeGen::load(const Type &type, std::istream &in) {
   return dict.load(type, in);
@@ -210,19 +211,19 @@ Attribute &OffsetShapeGen::load(const Type &type, std::istream &in) {
 void OffsetShapeGen::operator()(const Type &type, Attributes &attributes, Sentence &sent, TagPair tp, int i) {
   const Raw *raw = _get_raw(sent.words, i);
   if (raw != &Sentinel::str)
-    attributes(type.name, shape(*raw), tp, _add_state, _add_trans);
+    attributes(type.name, Shape()(*raw), tp, _add_state, _add_trans);
 }
 
 void OffsetShapeGen::operator()(const Type &type, Attributes &attributes, Sentence &sent, Context &c, int i) {
   const Raw *raw = _get_raw(sent.words, i);
   if (raw != &Sentinel::str)
-    attributes(type.name, shape(*raw), c);
+    attributes(type.name, Shape()(*raw), c);
 }
 
 void OffsetShapeGen::operator()(const Type &type, Sentence &sent, PDFs &dist, int i) {
   const Raw *raw = _get_raw(sent.words, i);
   if (raw != &Sentinel::str)
-    _add_features(dict.get(type, shape(*raw)), dist);
+    _add_features(dict.get(type, Shape()(*raw)), dist);
 }
 
 PosGen::PosGen(TagSetDict &dict, const bool add_state, const bool add_trans)
@@ -214,6 +214,30 @@ namespace NLP {
               (*e->gen)(e->type, sent, dist, i);
           }
         }
+
+        /**
+         * add_features.
+         * Adds the lambdas of active features for a sentence to a
+         * probability distribution using a hashed model. The features are
+         * found by running the generators in the same way as when building
+         * the training contexts, so no feature dictionaries are used. The
+         * transition features are added at every position after the first.
+         */
+        void add_features(Attributes &attributes, Lexicon lexicon, Sentence &sent, PDFs &dist, int i) {
+          Context c;
+          for (Entries::iterator j = _actives.begin(); j != _actives.end(); ++j) {
+            RegEntry *e = *j;
+            if (!(e->rare) || lexicon.freq(sent.words[i]) < rare_cutoff)
+              (*e->gen)(e->type, attributes, sent, c, i);
+          }
+          for (FeaturePtrs::iterator j = c.features.begin(); j != c.features.end(); ++j)
+            dist[(*j)->klasses.prev][(*j)->klasses.curr] += *(*j)->lambda;
+          if (i > 0) {
+            FeaturePtrs &trans = attributes.trans_features();
+            for (FeaturePtrs::iterator j = trans.begin(); j != trans.end(); ++j)
+              dist[(*j)->klasses.prev][(*j)->klasses.curr] += *(*j)->lambda;
+          }
+        }
     };
 
     Registry::Registry(const uint64_t rare_cutoff, const size_t nbuckets, const size_t pool_size) :
@@ -243,5 +267,9 @@ namespace NLP {
       _impl->add_features(lexicon, sent, dist, i);
     }
 
+    void Registry::add_features(Attributes &attributes, Lexicon lexicon, Sentence &sent, PDFs &dist, int i) {
+      _impl->add_features(attributes, lexicon, sent, dist, i);
+    }
+
   }
 }
@@ -9,9 +9,9 @@
 #include "prob.h"
 #include "tagset.h"
 #include "taglimits.h"
+#include "tagdict.h"
 #include "vector.h"
 #include "factor.h"
-#include "crf/nodepool.h"
 #include "crf/lattice.h"
 #include "crf/state.h"
 #include "crf/features.h"
@@ -29,23 +29,10 @@ class NER::Impl : public Tagger::Impl {
   protected:
     typedef Tagger::Impl Base;
 
-    virtual void run_tag(Reader &reader, Writer &writer) {
-      load();
-      Sentence sent;
-      State state(tags.size());
-
-      while (reader.next(sent)) {
-        tag(state, sent);
-        writer.next(sent);
-        sent.reset();
-        state.reset();
-      }
-    }
-
     virtual void tag(State &state, Sentence &sent) {
       for (size_t i = 0; i < sent.size(); ++i) {
-        registry.add_features(lexicon, sent, state.dist, i);
-        state.lattice.viterbi(tags, state.dist);
+        add_features(sent, state.dist, i);
+        state.lattice.viterbi(tags, state.dist, candidates(sent, i));
         state.next_word();
       }
       //state.lattice.print(std::cout, tags, sent.size());
@@ -78,24 +65,12 @@ class NER::Impl : public Tagger::Impl {
     }
 
     virtual void _pass2(Reader &reader) {
-      Sentence sent;
-      Contexts contexts; //not used in this pass
-      while (reader.next(sent)) {
-        registry.generate(attributes, lexicon, tags, sent, chains, contexts, true);
-        sent.reset();
-      }
-
+      count_attributes(reader);
       attributes.save_attributes(cfg.attributes(), preface);
     }
 
     virtual void _pass3(Reader &reader, Instances &instances) {
-      Sentence sent;
-      while (reader.next(sent)) {
-        Contexts contexts(sent.words.size());
-        instances.push_back(contexts);
-        registry.generate(attributes, lexicon, tags, sent, chains, instances.back(), false);
-        sent.reset();
-      }
+      build_instances(reader, instances);
     }
 
     virtual void reg(void) {
@@ -9,9 +9,9 @@
 #include "prob.h"
 #include "tagset.h"
 #include "taglimits.h"
+#include "tagdict.h"
 #include "vector.h"
 #include "factor.h"
-#include "crf/nodepool.h"
 #include "crf/lattice.h"
 #include "crf/state.h"
 #include "crf/features.h"
@@ -33,19 +33,70 @@ lbfgsfloatval_t Tagger::Impl::duration_m(void) {
   return (clock() - clock_begin) / (60.0 * CLOCKS_PER_SEC);
 }
 
-void Tagger::Impl::reset(const size_t size) {
+/**
+ * Buffers::init.
+ * Allocates the working vectors. Each one is prepopulated to the size of the
+ * longest sentence seen in the training data to avoid the overhead of extra
+ * memory allocations during training
+ */
+void Tagger::Impl::Buffers::init(const size_t ntags, const size_t max_size,
+    const size_t nfeatures) {
+  trans_marginals.resize(ntags, ntags);
+  trans.resize(ntags, ntags);
+  trans_t.resize(ntags, ntags);
+  alphas.resize(max_size, ntags);
+  betas.resize(max_size, ntags);
+  state_marginals.resize(max_size, ntags);
+  states.resize(max_size, ntags);
+  scale.resize(max_size, 1.0);
+  exp.resize(nfeatures, 0.0);
+}
+
+/**
+ * Buffers::init_psis.
+ * Allocates the full per-position activation matrices, which are only needed
+ * for loopy belief propagation over the factor graph.
+ */
+void Tagger::Impl::Buffers::init_psis(const size_t ntags, const size_t max_size) {
+  psis.resize(max_size, ntags, ntags);
+}
+
+/**
+ * Buffers::init_hessian.
+ * Allocates the directional derivatives of the forward-backward algorithm,
+ * which are only needed for the Hessian-vector products of TRON.
+ */
+void Tagger::Impl::Buffers::init_hessian(const size_t ntags, const size_t max_size) {
+  dstates.resize(max_size, ntags);
+  dalphas.resize(max_size, ntags);
+  dbetas.resize(max_size, ntags);
+  dtrans.resize(ntags, ntags);
+  dpsi.resize(ntags, ntags);
+}
+
+/**
+ * Buffers::reset.
+ * Zeroes the working vectors for the first size positions before processing
+ * a training instance of that size.
+ */
+void Tagger::Impl::Buffers::reset(const size_t size) {
   std::fill(scale.begin(), scale.begin() + size, 1.0);
 
-  for (size_t i = 0; i < ntags; ++i)
-    std::fill(trans_marginals[i].begin(), trans_marginals[i].end(), 0.0);
+  trans_marginals.fill(0.0);
+  alphas.fill(size, 0.0);
+  betas.fill(size, 0.0);
+  state_marginals.fill(size, 0.0);
+  states.fill(size, 0.0);
+  psis.fill(std::min(size, psis.size()), 0.0);
+}
 
-  for (size_t i = 0; i < size; ++i) {
-    std::fill(alphas[i].begin(), alphas[i].end(), 0.0);
-    std::fill(betas[i].begin(), betas[i].end(), 0.0);
-    std::fill(state_marginals[i].begin(), state_marginals[i].end(), 0.0);
-    for (size_t j = 0; j < psis[i].size(); ++j)
-      std::fill(psis[i][j].begin(), psis[i][j].end(), 0.0);
-  }
+/**
+ * Buffers::reset_expectations.
+ * Zeroes the accumulated feature expectations and log partition function.
+ */
+void Tagger::Impl::Buffers::reset_expectations(void) {
+  std::fill(exp.begin(), exp.end(), 0.0);
+  log_z = 0.0;
 }
 
 /**
@@ -57,24 +108,24 @@ void Tagger::Impl::reset(const size_t size) {
  *
  * State features (previous_tag = None::val) are uniformly added to every
  * (x, current_tag) for each tag x
+ *
+ * This builds the full (ntags * ntags) matrix for a position, which is only
+ * required for loopy belief propagation. The forward-backward algorithm uses
+ * the factorized potentials from compute_states and compute_trans instead
  */
-void Tagger::Impl::compute_psis(Context &context, PDFs &dist, lbfgsfloatval_t decay) {
-  //TODO profiling shows that this is the bottleneck in training
-  //(50% of training time!)
-  FeaturePtrs &trans_features = attributes.trans_features();
-
-  for (size_t j = 0; j != context.features.size(); ++j) {
-    Feature &f = *context.features[j];
-    dist[f.klasses.prev][f.klasses.curr] += *(f.lambda);
-    if (f.klasses.prev == None::val)
+void Tagger::Impl::compute_psis(const Instance &instance, const size_t i, PDFs &dist, lbfgsfloatval_t decay) {
+  for (const uint32_t *j = instance.begin(i); j != instance.end(i); ++j) {
+    const TagPair &klasses = feature_klasses[*j];
+    dist[klasses.prev][klasses.curr] += lambdas[*j];
+    if (klasses.prev == None::val)
       for (Tag prev = 1; prev < ntags; ++prev)
-        dist[prev][f.klasses.curr] += *(f.lambda);
+        dist[prev][klasses.curr] += lambdas[*j];
   }
 
-  if (context.index > 0) {
-    for (size_t j = 0; j != trans_features.size(); ++j) {
-      Feature &f = *trans_features[j];
-      dist[f.klasses.prev][f.klasses.curr] += *(f.lambda);
+  if (i > 0) {
+    for (size_t j = 0; j != trans_ids.size(); ++j) {
+      const TagPair &klasses = feature_klasses[trans_ids[j]];
+      dist[klasses.prev][klasses.curr] += lambdas[trans_ids[j]];
     }
   }
 
@@ -93,16 +144,151 @@ void Tagger::Impl::compute_psis(Context &context, PDFs &dist, lbfgsfloatval_t de
 
 /**
  * compute_psis.
- * Iterate through contexts, computing the activation values for each one.
+ * Iterate through the positions of an instance, computing the activation
+ * values for each one.
+ */
+void Tagger::Impl::compute_psis(const Instance &instance, PSIs &psis, lbfgsfloatval_t decay) {
+  for (size_t i = 0; i < instance.size(); ++i)
+    compute_psis(instance, i, psis[i], decay);
+}
+
+/**
+ * compute_states.
+ * Iterate through the state features active at position i, adding the
+ * weight for each feature to the distribution over the current tag, and
+ * exponentiate the summed distribution, scaling by a decay factor for SGD.
+ *
+ * The activation value for a transition from tag t to tag u at position i is
+ * factorized as states[i][u] * trans[t][u], so only the O(ntags) state part
+ * is computed per position. Features active at a position that condition on
+ * the previous tag are not part of the linear chain potentials
+ *
+ * If position i is restricted to a set of candidate tags by the tag
+ * dictionary, the activation of every other tag is zero, which removes it
+ * from the lattice. Only the candidates are exponentiated.
+ */
+void Tagger::Impl::compute_states(const Instance &instance, const size_t i, lbfgsfloatval_t *dist, const lbfgsfloatval_t *weights, lbfgsfloatval_t decay) {
+  for (const uint32_t *j = instance.begin(i); j != instance.end(i); ++j) {
+    const TagPair &klasses = feature_klasses[*j];
+    if (klasses.prev == None::val)
+      dist[klasses.curr] += weights[*j];
+  }
+
+  const uint16_t *candidate = instance.candidate_begin(i);
+  const uint16_t *end = instance.candidate_end(i);
+  if (candidate != end) {
+    for (Tag curr = 0; curr < ntags; ++curr) {
+      if (candidate == end || *candidate != curr)
+        dist[curr] = 0.0;
+      else {
+        ++candidate;
+        if (dist[curr] == 0)
+          dist[curr] = 1;
+        else
+#ifdef FASTEXP
+          dist[curr] = fastexp(dist[curr] * decay);
+#else
+          dist[curr] = std::exp(dist[curr] * decay);
+#endif
+      }
+    }
+    return;
+  }
+
+  for (Tag curr = 0; curr < ntags; ++curr) {
+    if (dist[curr] == 0)
+      dist[curr] = 1;
+    else
+#ifdef FASTEXP
+      dist[curr] = fastexp(dist[curr] * decay);
+#else
+      dist[curr] = std::exp(dist[curr] * decay);
+#endif
+  }
+}
+
+/**
+ * compute_states.
+ * Iterate through the positions of an instance, computing the state
+ * activation values for each one from the given weights.
  */
-void Tagger::Impl::compute_psis(Contexts &contexts, PSIs &psis, lbfgsfloatval_t decay) {
-  for (size_t i = 0; i < contexts.size(); ++i)
-    compute_psis(contexts[i], psis[i], decay);
+void Tagger::Impl::compute_states(const Instance &instance, PDFs &states, const lbfgsfloatval_t *weights, lbfgsfloatval_t decay) {
+  for (size_t i = 0; i < instance.size(); ++i)
+    compute_states(instance, i, states[i], weights, decay);
+}
+
+void Tagger::Impl::compute_states(const Instance &instance, PDFs &states, lbfgsfloatval_t decay) {
+  compute_states(instance, states, lambdas, decay);
+}
+
+/**
+ * compute_trans.
+ * Computes the exponentiated transition activation values from the given
+ * weights, scaling by a decay factor for SGD. Transition features are the
+ * same at every position after the first, so this only needs to be done
+ * once per evaluation rather than once per token.
+ */
+void Tagger::Impl::compute_trans(Buffers &b, const lbfgsfloatval_t *weights, lbfgsfloatval_t decay) {
+  PDFs &trans = b.trans;
+  PDFs &trans_t = b.trans_t;
+  trans.fill(0.0);
+
+  for (size_t j = 0; j != trans_ids.size(); ++j) {
+    const TagPair &klasses = feature_klasses[trans_ids[j]];
+    trans[klasses.prev][klasses.curr] += weights[trans_ids[j]];
+  }
+
+  for (Tag prev = 0; prev < ntags; ++prev)
+    for (Tag curr = 0; curr < ntags; ++curr) {
+      if (trans[prev][curr] == 0)
+        trans[prev][curr] = 1;
+      else
+#ifdef FASTEXP
+        trans[prev][curr] = fastexp(trans[prev][curr] * decay);
+#else
+        trans[prev][curr] = std::exp(trans[prev][curr] * decay);
+#endif
+      trans_t[curr][prev] = trans[prev][curr];
+    }
+}
+
+void Tagger::Impl::compute_trans(Buffers &b, lbfgsfloatval_t decay) {
+  compute_trans(b, lambdas, decay);
+}
+
+namespace {
+
+  /**
+   * candidate_dot.
+   * The dot product of x and y over the candidate tags in [begin, end).
+   */
+  inline lbfgsfloatval_t candidate_dot(const lbfgsfloatval_t *x,
+      const lbfgsfloatval_t *y, const uint16_t *begin, const uint16_t *end) {
+    lbfgsfloatval_t sum = 0.0;
+    for ( ; begin != end; ++begin)
+      sum += x[*begin] * y[*begin];
+    return sum;
+  }
+
+  /**
+   * candidate_dot3.
+   * The three way dot product of x, y and z over the candidate tags in
+   * [begin, end).
+   */
+  inline lbfgsfloatval_t candidate_dot3(const lbfgsfloatval_t *x,
+      const lbfgsfloatval_t *y, const lbfgsfloatval_t *z,
+      const uint16_t *begin, const uint16_t *end) {
+    lbfgsfloatval_t sum = 0.0;
+    for ( ; begin != end; ++begin)
+      sum += x[*begin] * y[*begin] * z[*begin];
+    return sum;
+  }
+
 }
 
 /**
  * compute_expectations.
- * Iterate through contexts, computing the expected values of each feature
+ * Iterate through an instance, computing the expected values of each feature
  *
  * The expected value of a state feature is the sum over each occurence of the
  * feature of alpha[i][tag] * beta[i][tag] * (1.0 / scale[i]), where i is the
@@ -111,46 +297,79 @@ void Tagger::Impl::compute_psis(Contexts &contexts, PSIs &psis, lbfgsfloatval_t
  * The expected value of a transition feature is the sum over each occurence of
  * the feature of alpha[i-1][prev] * activation[i][prev][curr] * beta[i][curr],
  * where i is the current position, prev is the previous gold tag, and curr
- * is the current gold tag
+ * is the current gold tag. The activation is the product of the state
+ * activation states[i][curr] and the transition activation trans[prev][curr]
+ * (positions after the first only)
+ *
+ * Tags outside the candidates of a pruned position have zero alpha, so only
+ * the transition features between the candidates at i-1 and i are visited,
+ * through trans_index.
  */
-void Tagger::Impl::compute_expectations(Contexts &c) {
-  FeaturePtrs &trans_features = attributes.trans_features();
+void Tagger::Impl::compute_expectations(const Instance &c, Buffers &b) {
+  PDFs &trans = b.trans;
+  PDFs &alphas = b.alphas;
+  PDFs &betas = b.betas;
+  PDFs &states = b.states;
+  PDF &scale = b.scale;
+  PDF &exp = b.exp;
 
   for (size_t i = 0; i < c.size(); ++i) {
     lbfgsfloatval_t inv_scale = (1.0 / scale[i]);
-    for (size_t j = 0; j < c[i].features.size(); ++j) {
-      Feature &f = *(c[i].features[j]);
-      TagPair &klasses = f.klasses;
+    for (const uint32_t *j = c.begin(i); j != c.end(i); ++j) {
+      const TagPair &klasses = feature_klasses[*j];
       if (klasses.prev == None::val || klasses.prev.type() != klasses.curr.type()) { //state feature
         lbfgsfloatval_t alpha = alphas[i][klasses.curr];
         lbfgsfloatval_t beta = betas[i][klasses.curr];
-        f.exp += alpha * beta * inv_scale;
+        exp[*j] += alpha * beta * inv_scale;
       }
       else {
         //trans feature
         //FIXME TODO WARNING for some reason, trans features that look
         //further than 1 word back don't work
-        lbfgsfloatval_t alpha = (i > 0) ? alphas[i-1][klasses.prev] : 1.0;
+        lbfgsfloatval_t alpha = (i > 0) ? alphas[i-1][klasses.prev] * trans[klasses.prev][klasses.curr] : 1.0;
         lbfgsfloatval_t beta = betas[i][klasses.curr];
-        f.exp += alpha * psis[i][klasses.prev][klasses.curr] * beta;
+        exp[*j] += alpha * states[i][klasses.curr] * beta;
       }
     }
 
-    if (i > 0) {
-      for (size_t j = 0; j < trans_features.size(); ++j) {
-        Feature &f = *trans_features[j];
-        TagPair &klasses = f.klasses;
+    if (i == 0)
+      continue;
+
+    const uint16_t *prev_begin = c.candidate_begin(i - 1);
+    const uint16_t *prev_end = c.candidate_end(i - 1);
+    const uint16_t *curr_begin = c.candidate_begin(i);
+    const uint16_t *curr_end = c.candidate_end(i);
+    if (prev_begin == prev_end && curr_begin == curr_end) {
+      for (size_t j = 0; j < trans_ids.size(); ++j) {
+        const TagPair &klasses = feature_klasses[trans_ids[j]];
         lbfgsfloatval_t alpha = alphas[i-1][klasses.prev];
-        lbfgsfloatval_t beta = betas[i][klasses.curr];
-        f.exp += alpha * psis[i][klasses.prev][klasses.curr] * beta;
+        lbfgsfloatval_t beta = betas[i][klasses.curr] * states[i][klasses.curr];
+        exp[trans_ids[j]] += alpha * trans[klasses.prev][klasses.curr] * beta;
       }
+      continue;
+    }
+
+    if (prev_begin == prev_end) {
+      prev_begin = &all_klasses[0];
+      prev_end = prev_begin + all_klasses.size();
+    }
+    if (curr_begin == curr_end) {
+      curr_begin = &all_klasses[0];
+      curr_end = curr_begin + all_klasses.size();
+    }
+    for (const uint16_t *prev = prev_begin; prev != prev_end; ++prev) {
+      const lbfgsfloatval_t alpha = alphas[i-1][*prev];
+      const int64_t *ids = &trans_index[*prev * ntags];
+      for (const uint16_t *curr = curr_begin; curr != curr_end; ++curr)
+        if (ids[*curr] >= 0)
+          exp[ids[*curr]] += alpha * trans[*prev][*curr] * betas[i][*curr] * states[i][*curr];
     }
   }
 }
 
 /**
  * compute_expectations_from_marginals.
- * Iterate through contexts, computing the expected values of each feature
+ * Iterate through an instance, computing the expected values of each feature
  *
  * The expected value of a state feature is the sum over each occurence of the
  * feature of p(i, tag), where i is the current position and tag is the
@@ -160,29 +379,29 @@ void Tagger::Impl::compute_expectations(Contexts &c) {
  * of the feature of p(prev, curr, i-1, i) where i is the current position,
  * prev is the previous gold tag, and curr is the current gold tag
  */
-void Tagger::Impl::compute_expectations_from_marginals(Contexts &c) {
-  FeaturePtrs &trans_features = attributes.trans_features();
+void Tagger::Impl::compute_expectations_from_marginals(const Instance &c, Buffers &b) {
+  PDFs &state_marginals = b.state_marginals;
+  PDFs &trans_marginals = b.trans_marginals;
+  PDF &exp = b.exp;
 
   for (size_t i = 0; i < c.size(); ++i) {
-    for (size_t j = 0; j < c[i].features.size(); ++j) {
-      Feature &f = *(c[i].features[j]);
-      TagPair &klasses = f.klasses;
+    for (const uint32_t *j = c.begin(i); j != c.end(i); ++j) {
+      const TagPair &klasses = feature_klasses[*j];
       if (klasses.prev == None::val) { //state feature
-        f.exp += state_marginals[i][klasses.curr];
+        exp[*j] += state_marginals[i][klasses.curr];
       }
       else {
         //trans feature
         //FIXME TODO WARNING for some reason, trans features that look
         //further than 1 word back don't work
-        f.exp += trans_marginals[klasses.prev][klasses.curr];
+        exp[*j] += trans_marginals[klasses.prev][klasses.curr];
       }
     }
 
     if (i > 0) {
-      for (size_t j = 0; j < trans_features.size(); ++j) {
-        Feature &f = *trans_features[j];
-        TagPair &klasses = f.klasses;
-        f.exp += trans_marginals[klasses.prev][klasses.curr];
+      for (size_t j = 0; j < trans_ids.size(); ++j) {
+        const TagPair &klasses = feature_klasses[trans_ids[j]];
+        exp[trans_ids[j]] += trans_marginals[klasses.prev][klasses.curr];
       }
     }
   }
@@ -212,12 +431,31 @@ void Tagger::Impl::compute_expectations_from_marginals(Contexts &c) {
  * scale[i] = 1.0 / (sum (over tags t) [alpha[i][t]])
  * alpha'[i][tag] = alpha[i][tag] * scale[i]
  *
+ * The activation is factorized into state and transition parts, so
+ * alpha[i][tag] = states[i][tag] * sum (over p) [alpha'[i-1][p] * trans[p][tag]]
+ *
+ * The sum over p is a dot product of alpha'[i-1] with a column of trans,
+ * which is read as a row of the transposed matrix trans_t. The dot products,
+ * the multiplication by the state activations and the scaling all use the
+ * vectorized kernels.
+ *
+ * At a position pruned by the tag dictionary, alpha is only computed for
+ * the candidate tags (the rest stay zero), and the sum over p only runs
+ * over the candidates of a pruned previous position.
+ *
+ * Returns the log partition function of the instance.
  */
-void Tagger::Impl::forward(Contexts &contexts, PDFs &alphas, PSIs &psis, PDF &scale) {
+lbfgsfloatval_t Tagger::Impl::forward(const Instance &instance, Buffers &b) {
+  const Util::simd::Kernels &k = *kernels;
+  PDFs &alphas = b.alphas;
+  PDFs &states = b.states;
+  PDFs &trans_t = b.trans_t;
+  PDF &scale = b.scale;
+  const size_t n = ntags - 2;
   lbfgsfloatval_t sum = 0.0;
 
   for (Tag curr(2); curr < ntags; ++curr) {
-    lbfgsfloatval_t val = psis[0][Sentinel::val][curr];
+    lbfgsfloatval_t val = states[0][curr];
     alphas[0][curr] = val;
     sum += val;
     //std::cout << tags.str(curr) << ' ' << val << ' ' << sum << std::endl;
@@ -225,19 +463,35 @@ void Tagger::Impl::forward(Contexts &contexts, PDFs &alphas, PSIs &psis, PDF &sc
   if (sum == 0.0)
     sum = 1.0;
   scale[0] = 1.0 / sum;
-  vector_scale(alphas[0], scale[0], ntags);
+  k.scale(alphas[0], scale[0], ntags);
   //vector_print(alphas[0], ntags);
   //std::cout << "sum: " << sum << std::endl;
   //std::cout << "scale: " << scale[0] << std::endl;
 
-  for (size_t i = 1; i < contexts.size(); ++i) {
-    sum = 0.0;
-    for (Tag curr(2); curr < ntags; ++curr) {
-      for (Tag prev(2); prev < ntags; ++prev) {
-        lbfgsfloatval_t val = alphas[i-1][prev] * psis[i][prev][curr];
-        //std::cout << tags.str(prev) << ' ' << tags.str(curr) << ' ' << alphas[i-1][prev] << ' ' << psis[i][prev][curr] << ' ' << val << std::endl;
-        alphas[i][curr] += val;
-        sum += val;
+  for (size_t i = 1; i < instance.size(); ++i) {
+    const lbfgsfloatval_t *prev = alphas[i-1] + 2;
+    lbfgsfloatval_t *curr = alphas[i];
+    const uint16_t *prev_begin = instance.candidate_begin(i - 1);
+    const uint16_t *prev_end = instance.candidate_end(i - 1);
+    const uint16_t *curr_begin = instance.candidate_begin(i);
+    const uint16_t *curr_end = instance.candidate_end(i);
+    if (curr_begin == curr_end) {
+      if (prev_begin == prev_end)
+        for (Tag tag(2); tag < ntags; ++tag)
+          curr[tag] = k.dot(trans_t[tag] + 2, prev, n);
+      else
+        for (Tag tag(2); tag < ntags; ++tag)
+          curr[tag] = candidate_dot(trans_t[tag], alphas[i-1], prev_begin, prev_end);
+      sum = k.mul_sum(curr + 2, states[i] + 2, n);
+    }
+    else {
+      sum = 0.0;
+      for (const uint16_t *tag = curr_begin; tag != curr_end; ++tag) {
+        if (prev_begin == prev_end)
+          curr[*tag] = k.dot(trans_t[*tag] + 2, prev, n) * states[i][*tag];
+        else
+          curr[*tag] = candidate_dot(trans_t[*tag], alphas[i-1], prev_begin, prev_end) * states[i][*tag];
+        sum += curr[*tag];
       }
     }
     if (sum == 0.0)
@@ -246,10 +500,10 @@ void Tagger::Impl::forward(Contexts &contexts, PDFs &alphas, PSIs &psis, PDF &sc
     //std::cout << "sum: " << sum << std::endl;
     //std::cout << "scale: " << scale[i] << std::endl;
     //vector_print(alphas[i], ntags);
-    vector_scale(alphas[i], scale[i], ntags);
+    k.scale(curr, scale[i], ntags);
   }
-  log_z += -vector_sum_log(scale, contexts.size());
-  //std::cout << "scale Z: " << -vector_sum_log(scale, contexts.size()) << std::endl;
+  //std::cout << "scale Z: " << -vector_sum_log(scale, instance.size()) << std::endl;
+  return -vector_sum_log(scale, instance.size());
 }
 
 /**
@@ -259,22 +513,25 @@ void Tagger::Impl::forward(Contexts &contexts, PDFs &alphas, PSIs &psis, PDF &sc
  * the alpha values in the final column (i.e. at position N, where N is the
  * number of words in the sentence)
  */
-void Tagger::Impl::forward_noscale(Contexts &contexts, PDFs &alphas, PSIs &psis) {
+void Tagger::Impl::forward_noscale(const Instance &instance, Buffers &b) {
+  PDFs &alphas = b.alphas;
+  PDFs &states = b.states;
+  PDFs &trans = b.trans;
+
   for (Tag curr(2); curr < ntags; ++curr) {
-    lbfgsfloatval_t val = psis[0][Sentinel::val][curr];
+    lbfgsfloatval_t val = states[0][curr];
     alphas[0][curr] = val;
   }
 
-  for (size_t i = 1; i < contexts.size(); ++i) {
+  for (size_t i = 1; i < instance.size(); ++i) {
     for (Tag curr(2); curr < ntags; ++curr) {
-      for (Tag prev(2); prev < ntags; ++prev) {
-        lbfgsfloatval_t val = alphas[i-1][prev] * psis[i][prev][curr];
-        //std::cout << tags.str(prev) << ' ' << tags.str(curr) << ' ' << alphas[i-1][prev] << ' ' << psis[i][prev][curr] << ' ' << val << std::endl;
-        alphas[i][curr] += val;
-      }
+      lbfgsfloatval_t val = 0.0;
+      for (Tag prev(2); prev < ntags; ++prev)
+        val += alphas[i-1][prev] * trans[prev][curr];
+      alphas[i][curr] = val * states[i][curr];
     }
   }
-  //std::cout << "noscale Z: " << log(vector_sum(alphas[contexts.size() - 1], ntags)) << std::endl;
+  //std::cout << "noscale Z: " << log(vector_sum(alphas[instance.size() - 1], ntags)) << std::endl;
 }
 
 /**
@@ -299,21 +556,52 @@ void Tagger::Impl::forward_noscale(Contexts &contexts, PDFs &alphas, PSIs &psis)
  * beta[i][tag] = sum (over next tags t) [beta'[i+1][t] * activation[i+1][t]]
  * beta'[i][tag] = beta[i][tag] * scale[i]
  *
+ * With the factorized activation, the sum over t is a three way dot product
+ * of a row of trans with beta'[i+1] and states[i+1], computed with the
+ * vectorized kernels.
+ *
+ * At a position pruned by the tag dictionary, beta is only computed for the
+ * candidate tags, and the sum over t only runs over the candidates of a
+ * pruned next position. The other betas stay zero, and are only ever
+ * multiplied by the zero alphas and state activations of their tags.
  */
-void Tagger::Impl::backward(Contexts &contexts, PDFs &betas, PSIs &psis, PDF &scale) {
+void Tagger::Impl::backward(const Instance &instance, Buffers &b) {
+  const Util::simd::Kernels &k = *kernels;
+  PDFs &betas = b.betas;
+  PDFs &states = b.states;
+  PDFs &trans = b.trans;
+  PDF &scale = b.scale;
+  const size_t n = ntags - 2;
+
   //std::cout << "backward" << std::endl;
   for (Tag curr(2); curr < ntags; ++curr)
-    betas[contexts.size() - 1][curr] = 1.0;
-  vector_scale(betas[contexts.size() - 1], scale[contexts.size() - 1], ntags);
-
-  for (int i = contexts.size() - 2; i >= 0; --i) {
-    for (Tag curr(2); curr < ntags; ++curr) {
-      for (Tag next(2); next < ntags; ++next) {
-        betas[i][curr] += betas[i+1][next] * psis[i+1][curr][next];
-        //std::cout << betas[i+1][next] << ' ' << psis[i+1][curr][next] << std::endl;
+    betas[instance.size() - 1][curr] = 1.0;
+  k.scale(betas[instance.size() - 1], scale[instance.size() - 1], ntags);
+
+  for (int i = instance.size() - 2; i >= 0; --i) {
+    const lbfgsfloatval_t *next = betas[i+1] + 2;
+    const lbfgsfloatval_t *state = states[i+1] + 2;
+    const uint16_t *next_begin = instance.candidate_begin(i + 1);
+    const uint16_t *next_end = instance.candidate_end(i + 1);
+    const uint16_t *curr_begin = instance.candidate_begin(i);
+    const uint16_t *curr_end = instance.candidate_end(i);
+    if (curr_begin == curr_end) {
+      if (next_begin == next_end)
+        for (Tag curr(2); curr < ntags; ++curr)
+          betas[i][curr] = k.dot3(trans[curr] + 2, next, state, n);
+      else
+        for (Tag curr(2); curr < ntags; ++curr)
+          betas[i][curr] = candidate_dot3(trans[curr], betas[i+1], states[i+1], next_begin, next_end);
+    }
+    else {
+      for (const uint16_t *curr = curr_begin; curr != curr_end; ++curr) {
+        if (next_begin == next_end)
+          betas[i][*curr] = k.dot3(trans[*curr] + 2, next, state, n);
+        else
+          betas[i][*curr] = candidate_dot3(trans[*curr], betas[i+1], states[i+1], next_begin, next_end);
       }
     }
-    vector_scale(betas[i], scale[i], ntags);
+    k.scale(betas[i], scale[i], ntags);
       //assert(!isinf(betas[i][curr]) && !std::isnan(betas[i][curr]));
   }
 }
@@ -322,40 +610,44 @@ void Tagger::Impl::backward(Contexts &contexts, PDFs &betas, PSIs &psis, PDF &sc
  * backward_noscale.
  * A version of the backward pass that does not perform scaling.
  */
-void Tagger::Impl::backward_noscale(Contexts &contexts, PDFs &betas, PSIs &psis) {
+void Tagger::Impl::backward_noscale(const Instance &instance, Buffers &b) {
+  PDFs &betas = b.betas;
+  PDFs &states = b.states;
+  PDFs &trans = b.trans;
+
   for (Tag curr(2); curr < ntags; ++curr)
-    betas[contexts.size() - 1][curr] = 1.0;
+    betas[instance.size() - 1][curr] = 1.0;
 
-  for (int i = contexts.size() - 2; i >= 0; --i) {
-    for (Tag curr(2); curr < ntags; ++curr) {
-      for (Tag next(2); next < ntags; ++next) {
-        betas[i][curr] += betas[i+1][next] * psis[i+1][curr][next];
-      }
+  for (int i = instance.size() - 2; i >= 0; --i) {
+    for (Tag next(2); next < ntags; ++next) {
+      lbfgsfloatval_t val = betas[i+1][next] * states[i+1][next];
+      for (Tag curr(2); curr < ntags; ++curr)
+        betas[i][curr] += trans[curr][next] * val;
     }
   }
   lbfgsfloatval_t z = 0.0;
   for (Tag next(2); next < ntags; ++next)
-    z += betas[0][next] * psis[0][Sentinel::val][next];
+    z += betas[0][next] * states[0][next];
   //std::cout << "noscale Z: " << log(z) << std::endl;
 }
 
 /**
  * sum_llhood.
- * Iterates through a given vector of contexts and computes the sum of all
- * active features on each context. Returns the sum.
+ * Iterates through the positions of a given instance and computes the sum
+ * of all active features that match the gold tags at each position. Returns
+ * the sum.
  */
-lbfgsfloatval_t Tagger::Impl::sum_llhood(Contexts &contexts, lbfgsfloatval_t decay) {
+lbfgsfloatval_t Tagger::Impl::sum_llhood(const Instance &instance, lbfgsfloatval_t decay) {
   lbfgsfloatval_t score = 0.0;
-  FeaturePtrs &trans_features = attributes.trans_features();
 
-  for (Contexts::iterator i = contexts.begin(); i != contexts.end(); ++i) {
-    for (FeaturePtrs::iterator j = i->features.begin(); j != i->features.end(); ++j)
-      if (i->klasses_match_or_none((*j)->klasses))
-        score += *((*j)->lambda) * decay;
+  for (size_t i = 0; i < instance.size(); ++i) {
+    for (const uint32_t *j = instance.begin(i); j != instance.end(i); ++j)
+      if (instance.klasses_match_or_none(i, feature_klasses[*j]))
+        score += lambdas[*j] * decay;
 
-    for (FeaturePtrs::iterator j = trans_features.begin(); j != trans_features.end(); ++j)
-      if (i->klasses_match((*j)->klasses)) {
-        score += *((*j)->lambda) * decay;
+    for (size_t j = 0; j < trans_ids.size(); ++j)
+      if (instance.klasses_match(i, feature_klasses[trans_ids[j]])) {
+        score += lambdas[trans_ids[j]] * decay;
         break;
       }
   }
@@ -377,12 +669,537 @@ lbfgsfloatval_t Tagger::Impl::sum_llhood(Contexts &contexts, lbfgsfloatval_t dec
  */
 lbfgsfloatval_t Tagger::Impl::regularised_llhood(void) {
   lbfgsfloatval_t llhood = 0.0;
-  for (Instances::iterator i = instances.begin(); i != instances.end(); ++i)
-    llhood += sum_llhood(*i);
+  for (size_t i = 0; i < instances.size(); ++i)
+    llhood += sum_llhood(instances[i]);
+  return regularised_llhood(llhood);
+}
+
+/**
+ * regularised_llhood.
+ * Computes the regularised log likelihood given the summed log likelihood
+ * over each training instance, which is computed by the workers in
+ * distributed training.
+ */
+lbfgsfloatval_t Tagger::Impl::regularised_llhood(const lbfgsfloatval_t llhood) {
   //std::cout << llhood << ' ' << log_z << ' ' << (attributes.sum_lambda_sq() * inv_sigma_sq * 0.5) << std::endl;
   return -(llhood - log_z - (attributes.sum_lambda_sq() * inv_sigma_sq * 0.5));
 }
 
+/**
+ * accumulate.
+ * Runs the forward-backward algorithm over a single training instance,
+ * adding the feature expectations and log partition function of the instance
+ * to the given working buffers.
+ *
+ * The process is:
+ *  1. reset the working vectors (alphas, betas, etc.)
+ *  2. compute the state activation scores for each position in the instance
+ *     (the shared transition activation scores are computed beforehand)
+ *  3. perform the forward-backward algorithm to compute marginals
+ *  4. increment the feature expectations based on the instance
+ */
+void Tagger::Impl::accumulate(const Instance &instance, Buffers &b) {
+  b.reset(instance.size());
+  compute_states(instance, b.states);
+
+  //forward_noscale(instance, b);
+  //backward_noscale(instance, b);
+
+  b.log_z += forward(instance, b);
+  backward(instance, b);
+  //print_fwd_bwd(instance, b.alphas, b.scale);
+  //print_fwd_bwd(instance, b.betas, b.scale);
+
+  compute_expectations(instance, b);
+}
+
+namespace {
+
+  /**
+   * within_chain.
+   * Returns true if a gold tagpair is the previous and current tag of one
+   * chain, rather than the tags of two chains at the same position (in
+   * factorial models).
+   */
+  inline bool within_chain(const TagPair &tp) {
+    return tp.prev == Sentinel::val || tp.prev.type() == tp.curr.type();
+  }
+
+}
+
+/**
+ * accumulate_pl.
+ * Adds the negative log pseudo-likelihood of a single training instance to
+ * log_z in the given working buffers, and adds the feature expectations.
+ *
+ * The pseudo-likelihood replaces p(Y|X) with the product over positions i,
+ * and over the chains at each position, of the probability of the gold tag
+ * of the chain given the gold tags of its neighbours: the tags of the same
+ * chain at i-1 and i+1, and (in factorial models) the tags of the other
+ * chains at i. Each factor is normalized over the tags of its chain only,
+ * so no lattice is needed and the cost is O(T * K) rather than
+ * O(T * K^2). With the factorized activations,
+ *
+ * p(u | ...) = states[i][u] * trans[y(i-1)][u] * trans[u][y(i+1)] * exp(cross[u]) / Z(i)
+ *
+ * where the transition terms are omitted at the start and end of the
+ * sentence, and cross[u] (kept in alphas[i]) sums the lambdas of the
+ * features between chains at i that pair u with a gold tag of another
+ * chain. The local marginals of each factor are kept in state_marginals[i].
+ *
+ * Transition features and features between chains occur in two factors,
+ * one for each of their tags. Their frequency only counts one gold
+ * occurrence, so the gold count from the second factor is subtracted from
+ * the expectation instead. Transition expectations are summed into
+ * trans_marginals along the gold row and column at each position, and
+ * copied to the transition features once per instance.
+ */
+void Tagger::Impl::accumulate_pl(const Instance &instance, Buffers &b) {
+  PDFs &states = b.states;
+  PDFs &trans = b.trans;
+  PDFs &cross = b.alphas;
+  PDFs &marginals = b.state_marginals;
+  PDFs &trans_exp = b.trans_marginals;
+  PDF &exp = b.exp;
+  const size_t nchains = limits.ntypes();
+  Tags prev(nchains), curr(nchains), next(nchains);
+
+  b.reset(instance.size());
+  compute_states(instance, states);
+
+  for (const TagPair *k = instance.klass_begin(0); k != instance.klass_end(0); ++k)
+    if (within_chain(*k))
+      next[k->curr.type()] = k->curr;
+
+  for (size_t i = 0; i < instance.size(); ++i) {
+    prev.swap(curr);
+    curr.swap(next);
+    if (i + 1 < instance.size())
+      for (const TagPair *k = instance.klass_begin(i + 1); k != instance.klass_end(i + 1); ++k)
+        if (within_chain(*k))
+          next[k->curr.type()] = k->curr;
+
+    for (const uint32_t *j = instance.begin(i); j != instance.end(i); ++j) {
+      const TagPair &klasses = feature_klasses[*j];
+      if (!(klasses.prev == None::val)) {
+        if (klasses.curr == curr[klasses.curr.type()])
+          cross[i][klasses.prev] += lambdas[*j];
+        if (klasses.prev == curr[klasses.prev.type()])
+          cross[i][klasses.curr] += lambdas[*j];
+      }
+    }
+
+    for (size_t c = 0; c < nchains; ++c) {
+      const TagPair &range = limits[c];
+      lbfgsfloatval_t z = 0.0;
+      for (Tag u = range.prev; u < range.curr; ++u) {
+        lbfgsfloatval_t val = states[i][u];
+        if (i > 0)
+          val *= trans[prev[c]][u];
+        if (i + 1 < instance.size())
+          val *= trans[u][next[c]];
+        if (cross[i][u] != 0.0)
+          val *= std::exp(cross[i][u]);
+        marginals[i][u] = val;
+        z += val;
+      }
+      b.log_z += std::log(z) - std::log(marginals[i][curr[c]]);
+      for (Tag u = range.prev; u < range.curr; ++u)
+        marginals[i][u] /= z;
+
+      if (i > 0) {
+        for (Tag u = range.prev; u < range.curr; ++u) {
+          trans_exp[prev[c]][u] += marginals[i][u];
+          trans_exp[u][curr[c]] += marginals[i - 1][u];
+        }
+        trans_exp[prev[c]][curr[c]] -= 1.0;
+      }
+    }
+
+    for (const uint32_t *j = instance.begin(i); j != instance.end(i); ++j) {
+      const TagPair &klasses = feature_klasses[*j];
+      if (klasses.prev == None::val)
+        exp[*j] += marginals[i][klasses.curr];
+      else {
+        const bool prev_gold = klasses.prev == curr[klasses.prev.type()];
+        const bool curr_gold = klasses.curr == curr[klasses.curr.type()];
+        if (prev_gold)
+          exp[*j] += marginals[i][klasses.curr];
+        if (curr_gold)
+          exp[*j] += marginals[i][klasses.prev];
+        if (prev_gold && curr_gold)
+          exp[*j] -= 1.0;
+      }
+    }
+  }
+
+  for (size_t j = 0; j < trans_ids.size(); ++j) {
+    const TagPair &klasses = feature_klasses[trans_ids[j]];
+    exp[trans_ids[j]] += trans_exp[klasses.prev][klasses.curr];
+  }
+}
+
+/**
+ * accumulate_piecewise.
+ * Adds the negative log piecewise likelihood of a single training instance
+ * to log_z in the given working buffers, and adds the feature expectations.
+ *
+ * Piecewise training splits the model into its factors and normalizes each
+ * one separately, so no messages are passed. The pieces at position i are:
+ *  1. the state factor of each chain c, psis[i][None][u] for u in c
+ *  2. the transition factor of each chain c, psis[i][t][u] for t and u in c
+ *     (after the first position)
+ *  3. the factor between each pair of chains j < k, psis[i][t][u] for t in
+ *     k and u in j, which is the orientation of the tagpairs extracted for
+ *     observations between chains
+ * Each piece is normalized over every assignment of its own variables, and
+ * contributes the log of its local probability of the gold assignment.
+ *
+ * The psis add the state features of the current tag to every entry of its
+ * column, so a state feature occurs in every piece where its tag is the
+ * current tag. Its expectation is the sum of the local marginals of its
+ * tag in those pieces, less the gold occurrences in all but one of them,
+ * which its frequency counts. Once the
+ * pieces at a position are normalized, psis[i] holds their local
+ * marginals, which are the expectations of the features between chains.
+ * Transition expectations are summed in trans_marginals.
+ */
+void Tagger::Impl::accumulate_piecewise(const Instance &instance, Buffers &b) {
+  PSIs &psis = b.psis;
+  PDFs &marginals = b.state_marginals;
+  PDFs &trans_exp = b.trans_marginals;
+  PDF &exp = b.exp;
+  const size_t nchains = limits.ntypes();
+  Tags prev(nchains), curr(nchains);
+
+  b.reset(instance.size());
+  compute_psis(instance, psis);
+
+  for (size_t i = 0; i < instance.size(); ++i) {
+    PDFs &dist = psis[i];
+    for (const TagPair *k = instance.klass_begin(i); k != instance.klass_end(i); ++k)
+      if (within_chain(*k))
+        curr[k->curr.type()] = k->curr;
+
+    for (size_t c = 0; c < nchains; ++c) {
+      const TagPair &range = limits[c];
+      lbfgsfloatval_t *state = dist[None::val];
+      lbfgsfloatval_t z = 0.0;
+      for (Tag u = range.prev; u < range.curr; ++u)
+        z += state[u];
+      b.log_z += std::log(z) - std::log(state[curr[c]]);
+      for (Tag u = range.prev; u < range.curr; ++u)
+        marginals[i][u] += state[u] / z;
+      marginals[i][curr[c]] -= 1.0;
+
+      // the transition factor of chain c (k == c), and the factors between
+      // chain c and each later chain k
+      for (size_t k = (i == 0) ? c + 1 : c; k < nchains; ++k) {
+        const TagPair &from = limits[k];
+        const Tag gold = (k == c) ? prev[c] : curr[k];
+        z = 0.0;
+        for (Tag t = from.prev; t < from.curr; ++t)
+          for (Tag u = range.prev; u < range.curr; ++u)
+            z += dist[t][u];
+        b.log_z += std::log(z) - std::log(dist[gold][curr[c]]);
+        for (Tag t = from.prev; t < from.curr; ++t)
+          for (Tag u = range.prev; u < range.curr; ++u) {
+            dist[t][u] /= z;
+            marginals[i][u] += dist[t][u];
+            if (k == c)
+              trans_exp[t][u] += dist[t][u];
+          }
+        marginals[i][curr[c]] -= 1.0;
+      }
+    }
+
+    for (const uint32_t *j = instance.begin(i); j != instance.end(i); ++j) {
+      const TagPair &klasses = feature_klasses[*j];
+      if (klasses.prev == None::val)
+        exp[*j] += marginals[i][klasses.curr] + (klasses.curr == curr[klasses.curr.type()]);
+      else
+        exp[*j] += dist[klasses.prev][klasses.curr];
+    }
+    prev.swap(curr);
+  }
+
+  for (size_t j = 0; j < trans_ids.size(); ++j) {
+    const TagPair &klasses = feature_klasses[trans_ids[j]];
+    exp[trans_ids[j]] += trans_exp[klasses.prev][klasses.curr];
+  }
+}
+
+namespace {
+
+  /**
+   * lattice_pair.
+   * Returns true if a feature active at position i is treated as a pair of
+   * the previous and current tags in the lattice by compute_expectations,
+   * rather than as a state of the current tag.
+   */
+  inline bool lattice_pair(const TagPair &klasses, const size_t i) {
+    return i > 0 && !(klasses.prev == None::val) && klasses.prev.type() == klasses.curr.type();
+  }
+
+}
+
+/**
+ * compute_dtrans.
+ * Computes the directional derivative of the transition activation values
+ * along the direction of the Hessian-vector product, relative to the
+ * activations themselves (i.e. the direction of the transition lambdas).
+ * Like compute_trans, this is done once per evaluation.
+ */
+void Tagger::Impl::compute_dtrans(Buffers &b) {
+  PDFs &dtrans = b.dtrans;
+  dtrans.fill(0.0);
+
+  for (size_t j = 0; j != trans_ids.size(); ++j) {
+    const TagPair &klasses = feature_klasses[trans_ids[j]];
+    dtrans[klasses.prev][klasses.curr] += direction[trans_ids[j]];
+  }
+
+  for (Tag prev = 0; prev < ntags; ++prev)
+    for (Tag curr = 0; curr < ntags; ++curr)
+      b.dpsi[prev][curr] = dtrans[prev][curr];
+}
+
+/**
+ * add_pair_directions.
+ * Adds the direction of the pair features active at position i to dpsi, or
+ * restores the entries of dpsi that they changed to dtrans.
+ */
+void Tagger::Impl::add_pair_directions(const Instance &instance, const size_t i,
+    Buffers &b, const bool add) {
+  for (const uint32_t *j = instance.begin(i); j != instance.end(i); ++j) {
+    const TagPair &klasses = feature_klasses[*j];
+    if (!lattice_pair(klasses, i))
+      continue;
+    if (add)
+      b.dpsi[klasses.prev][klasses.curr] += direction[*j];
+    else
+      b.dpsi[klasses.prev][klasses.curr] = b.dtrans[klasses.prev][klasses.curr];
+  }
+}
+
+/**
+ * pair_tangent.
+ * Returns the directional derivative of the pair marginal p(prev, curr, i-1, i)
+ * given eg, the directional derivative of the log partition function. dpsi
+ * must hold the pair directions for position i.
+ */
+lbfgsfloatval_t Tagger::Impl::pair_tangent(Buffers &b, const size_t i,
+    const Tag prev, const Tag curr, const lbfgsfloatval_t eg) {
+  const lbfgsfloatval_t act = b.trans[prev][curr] * b.states[i][curr];
+  const lbfgsfloatval_t alpha = b.alphas[i-1][prev];
+  const lbfgsfloatval_t beta = b.betas[i][curr];
+  const lbfgsfloatval_t dpsi = b.dpsi[prev][curr] + b.dstates[i][curr];
+  return act * (b.dalphas[i-1][prev] * beta + alpha * (dpsi * beta + b.dbetas[i][curr]) - alpha * beta * eg);
+}
+
+/**
+ * hessian_vector.
+ * Adds the product of the Hessian of the negative log likelihood of a
+ * single training instance with the direction vector to the expectations
+ * of the given working buffers.
+ *
+ * The Hessian of the log partition function is the covariance matrix of the
+ * features, so the product with a direction v is the directional derivative
+ * of the feature expectations along v. This is computed exactly by
+ * differentiating the forward-backward algorithm: alongside the scaled
+ * alphas and betas, dalphas and dbetas hold their derivatives along v,
+ * scaled by the same factors (the scale factors are held fixed, which
+ * cancels out since the expectations are invariant to them):
+ *
+ * dalpha[0][u] = alpha[0][u] * dstates[0][u]
+ * dalpha[i][u] = scale[i] * states[i][u] * sum (over p) [(dalpha[i-1][p] +
+ *     alpha[i-1][p] * dpsi[p][u]) * trans[p][u]] + alpha[i][u] * dstates[i][u]
+ *
+ * dbeta[N][u] = 0
+ * dbeta[i][u] = scale[i] * sum (over t) [trans[u][t] * states[i+1][t] *
+ *     (dbeta[i+1][t] + beta[i+1][t] * (dpsi[u][t] + dstates[i+1][t]))]
+ *
+ * where dstates and dpsi are the sums of the directions of the state and pair
+ * features. The derivative of the log partition function is then the sum of
+ * dalpha[N], and the derivative of a state marginal alpha * beta / scale is
+ * (dalpha * beta + alpha * dbeta) / scale - p(i, u) * sum(dalpha[N]), and
+ * likewise for the pair marginals. The cost is about twice that of
+ * accumulate.
+ */
+void Tagger::Impl::hessian_vector(const Instance &instance, Buffers &b) {
+  PDFs &alphas = b.alphas;
+  PDFs &betas = b.betas;
+  PDFs &states = b.states;
+  PDFs &trans = b.trans;
+  PDFs &dstates = b.dstates;
+  PDFs &dalphas = b.dalphas;
+  PDFs &dbetas = b.dbetas;
+  PDFs &dpsi = b.dpsi;
+  PDF &scale = b.scale;
+  PDF &exp = b.exp;
+  const size_t size = instance.size();
+
+  b.reset(size);
+  dstates.fill(size, 0.0);
+  dalphas.fill(size, 0.0);
+  dbetas.fill(size, 0.0);
+  compute_states(instance, states);
+  for (size_t i = 0; i < size; ++i)
+    for (const uint32_t *j = instance.begin(i); j != instance.end(i); ++j) {
+      const TagPair &klasses = feature_klasses[*j];
+      if (!lattice_pair(klasses, i))
+        dstates[i][klasses.curr] += direction[*j];
+    }
+
+  forward(instance, b);
+  backward(instance, b);
+
+  for (Tag curr(2); curr < ntags; ++curr)
+    dalphas[0][curr] = alphas[0][curr] * dstates[0][curr];
+  for (size_t i = 1; i < size; ++i) {
+    add_pair_directions(instance, i, b, true);
+    for (Tag curr(2); curr < ntags; ++curr) {
+      lbfgsfloatval_t val = 0.0;
+      for (Tag prev(2); prev < ntags; ++prev)
+        val += (dalphas[i-1][prev] + alphas[i-1][prev] * dpsi[prev][curr]) * trans[prev][curr];
+      dalphas[i][curr] = scale[i] * states[i][curr] * val + alphas[i][curr] * dstates[i][curr];
+    }
+    add_pair_directions(instance, i, b, false);
+  }
+
+  for (int i = size - 2; i >= 0; --i) {
+    add_pair_directions(instance, i + 1, b, true);
+    for (Tag curr(2); curr < ntags; ++curr) {
+      lbfgsfloatval_t val = 0.0;
+      for (Tag next(2); next < ntags; ++next)
+        val += trans[curr][next] * states[i+1][next] * (dbetas[i+1][next] +
+            betas[i+1][next] * (dpsi[curr][next] + dstates[i+1][next]));
+      dbetas[i][curr] = scale[i] * val;
+    }
+    add_pair_directions(instance, i + 1, b, false);
+  }
+
+  lbfgsfloatval_t eg = 0.0;
+  for (Tag curr(2); curr < ntags; ++curr)
+    eg += dalphas[size - 1][curr];
+
+  for (size_t i = 0; i < size; ++i) {
+    const lbfgsfloatval_t inv_scale = 1.0 / scale[i];
+    if (i > 0)
+      add_pair_directions(instance, i, b, true);
+    for (const uint32_t *j = instance.begin(i); j != instance.end(i); ++j) {
+      const TagPair &klasses = feature_klasses[*j];
+      if (lattice_pair(klasses, i))
+        exp[*j] += pair_tangent(b, i, klasses.prev, klasses.curr, eg);
+      else {
+        const Tag curr = klasses.curr;
+        exp[*j] += (dalphas[i][curr] * betas[i][curr] + alphas[i][curr] *
+            (dbetas[i][curr] - betas[i][curr] * eg)) * inv_scale;
+      }
+    }
+
+    if (i > 0) {
+      for (Tag prev(2); prev < ntags; ++prev)
+        for (Tag curr(2); curr < ntags; ++curr)
+          b.trans_marginals[prev][curr] += pair_tangent(b, i, prev, curr, eg);
+      add_pair_directions(instance, i, b, false);
+    }
+  }
+
+  for (size_t j = 0; j < trans_ids.size(); ++j) {
+    const TagPair &klasses = feature_klasses[trans_ids[j]];
+    exp[trans_ids[j]] += b.trans_marginals[klasses.prev][klasses.curr];
+  }
+}
+
+/**
+ * Worker::run.
+ * Accumulates the feature expectations and log partition function (or the
+ * negative log pseudo-likelihood or piecewise likelihood) over each training
+ * instance in the partition assigned to this worker. When TRON has set a
+ * direction, the Hessian-vector product is accumulated in the expectations
+ * instead.
+ */
+void Tagger::Impl::Worker::run(void) {
+  impl.compute_trans(buffers);
+  buffers.reset_expectations();
+  if (impl.direction) {
+    impl.compute_dtrans(buffers);
+    for (InstanceRefs::iterator i = instances.begin(); i != instances.end(); ++i)
+      impl.hessian_vector(*i, buffers);
+    return;
+  }
+  for (InstanceRefs::iterator i = instances.begin(); i != instances.end(); ++i)
+    switch (impl.objective) {
+      case LIKELIHOOD: impl.accumulate(*i, buffers); break;
+      case PSEUDO_LIKELIHOOD: impl.accumulate_pl(*i, buffers); break;
+      case PIECEWISE: impl.accumulate_piecewise(*i, buffers); break;
+    }
+}
+
+/**
+ * partition.
+ * Creates the workers used for L-BFGS evaluation and divides the training
+ * instances between them.
+ *
+ * The cost of forward-backward is linear in the length of an instance, so
+ * sentence lengths are used to balance the load. Instances are sorted by
+ * decreasing length and each is assigned to the worker with the smallest
+ * total length so far (ties go to the lowest numbered worker). The assignment
+ * is fixed for the whole optimization and the partial results are always
+ * reduced in worker order, so the objective and gradient are deterministic
+ * for a given number of threads.
+ *
+ * With a single thread, all instances are assigned to one worker in their
+ * original order.
+ */
+void Tagger::Impl::partition(const size_t nthreads) {
+  for (size_t i = 0; i < nthreads; ++i) {
+    workers.push_back(new Worker(*this));
+    workers.back()->buffers.init(ntags, model.max_size(), model.nfeatures());
+    if (objective == PIECEWISE)
+      workers.back()->buffers.init_psis(ntags, model.max_size());
+  }
+
+  if (nthreads == 1) {
+    for (size_t i = 0; i < instances.size(); ++i)
+      workers[0]->instances.push_back(instances[i]);
+    return;
+  }
+
+  std::vector<std::pair<size_t, size_t> > sizes;
+  sizes.reserve(instances.size());
+  for (size_t i = 0; i < instances.size(); ++i)
+    sizes.push_back(std::make_pair(instances[i].size(), i));
+  std::sort(sizes.begin(), sizes.end(), std::greater<std::pair<size_t, size_t> >());
+
+  std::vector<size_t> loads(nthreads, 0);
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    size_t min = std::min_element(loads.begin(), loads.end()) - loads.begin();
+    loads[min] += sizes[i].first;
+    workers[min]->instances.push_back(instances[sizes[i].second]);
+  }
+
+  for (size_t i = 0; i < nthreads; ++i)
+    logger << "worker " << i << ": " << workers[i]->instances.size() << " instances, " << loads[i] << " tokens" << std::endl;
+}
+
+/**
+ * run_workers.
+ * Runs each worker over its partition of the training instances, on the
+ * calling thread if there is only one worker.
+ */
+void Tagger::Impl::run_workers(void) {
+  if (workers.size() == 1)
+    workers[0]->run();
+  else {
+    for (Workers::iterator i = workers.begin(); i != workers.end(); ++i)
+      (*i)->start();
+    for (Workers::iterator i = workers.begin(); i != workers.end(); ++i)
+      (*i)->join();
+  }
+}
+
 /**
  * _lbfgs_evaluate.
  * Gradient and objective evaluation function for libLBFGS optimization.
@@ -390,96 +1207,284 @@ lbfgsfloatval_t Tagger::Impl::regularised_llhood(void) {
  * of the objective function (regularised_llhood)
  *
  * The update process is:
+ *  1. compute the transition activation scores shared by every instance
+ *  2. each worker resets its feature expectations and log_z to 0, and
+ *     accumulates them over its partition of the training instances
+ *  3. the expectations and log_z of each worker are summed in worker order
+ *  4. calculate the gradient of each feature, and copy to the grad vector
+ *  5. calculate the regularised log likelihood and return it
+ *
+ * With a single worker, the work is done on the calling thread.
+ */
+lbfgsfloatval_t Tagger::Impl::_lbfgs_evaluate(const lbfgsfloatval_t *x,
+    lbfgsfloatval_t *g, const int n, const lbfgsfloatval_t step) {
+  //vector_print(x, n);
+  run_workers();
+  ++nevaluations;
+
+  attributes.reset_expectations();
+  log_z = 0.0;
+  for (Workers::iterator i = workers.begin(); i != workers.end(); ++i) {
+    attributes.add_expectations(&(*i)->buffers.exp[0]);
+    log_z += (*i)->buffers.log_z;
+  }
+  //attributes.prep_finite_differences();
+  //finite_differences(g, false);
+
+  attributes.copy_gradients(g, inv_sigma_sq);
+  //attributes.print(inv_sigma_sq);
+
+  // with the pseudo-likelihood or piecewise likelihood, log_z is already
+  // the negative log of the objective, so only the regularization term is
+  // added
+  if (objective != LIKELIHOOD)
+    return log_z + attributes.sum_lambda_sq() * inv_sigma_sq * 0.5;
+  return regularised_llhood();
+}
+
+/**
+ * _hessian_vector.
+ * Computes the product of the Hessian of the objective (the negative
+ * regularised log likelihood) at the current lambdas with the vector v,
+ * for TRON. The workers accumulate the product for the log partition
+ * function over their partitions, which are summed in worker order, and the
+ * regularization term adds v / sigma^2.
+ */
+void Tagger::Impl::_hessian_vector(const lbfgsfloatval_t *v,
+    lbfgsfloatval_t *hv, const int n) {
+  direction = v;
+  run_workers();
+  direction = 0;
+  ++nproducts;
+
+  for (int i = 0; i < n; ++i)
+    hv[i] = v[i] * inv_sigma_sq;
+  for (Workers::iterator w = workers.begin(); w != workers.end(); ++w) {
+    const PDF &exp = (*w)->buffers.exp;
+    for (int i = 0; i < n; ++i)
+      hv[i] += exp[i];
+  }
+}
+
+/**
+ * _lbfgs_bp_evaluate.
+ * Gradient and objective evaluation function for libLBFGS optimization.
+ * Updates the gradient for each feature lambda, and computes the new value
+ * of the objective function (regularised_llhood)
+ *
+ * The update process is:
  *  1. reset previously computed feature expectations and log_z to 0
  *  2. for each training instance:
  *        a. reset the working vectors (alphas, betas, etc.)
  *        b. compute the activation scores (psis) for each position in the
  *           instance
- *        c. perform the forward-backward algorithm to compute marginals
+ *        c. perform loopy belief propagation to estimate the true marginals
  *        d. increment the feature expectations based on the instance
  *  3. calculate the gradient of each feature, and copy to the grad vector
  *  4. calculate the regularised log likelihood and return it
  */
-lbfgsfloatval_t Tagger::Impl::_lbfgs_evaluate(const lbfgsfloatval_t *x,
-    lbfgsfloatval_t *g, const int n, const lbfgsfloatval_t step) {
-  attributes.reset_expectations();
-  //vector_print(x, n);
+lbfgsfloatval_t Tagger::Impl::_lbfgs_bp_evaluate(const lbfgsfloatval_t *x,
+    lbfgsfloatval_t *g, const int n, const lbfgsfloatval_t step) {
+  Buffers &b = buffers;
+  b.reset_expectations();
+
+  for (size_t i = 0; i < instances.size(); ++i) {
+    Instance instance = instances[i];
+    b.reset(instance.size());
+    compute_psis(instance, b.psis);
+    graph.propagate(b.psis, instance.size(), cfg.bp_iterations(), cfg.bp_convergence_threshold());
+    b.log_z += graph.marginals(b.psis, b.state_marginals, b.trans_marginals);
+    compute_expectations_from_marginals(instance, b);
+  }
+
+  attributes.reset_expectations();
+  attributes.add_expectations(&b.exp[0]);
+  log_z = b.log_z;
+  //attributes.prep_finite_differences();
+  //finite_differences(g, false);
+
+  attributes.copy_gradients(g, inv_sigma_sq);
+  //attributes.print(inv_sigma_sq);
+
+  return regularised_llhood();
+}
+
+namespace {
+
+  /**
+   * The messages of the distributed L-BFGS protocol. A worker connects and
+   * sends HELLO and the size of a lambda, and is told its shard and the
+   * number of shards. After feature extraction, it sends its number of
+   * features, instances and tokens. For each evaluation of the objective,
+   * the coordinator sends EVALUATE and the current lambdas, and each worker
+   * replies with its summed log partition function, log likelihood and
+   * feature expectations. STOP ends training.
+   */
+  const uint32_t HELLO = 0x43524631;
+  const uint32_t EVALUATE = 1;
+  const uint32_t STOP = 2;
+
+  // seconds a worker keeps retrying to connect to the coordinator
+  const unsigned int CONNECT_TIMEOUT = 60;
+
+}
+
+/**
+ * accept_workers.
+ * Listens on the listen address and waits for nworkers worker processes to
+ * connect. Each worker is assigned the shard of the training instances
+ * given by the order in which it connected. The coordinator stores no
+ * instances itself.
+ */
+void Tagger::Impl::accept_workers(void) {
+  if (cfg.nworkers() == 0)
+    throw Util::config::ConfigException("nworkers must be positive for distributed training", "nworkers");
+
+  Util::Listener listener(cfg.listen());
+  nshards = cfg.nworkers();
+  shard = nshards;
+  logger << "waiting for " << nshards << " workers on " << cfg.listen() << std::endl;
+
+  for (uint64_t i = 0; i < nshards; ++i) {
+    remotes.push_back(listener.accept());
+    uint32_t hello, size;
+    remotes.back()->recv(hello);
+    remotes.back()->recv(size);
+    if (hello != HELLO || size != sizeof(lbfgsfloatval_t))
+      throw IOException("unexpected handshake from worker", cfg.listen());
+    remotes.back()->send(i);
+    remotes.back()->send(nshards);
+    logger << "worker " << i << " connected" << std::endl;
+  }
+}
+
+/**
+ * connect_coordinator.
+ * Connects to the coordinator of distributed training, and receives the
+ * shard of the training instances to store.
+ */
+void Tagger::Impl::connect_coordinator(void) {
+  logger << "connecting to the coordinator on " << cfg.connect() << std::endl;
+  coordinator = Util::connect(cfg.connect(), CONNECT_TIMEOUT);
+  coordinator->send(HELLO);
+  coordinator->send((uint32_t)sizeof(lbfgsfloatval_t));
+  coordinator->recv(shard);
+  coordinator->recv(nshards);
+  logger << "storing shard " << shard << " of " << nshards << std::endl;
+}
+
+/**
+ * check_workers.
+ * Receives the number of features, instances and tokens from each worker
+ * after feature extraction. Every process extracts features from the whole
+ * training data, so the features must be identical to the coordinator's.
+ */
+void Tagger::Impl::check_workers(void) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < remotes.size(); ++i) {
+    uint64_t nfeatures, ninstances, ntokens;
+    remotes[i]->recv(nfeatures);
+    remotes[i]->recv(ninstances);
+    remotes[i]->recv(ntokens);
+    if (nfeatures != model.nfeatures())
+      throw IOException("worker has a different number of features to the coordinator", remotes[i]->address());
+    logger << "worker " << i << ": " << ninstances << " instances, " << ntokens << " tokens" << std::endl;
+    total += ninstances;
+  }
+  logger << "distributed " << total << " instances over " << remotes.size() << " workers" << std::endl;
+}
+
+/**
+ * serve.
+ * The main loop of a distributed training worker. Sends the size of its
+ * shard to the coordinator, and then evaluates the log partition function,
+ * log likelihood and feature expectations over the shard for each set of
+ * lambdas the coordinator sends, using the local threads as for ordinary
+ * L-BFGS training.
+ */
+void Tagger::Impl::serve(void) {
+  const size_t n = model.nfeatures();
+  coordinator->send((uint64_t)n);
+  coordinator->send((uint64_t)instances.size());
+  coordinator->send((uint64_t)instances.ntokens());
+
+  partition(std::max<uint64_t>(cfg.threads(), 1));
+  PDF exp(n, 0.0);
+  uint64_t nevaluations = 0;
+
+  while (true) {
+    uint32_t command;
+    coordinator->recv(command);
+    if (command == STOP)
+      break;
+    if (command != EVALUATE)
+      throw IOException("unexpected command from coordinator", cfg.connect());
+    coordinator->recv(lambdas, n * sizeof(lbfgsfloatval_t));
+    run_workers();
+
+    lbfgsfloatval_t llhood = 0.0, shard_log_z = 0.0;
+    std::fill(exp.begin(), exp.end(), 0.0);
+    for (Workers::iterator i = workers.begin(); i != workers.end(); ++i) {
+      const PDF &worker_exp = (*i)->buffers.exp;
+      for (size_t j = 0; j < n; ++j)
+        exp[j] += worker_exp[j];
+      shard_log_z += (*i)->buffers.log_z;
+    }
+    for (size_t i = 0; i < instances.size(); ++i)
+      llhood += sum_llhood(instances[i]);
 
-  log_z = 0.0;
-  for (Instances::iterator i = instances.begin(); i != instances.end(); ++i) {
-    Contexts &contexts = *i;
-    reset(i->size());
-    compute_psis(contexts, psis);
-
-    //print_psis(contexts, psis);
-    //forward_noscale(contexts, alphas, psis);
-    //backward_noscale(contexts, betas, psis);
-    //for (size_t j = 0; j < alphas.size(); ++j) {
-      //std::fill(alphas[j].begin(), alphas[j].end(), 0.0);
-      //std::fill(betas[j].begin(), betas[j].end(), 0.0);
-    //}
-
-    forward(contexts, alphas, psis, scale);
-    backward(contexts, betas, psis, scale);
-    //print_fwd_bwd(contexts, alphas, scale);
-    //print_fwd_bwd(contexts, betas, scale);
-
-    compute_expectations(contexts);
+    coordinator->send(shard_log_z);
+    coordinator->send(llhood);
+    coordinator->send(&exp[0], n * sizeof(lbfgsfloatval_t));
+    ++nevaluations;
   }
-  //attributes.prep_finite_differences();
-  //finite_differences(g, false);
-
-  attributes.copy_gradients(g, inv_sigma_sq);
-  //attributes.print(inv_sigma_sq);
 
-  return regularised_llhood();
+  logger << "completed " << nevaluations << " evaluations for the coordinator" << std::endl;
 }
 
 /**
- * _lbfgs_bp_evaluate.
- * Gradient and objective evaluation function for libLBFGS optimization.
- * Updates the gradient for each feature lambda, and computes the new value
- * of the objective function (regularised_llhood)
- *
- * The update process is:
- *  1. reset previously computed feature expectations and log_z to 0
- *  2. for each training instance:
- *        a. reset the working vectors (alphas, betas, etc.)
- *        b. compute the activation scores (psis) for each position in the
- *           instance
- *        c. perform loopy belief propagation to estimate the true marginals
- *        d. increment the feature expectations based on the instance
- *  3. calculate the gradient of each feature, and copy to the grad vector
- *  4. calculate the regularised log likelihood and return it
+ * _lbfgs_remote_evaluate.
+ * Gradient and objective evaluation function for distributed L-BFGS
+ * optimization. The current lambdas are sent to every worker before any
+ * reply is read, so the workers evaluate their shards concurrently. The
+ * partial results are then summed in worker order, so the objective and
+ * gradient are deterministic for a given number of workers, and the
+ * gradient and regularised log likelihood are computed as in
+ * _lbfgs_evaluate.
  */
-lbfgsfloatval_t Tagger::Impl::_lbfgs_bp_evaluate(const lbfgsfloatval_t *x,
+lbfgsfloatval_t Tagger::Impl::_lbfgs_remote_evaluate(const lbfgsfloatval_t *x,
     lbfgsfloatval_t *g, const int n, const lbfgsfloatval_t step) {
-  attributes.reset_expectations();
+  for (Sockets::iterator i = remotes.begin(); i != remotes.end(); ++i) {
+    (*i)->send(EVALUATE);
+    (*i)->send(x, n * sizeof(lbfgsfloatval_t));
+  }
+  ++nevaluations;
 
+  PDF &exp = buffers.exp;
+  lbfgsfloatval_t llhood = 0.0;
+  attributes.reset_expectations();
   log_z = 0.0;
-  for (Instances::iterator i = instances.begin(); i != instances.end(); ++i) {
-    Contexts &contexts = *i;
-    reset(i->size());
-    compute_psis(contexts, psis);
-    graph.propagate(psis, contexts.size(), cfg.bp_iterations(), cfg.bp_convergence_threshold());
-    log_z += graph.marginals(psis, state_marginals, trans_marginals);
-    compute_expectations_from_marginals(contexts);
+  for (Sockets::iterator i = remotes.begin(); i != remotes.end(); ++i) {
+    lbfgsfloatval_t remote_log_z, remote_llhood;
+    (*i)->recv(remote_log_z);
+    (*i)->recv(remote_llhood);
+    (*i)->recv(&exp[0], n * sizeof(lbfgsfloatval_t));
+    attributes.add_expectations(&exp[0]);
+    log_z += remote_log_z;
+    llhood += remote_llhood;
   }
-  //attributes.prep_finite_differences();
-  //finite_differences(g, false);
 
   attributes.copy_gradients(g, inv_sigma_sq);
-  //attributes.print(inv_sigma_sq);
-
-  return regularised_llhood();
+  return regularised_llhood(llhood);
 }
+
 /**
  * print_psis.
  * Debugging function to print out the matrix of activation values (psis)
  * for a given instance.
  */
-void Tagger::Impl::print_psis(Contexts &contexts, PSIs &psis) {
-  for (size_t i = 0; i < contexts.size(); ++i) {
+void Tagger::Impl::print_psis(const Instance &instance, PSIs &psis) {
+  for (size_t i = 0; i < instance.size(); ++i) {
     std::cout << "Position " << i << std::endl;
     for (size_t j = 0; j < tags.size(); ++j) {
       if(j == 0){
@@ -503,32 +1508,32 @@ void Tagger::Impl::print_psis(Contexts &contexts, PSIs &psis) {
  * Debugging function to print out the matrix of alpha values or matrix of
  * beta values as well as the accompanying scale factors.
  */
-void Tagger::Impl::print_fwd_bwd(Contexts &contexts, PDFs &pdfs, PDF &scale) {
+void Tagger::Impl::print_fwd_bwd(const Instance &instance, PDFs &pdfs, PDF &scale) {
   std::cout << std::setw(16) << ' ';
-  for (size_t i = 0; i < contexts.size(); ++i)
-    std::cout << std::setw(16) << tags.str(contexts[i].klasses[0].curr);
+  for (size_t i = 0; i < instance.size(); ++i)
+    std::cout << std::setw(16) << tags.str(instance.klass(i).curr);
   std::cout << std::endl;
   for (Tag curr(0); curr < ntags; ++curr) {
     std::cout << std::setw(16) << tags.str(curr);
-    for (size_t i = 0; i < contexts.size(); ++i)
+    for (size_t i = 0; i < instance.size(); ++i)
       std::cout << std::setw(16) << pdfs[i][curr];
     std::cout << std::endl;
   }
   std::cout << std::setw(16) << "scale:";
-  for (size_t i = 0; i < contexts.size(); ++i)
+  for (size_t i = 0; i < instance.size(); ++i)
     std::cout << std::setw(16) << scale[i];
 
   std::cout << '\n' << std::endl;
 }
 
-void Tagger::Impl::print_state_marginals(Contexts &contexts, PDFs &state_marginals) {
+void Tagger::Impl::print_state_marginals(const Instance &instance, PDFs &state_marginals) {
   std::cout << std::setw(16) << ' ';
-  for (size_t i = 0; i < contexts.size(); ++i)
-    std::cout << std::setw(16) << tags.str(contexts[i].klasses[0].curr);
+  for (size_t i = 0; i < instance.size(); ++i)
+    std::cout << std::setw(16) << tags.str(instance.klass(i).curr);
   std::cout << std::endl;
   for (size_t curr = 0; curr < ntags; ++curr) {
     std::cout << std::setw(16) << tags.str(tags[curr]);
-    for (size_t i = 0; i < contexts.size(); ++i)
+    for (size_t i = 0; i < instance.size(); ++i)
       std::cout << std::setw(16) << state_marginals[i][curr];
     std::cout << std::endl;
   }
@@ -584,11 +1589,12 @@ void Tagger::Impl::finite_differences(lbfgsfloatval_t *g, bool overwrite) {
   while (attributes.inc_next_lambda(EPSILON)) {
     log_z = 0.0;
     // re-estimate log Z
-    for (Instances::iterator i = instances.begin(); i != instances.end(); ++i) {
-      Contexts &contexts = *i;
-      reset(i->size());
-      compute_psis(contexts, psis);
-      forward(contexts, alphas, psis, scale);
+    compute_trans(buffers);
+    for (size_t i = 0; i < instances.size(); ++i) {
+      Instance instance = instances[i];
+      buffers.reset(instance.size());
+      compute_states(instance, buffers.states);
+      log_z += forward(instance, buffers);
     }
 
     lbfgsfloatval_t plus_llhood = regularised_llhood();
@@ -602,6 +1608,48 @@ void Tagger::Impl::finite_differences(lbfgsfloatval_t *g, bool overwrite) {
   log_z = old_log_z;
 }
 
+/**
+ * check_kernels.
+ * Checks the vectorized kernels against the scalar kernels by computing the
+ * log partition function of every training instance with the scalar
+ * kernels and with each instruction set supported by this CPU. Throws an
+ * exception if any of them differ by more than a small relative tolerance
+ * (the vectorized sums are reordered, so they are not bit identical).
+ */
+void Tagger::Impl::check_kernels(void) {
+  const Util::simd::Kernels *current = kernels;
+  const Util::simd::Kernels &reference = Util::simd::kernels(Util::simd::SCALAR);
+  const Util::simd::Level widest = Util::simd::detect();
+  size_t nerrors = 0;
+
+  compute_trans(buffers);
+  for (int level = Util::simd::SSE2; level <= widest; ++level) {
+    const Util::simd::Kernels &k = Util::simd::kernels(static_cast<Util::simd::Level>(level));
+    size_t ndiffer = 0;
+    for (size_t i = 0; i < instances.size(); ++i) {
+      Instance instance = instances[i];
+      buffers.reset(instance.size());
+      compute_states(instance, buffers.states);
+
+      kernels = &reference;
+      lbfgsfloatval_t expected = forward(instance, buffers);
+      kernels = &k;
+      lbfgsfloatval_t actual = forward(instance, buffers);
+
+      if (std::fabs(expected - actual) > 1e-10 * std::max(1.0, std::fabs(expected))) {
+        logger << "instance " << i << ": scalar log Z " << expected << ", " << k.name << " log Z " << actual << std::endl;
+        ++ndiffer;
+      }
+    }
+    logger << k.name << " kernels: " << ndiffer << " of " << instances.size() << " instances differ from scalar" << std::endl;
+    nerrors += ndiffer;
+  }
+  kernels = current;
+
+  if (nerrors)
+    throw Exception("the vectorized kernels do not give the same log Z as the scalar kernels");
+}
+
 /**
  * calibrate.
  * Calibrates the learning rate for stochastic gradient descent optimization.
@@ -621,7 +1669,7 @@ void Tagger::Impl::finite_differences(lbfgsfloatval_t *g, bool overwrite) {
  * epoch, choosing the learning rate that results in the lowest possible
  * loss.
  */
-lbfgsfloatval_t Tagger::Impl::calibrate(InstancePtrs &instance_ptrs,
+lbfgsfloatval_t Tagger::Impl::calibrate(InstanceRefs &refs,
     lbfgsfloatval_t *weights, lbfgsfloatval_t lambda,
     lbfgsfloatval_t initial_eta, const int nfeatures) {
   size_t max_samples = fmin(1000, instances.size());
@@ -635,19 +1683,18 @@ lbfgsfloatval_t Tagger::Impl::calibrate(InstancePtrs &instance_ptrs,
   lbfgsfloatval_t best_loss = std::numeric_limits<lbfgsfloatval_t>::max();
   bool dec = false;
 
-  std::random_shuffle(instance_ptrs.begin(), instance_ptrs.end());
-  for (int i = 0; i < nfeatures; ++i)
-    weights[i] = 0.0;
+  std::random_shuffle(refs.begin(), refs.end());
+  reset_weights(weights);
 
   for (size_t i = 0; i < max_samples; ++i)
-    initial_loss += score(*(instance_ptrs[i]));
+    initial_loss += score(refs[i], buffers);
 
   initial_loss += (attributes.sum_lambda_sq() * inv_sigma_sq * 0.5);
   logger << "Initial loss: " << initial_loss << std::endl;
 
   while (ncandidates > 0 || !dec) {
     logger << "Trial " << ntrials << ", eta = " << eta << std::endl;
-    loss = sgd_iterate_calibrate(instance_ptrs, weights, nfeatures, max_samples, 1.0 / (lambda * eta), lambda);
+    loss = sgd_iterate_calibrate(refs, weights, nfeatures, max_samples, 1.0 / (lambda * eta), lambda);
 
     bool check = !isinf(loss) && !std::isnan(loss) && loss < initial_loss;
     if (check) {
@@ -693,20 +1740,76 @@ lbfgsfloatval_t Tagger::Impl::calibrate(InstancePtrs &instance_ptrs,
  * lambdas is calculated, and the lambdas are updated based on the
  * instance. Once nsamples have been considered, the weights are scaled by the
  * decay factor and the loss incremented by the L2 norm of the weights
+ *
+ * With eta = 1 / (lambda * (t0 + t)), each update multiplies the decay by
+ * (t0 + t - 1) / (t0 + t), so the product telescopes and the decay after
+ * update t of an epoch starting at update s is (t0 + s - 1) / (t0 + t). With
+ * more than one SGD worker, the workers use this to compute the decay and
+ * gain of the updates they claim independently, and update the shared
+ * lambdas in parallel without locking.
+ *
+ * With a batch size B greater than one, the gradients of each batch of B
+ * instances are computed by the SGD workers and summed, and a single update
+ * is made per batch. The regularisation for a batch is B times that of a
+ * single instance, so the schedule uses B * lambda, and t counts batches
+ * rather than instances.
+ *
+ * AdaGrad and Adam use per-feature learning rates instead of the decay
+ * schedule (see adaptive_epoch).
  */
-lbfgsfloatval_t Tagger::Impl::sgd_epoch(InstancePtrs &instance_ptrs,
+lbfgsfloatval_t Tagger::Impl::sgd_epoch(InstanceRefs &refs,
     lbfgsfloatval_t *weights, const int nfeatures, const int nsamples,
     const lbfgsfloatval_t lambda, const int t0, int &t, const bool log) {
   lbfgsfloatval_t eta, norm, gain, decay = 1.0;
   lbfgsfloatval_t loss = 0.0;
 
-  for (int i = 0; i < nsamples; ++i) {
-    Contexts &contexts = *(instance_ptrs[i]);
-    eta = 1 / (lambda * (t0 + t));
-    decay *= (1.0 - eta * lambda);
-    gain = eta / decay;
-    loss += score_instance(contexts, decay, gain);
-    ++t;
+  if (adaptive) {
+    loss = adaptive_epoch(refs, nsamples, lambda);
+    t += nsamples;
+    eta = adaptive->eta;
+  }
+  else if (!sgd_workers.empty()) {
+    schedule.refs = &refs;
+    schedule.nsamples = nsamples;
+    schedule.batch = std::max<uint64_t>(cfg.batch(), 1);
+    schedule.next = 0;
+    schedule.t0 = t0;
+    schedule.lambda = lambda * schedule.batch;
+    schedule.decay = 1.0;
+    schedule.t = t;
+    if (schedule.batch > 1 && nsamples > 0)
+      schedule.advance();
+
+    if (sgd_workers.size() == 1)
+      sgd_workers[0]->run();
+    else {
+      for (SGDWorkers::iterator i = sgd_workers.begin(); i != sgd_workers.end(); ++i)
+        (*i)->start();
+      for (SGDWorkers::iterator i = sgd_workers.begin(); i != sgd_workers.end(); ++i)
+        (*i)->join();
+    }
+    for (SGDWorkers::iterator i = sgd_workers.begin(); i != sgd_workers.end(); ++i)
+      loss += (*i)->loss;
+
+    if (schedule.batch > 1) {
+      t = schedule.t;
+      eta = schedule.eta;
+      decay = schedule.decay;
+    }
+    else {
+      t += nsamples;
+      eta = 1 / (lambda * (t0 + t - 1));
+      decay = (t0 + schedule.t - 1.0) / (t0 + t - 1.0);
+    }
+  }
+  else {
+    for (int i = 0; i < nsamples; ++i) {
+      eta = 1 / (lambda * (t0 + t));
+      decay *= (1.0 - eta * lambda);
+      gain = eta / decay;
+      loss += score_instance(refs[i], buffers, decay, gain);
+      ++t;
+    }
   }
 
   if (isinf(loss))
@@ -726,19 +1829,254 @@ lbfgsfloatval_t Tagger::Impl::sgd_epoch(InstancePtrs &instance_ptrs,
   return loss;
 }
 
+/**
+ * adaptive_epoch.
+ * Performs one epoch of AdaGrad or Adam over the first nsamples training
+ * instances, returning the summed unregularized loss. For each instance,
+ * the gradient of the loss is accumulated in buffers.exp, and each feature
+ * that is active on the instance (and each transition feature) is updated
+ * with its own learning rate.
+ */
+lbfgsfloatval_t Tagger::Impl::adaptive_epoch(InstanceRefs &refs,
+    const int nsamples, const lbfgsfloatval_t lambda) {
+  Adaptive &a = *adaptive;
+  lbfgsfloatval_t loss = 0.0;
+
+  for (int i = 0; i < nsamples; ++i) {
+    const Instance &instance = refs[i];
+    ++a.t;
+    if (a.method == Adaptive::ADAM) {
+      a.bias1 = 1.0 - std::pow(a.beta1, (double)a.t);
+      a.bias2 = 1.0 - std::pow(a.beta2, (double)a.t);
+    }
+
+    compute_trans(buffers);
+    loss += score_gradient(instance, buffers, 1.0);
+    if (instance.size())
+      for (const uint32_t *j = instance.begin(0); j != instance.end(instance.size() - 1); ++j)
+        adaptive_update(*j, lambda);
+    for (std::vector<uint32_t>::iterator j = trans_ids.begin(); j != trans_ids.end(); ++j)
+      adaptive_update(*j, lambda);
+  }
+
+  return loss;
+}
+
+/**
+ * adaptive_update.
+ * Updates the lambda for feature f using the gradient accumulated in
+ * buffers.exp, which holds the empirical minus the expected count, plus the
+ * L2 regularization for every update since the feature was last changed.
+ * The accumulated gradient is zeroed, so a feature that appears more than
+ * once on an instance is only updated once.
+ */
+void Tagger::Impl::adaptive_update(const uint32_t f, const lbfgsfloatval_t lambda) {
+  Adaptive &a = *adaptive;
+  PDF &grad = buffers.exp;
+  if (grad[f] == 0.0)
+    return;
+
+  const lbfgsfloatval_t g = -grad[f] + lambda * lambdas[f] * (a.t - a.last[f]);
+  grad[f] = 0.0;
+  adaptive_step(f, g);
+}
+
+/**
+ * adaptive_step.
+ * Moves the lambda for feature f against the gradient g, scaled by the
+ * feature's AdaGrad or Adam learning rate, and marks the feature as up to
+ * date with the regularization at the current update.
+ */
+void Tagger::Impl::adaptive_step(const uint32_t f, const lbfgsfloatval_t g) {
+  Adaptive &a = *adaptive;
+  lbfgsfloatval_t update;
+  a.last[f] = a.t;
+
+  if (a.method == Adaptive::ADAGRAD) {
+    a.v[f] += g * g;
+    update = -a.eta * g / (std::sqrt(a.v[f]) + a.epsilon);
+  }
+  else {
+    a.m[f] = a.beta1 * a.m[f] + (1.0 - a.beta1) * g;
+    a.v[f] = a.beta2 * a.v[f] + (1.0 - a.beta2) * g * g;
+    update = -a.eta * (a.m[f] / a.bias1) / (std::sqrt(a.v[f] / a.bias2) + a.epsilon);
+  }
+
+  lambdas[f] += update;
+  if (a.average)
+    a.sums[f] += (a.t - 1) * update;
+}
+
+/**
+ * adaptive_flush.
+ * Applies the L2 regularization that is still outstanding for every feature
+ * not touched since its last update, so that rare features end training as
+ * regularized as the frequent ones. Called once training finishes, before
+ * the lambdas are averaged.
+ */
+void Tagger::Impl::adaptive_flush(const size_t nfeatures, const lbfgsfloatval_t lambda) {
+  Adaptive &a = *adaptive;
+  for (size_t f = 0; f < nfeatures; ++f)
+    if (a.last[f] != a.t && lambdas[f] != 0.0)
+      adaptive_step(f, lambda * lambdas[f] * (a.t - a.last[f]));
+}
+
+/**
+ * svrg_epoch.
+ * Performs one epoch of stochastic variance reduced gradient (SVRG) descent
+ * over the training instances.
+ *
+ * Each update on instance i moves the lambdas w along
+ *
+ *   grad(i, w) - grad(i, snapshot) + (w - snapshot) / (N * sigma^2) + g / N
+ *
+ * where grad(i, .) is the gradient of the loss on instance i and g is the
+ * full gradient of the objective at the snapshot. The first two terms are
+ * sparse. They are applied with score_instance at w, and with
+ * compute_weights from the marginals at the snapshot (whose transition
+ * activations are computed once per epoch in snap). The remaining terms are
+ * dense, but for a feature that is not active they only pull its lambda
+ * towards target = snapshot - sigma^2 * g, multiplying the distance by
+ * (1 - eta / (N * sigma^2)) on each update. So they are applied lazily, in
+ * closed form, when the feature is next active and at the end of the epoch.
+ */
+void Tagger::Impl::svrg_epoch(InstanceRefs &refs,
+    lbfgsfloatval_t *weights, const lbfgsfloatval_t *snapshot,
+    const lbfgsfloatval_t *target, Buffers &snap, const lbfgsfloatval_t eta,
+    const int nfeatures) {
+  const size_t nsamples = refs.size();
+  std::vector<uint32_t> last(nfeatures, 0);
+  std::vector<lbfgsfloatval_t> powers(nsamples + 1, 1.0);
+
+  for (size_t t = 1; t <= nsamples; ++t)
+    powers[t] = powers[t-1] * (1.0 - eta * inv_sigma_sq / nsamples);
+
+  for (size_t t = 0; t < nsamples; ++t) {
+    const Instance &instance = refs[t];
+    if (instance.size())
+      for (const uint32_t *j = instance.begin(0); j != instance.end(instance.size() - 1); ++j) {
+        weights[*j] = target[*j] + powers[t - last[*j]] * (weights[*j] - target[*j]);
+        last[*j] = t;
+      }
+    for (std::vector<uint32_t>::iterator j = trans_ids.begin(); j != trans_ids.end(); ++j) {
+      weights[*j] = target[*j] + powers[t - last[*j]] * (weights[*j] - target[*j]);
+      last[*j] = t;
+    }
+
+    score_instance(instance, buffers, 1.0, eta);
+
+    snap.reset(instance.size());
+    compute_states(instance, snap.states, snapshot);
+    forward(instance, snap);
+    backward(instance, snap);
+    compute_marginals(instance, snap);
+    compute_weights(instance, snap, -eta, weights);
+  }
+
+  for (int j = 0; j < nfeatures; ++j)
+    weights[j] = target[j] + powers[nsamples - last[j]] * (weights[j] - target[j]);
+}
+
+/**
+ * SGDWorker::run.
+ * Runs the worker's part of an SGD epoch, with or without batching.
+ */
+void Tagger::Impl::SGDWorker::run(void) {
+  loss = 0.0;
+  if (impl.schedule.batch > 1)
+    batches();
+  else
+    hogwild();
+}
+
+/**
+ * SGDWorker::hogwild.
+ * Claims instances from the shared schedule until the epoch is complete,
+ * performing the SGD update for each one in the worker's own buffers.
+ */
+void Tagger::Impl::SGDWorker::hogwild(void) {
+  Schedule &s = impl.schedule;
+
+  for (size_t i = Util::fetch_and_add(s.next, 1); i < s.nsamples; i = Util::fetch_and_add(s.next, 1)) {
+    lbfgsfloatval_t t = s.t0 + s.t + i;
+    lbfgsfloatval_t eta = 1.0 / (s.lambda * t);
+    lbfgsfloatval_t decay = (s.t0 + s.t - 1.0) / t;
+    loss += impl.score_instance((*s.refs)[i], buffers, decay, eta / decay);
+  }
+}
+
+/**
+ * SGDWorker::batches.
+ * Computes the gradient of every nworkers'th instance of each batch,
+ * starting from the worker's id. Once every worker has finished the batch,
+ * the first worker applies the summed update, and the next batch begins once
+ * the update is complete.
+ */
+void Tagger::Impl::SGDWorker::batches(void) {
+  Schedule &s = impl.schedule;
+  const size_t nworkers = impl.sgd_workers.size();
+
+  for (size_t begin = 0; begin < s.nsamples; begin += s.batch) {
+    const size_t end = std::min(begin + s.batch, s.nsamples);
+    impl.compute_trans(buffers, s.decay);
+    for (size_t i = begin + id; i < end; i += nworkers) {
+      const Instance &instance = (*s.refs)[i];
+      loss += impl.score_gradient(instance, buffers, s.decay);
+      if (instance.size())
+        touched.insert(touched.end(), instance.begin(0), instance.end(instance.size() - 1));
+    }
+
+    s.barrier->wait();
+    if (id == 0)
+      impl.apply_batch(end < s.nsamples);
+    s.barrier->wait();
+  }
+}
+
+/**
+ * apply_batch.
+ * Adds the gradient accumulated by each SGD worker over a batch to the
+ * lambdas, scaled by the current gain, and zeroes it ready for the next
+ * batch. Only the features touched by the batch and the transition features
+ * are visited; a feature that appears more than once in the touched list is
+ * zeroed the first time, so it is only updated once. Advances the schedule
+ * if there is another batch to come.
+ */
+void Tagger::Impl::apply_batch(const bool advance) {
+  const lbfgsfloatval_t gain = schedule.gain;
+
+  for (SGDWorkers::iterator w = sgd_workers.begin(); w != sgd_workers.end(); ++w) {
+    PDF &delta = (*w)->buffers.exp;
+    std::vector<uint32_t> &touched = (*w)->touched;
+    for (std::vector<uint32_t>::iterator i = touched.begin(); i != touched.end(); ++i)
+      if (delta[*i] != 0.0) {
+        lambdas[*i] += delta[*i] * gain;
+        delta[*i] = 0.0;
+      }
+    touched.clear();
+
+    for (std::vector<uint32_t>::iterator i = trans_ids.begin(); i != trans_ids.end(); ++i) {
+      lambdas[*i] += delta[*i] * gain;
+      delta[*i] = 0.0;
+    }
+  }
+
+  if (advance)
+    schedule.advance();
+}
+
 /**
  * sgd_iterate_calibrate.
  * Performs one epoch of stochastic gradient descent. Used in the process
  * of calibrating the learning rate.
  */
-lbfgsfloatval_t Tagger::Impl::sgd_iterate_calibrate(InstancePtrs &instance_ptrs,
+lbfgsfloatval_t Tagger::Impl::sgd_iterate_calibrate(InstanceRefs &refs,
     lbfgsfloatval_t *weights, const int nfeatures, const int nsamples,
     const lbfgsfloatval_t t0, const lbfgsfloatval_t lambda) {
   int t = 0;
-  for (int i = 0; i < nfeatures; ++i)
-    weights[i] = 0.0;
+  reset_weights(weights);
 
-  return sgd_epoch(instance_ptrs, weights, nfeatures, nsamples, lambda, t0, t);
+  return sgd_epoch(refs, weights, nfeatures, nsamples, lambda, t0, t);
 }
 
 /**
@@ -752,7 +2090,7 @@ lbfgsfloatval_t Tagger::Impl::sgd_iterate_calibrate(InstancePtrs &instance_ptrs,
  * improvement in the summed loss over all the training instance falls
  * below cfg.delta()
  */
-lbfgsfloatval_t Tagger::Impl::sgd_iterate(InstancePtrs &instance_ptrs,
+lbfgsfloatval_t Tagger::Impl::sgd_iterate(InstanceRefs &refs,
     lbfgsfloatval_t *weights, const int nfeatures, const int nsamples,
     const lbfgsfloatval_t t0, const lbfgsfloatval_t lambda, const int nepochs,
     const int period) {
@@ -762,16 +2100,24 @@ lbfgsfloatval_t Tagger::Impl::sgd_iterate(InstancePtrs &instance_ptrs,
   lbfgsfloatval_t *best_weights = new lbfgsfloatval_t[nfeatures];
   lbfgsfloatval_t *previous = new lbfgsfloatval_t[period];
   int t = 0;
+  int first = 1;
+
+  if (resumed) {
+    t = resumed->t;
+    first = resumed->iteration + 1;
+    best_loss = resumed->best_loss;
+    std::fill(previous, previous + period, std::numeric_limits<lbfgsfloatval_t>::max());
+    std::copy(resumed->losses.begin(), resumed->losses.begin() + std::min<size_t>(period, resumed->losses.size()), previous);
+  }
+  else
+    reset_weights(weights);
 
-  for (int i = 0; i < nfeatures; ++i)
-    weights[i] = 0.0;
-
-  for (int epoch = 1; epoch <= nepochs; ++epoch) {
+  for (int epoch = first; epoch <= nepochs; ++epoch) {
     clock_begin = clock();
     logger << "Epoch " << epoch << std::endl;
-    std::random_shuffle(instance_ptrs.begin(), instance_ptrs.end());
+    std::random_shuffle(refs.begin(), refs.end());
 
-    loss = sgd_epoch(instance_ptrs, weights, nfeatures, nsamples, lambda, t0, t, true);
+    loss = sgd_epoch(refs, weights, nfeatures, nsamples, lambda, t0, t, true);
 
     if (loss < best_loss) {
       best_loss = loss;
@@ -788,6 +2134,11 @@ lbfgsfloatval_t Tagger::Impl::sgd_iterate(InstancePtrs &instance_ptrs,
       logger << "  Improvement ratio = " << improvement << std::endl;
     logger << "  Epoch time = " << duration_s() << "s\n" << std::endl;
 
+    progress.t = t;
+    progress.best_loss = best_loss;
+    progress.losses.assign(previous, previous + period);
+    checkpoint(weights, epoch);
+
     if (improvement < cfg.delta())
       break;
   }
@@ -804,7 +2155,7 @@ lbfgsfloatval_t Tagger::Impl::sgd_iterate(InstancePtrs &instance_ptrs,
 /**
  * compute_marginals.
  * Computes the marginal probabilities based on the model expectations for
- * each tag at each position i in the given contexts.
+ * each tag at each position i in the given instance.
  *
  * The model expectation of a state having tag t at position i is given by:
  *   p(t, i) = alpha[i][t] * beta[i][t] / Z
@@ -813,7 +2164,7 @@ lbfgsfloatval_t Tagger::Impl::sgd_iterate(InstancePtrs &instance_ptrs,
  * The model expectation of a transition from tag t to tag u at position
  * (i, i+1) is given by:
  *   p(t, u, i, i+1) = alpha[i-1][t] * psis[i][t][u] * beta[i][u] / Z
- *                   = alpha'[i-1][t] * psis[i][t][u] * beta'[i][u]
+ *                   = alpha'[i-1][t] * trans[t][u] * states[i][u] * beta'[i][u]
  *
  * The model expecation of a transition from tag t to tag u is the sum of
  * p(t, u, i, i+1) over each position i in a sentence.
@@ -822,59 +2173,58 @@ lbfgsfloatval_t Tagger::Impl::sgd_iterate(InstancePtrs &instance_ptrs,
  * out of the transition expectations.
  *
  */
-void Tagger::Impl::compute_marginals(Contexts &c) {
+void Tagger::Impl::compute_marginals(const Instance &c, Buffers &b) {
+  const Util::simd::Kernels &k = *kernels;
+  const size_t n = ntags - 2;
+  PDFs &alphas = b.alphas;
+  PDFs &betas = b.betas;
+  PDFs &states = b.states;
+  PDFs &trans = b.trans;
+  PDF &scale = b.scale;
+  PDFs &state_marginals = b.state_marginals;
+  PDFs &trans_marginals = b.trans_marginals;
+
   for (size_t i = 0; i < c.size(); ++i) {
     lbfgsfloatval_t inv_scale = (1.0 / scale[i]);
-    for (Tag curr = 2; curr < ntags; ++curr) {
-      lbfgsfloatval_t alpha = alphas[i][curr];
-      lbfgsfloatval_t beta = betas[i][curr];
-      state_marginals[i][curr] += alpha * beta * inv_scale;
-    }
+    k.axpy_mul(state_marginals[i] + 2, inv_scale, alphas[i] + 2, betas[i] + 2, n);
     if (i > 0) {
-      for (Tag prev = 2; prev < ntags; ++prev) {
-        for (Tag curr = 2; curr < ntags; ++curr) {
-          lbfgsfloatval_t alpha = alphas[i-1][prev];
-          lbfgsfloatval_t beta = betas[i][curr];
-          trans_marginals[prev][curr] += alpha * psis[i][prev][curr] * beta;
-        }
-      }
+      for (Tag prev = 2; prev < ntags; ++prev)
+        k.axpy_mul3(trans_marginals[prev] + 2, alphas[i-1][prev], trans[prev] + 2, betas[i] + 2, states[i] + 2, n);
     }
   }
 }
 
 /**
  * compute_weights.
- * Updates the feature lambdas for features active on a training instance.
- * Used for stochastic gradient descent optimization.
+ * Updates the feature weights for features active on a training instance.
+ * Used for stochastic gradient descent optimization, either on the lambdas
+ * directly, or on a per-worker gradient accumulated over a batch.
  */
-void Tagger::Impl::compute_weights(Contexts &c, lbfgsfloatval_t gain) {
-  FeaturePtrs &trans_features = attributes.trans_features();
+void Tagger::Impl::compute_weights(const Instance &c, Buffers &b, lbfgsfloatval_t gain,
+    lbfgsfloatval_t *weights) {
+  PDFs &state_marginals = b.state_marginals;
+  PDFs &trans_marginals = b.trans_marginals;
 
   for (size_t i = 0; i < c.size(); ++i) {
-    for (size_t j = 0; j < c[i].features.size(); ++j) {
-      Feature &f = *(c[i].features[j]);
-      TagPair &klasses = f.klasses;
+    for (const uint32_t *j = c.begin(i); j != c.end(i); ++j) {
+      const TagPair &klasses = feature_klasses[*j];
       if (klasses.prev == None::val) {
-        if (c[i].klasses_match_or_none(klasses))
-          *f.lambda += gain;
-        *f.lambda -= state_marginals[i][klasses.curr] * gain;
+        if (c.klasses_match_or_none(i, klasses))
+          weights[*j] += gain;
+        weights[*j] -= state_marginals[i][klasses.curr] * gain;
       }
-      else if (c[i].klasses_match(klasses))
-        *f.lambda += gain;
+      else if (c.klasses_match(i, klasses))
+        weights[*j] += gain;
     }
 
-    for (size_t j = 0; j < trans_features.size(); ++j) {
-      Feature &f = *trans_features[j];
-      TagPair &klasses = f.klasses;
-      if (c[i].klasses_match(klasses))
-        *f.lambda += gain;
-    }
+    for (size_t j = 0; j < trans_ids.size(); ++j)
+      if (c.klasses_match(i, feature_klasses[trans_ids[j]]))
+        weights[trans_ids[j]] += gain;
   }
 
-  for (size_t j = 0; j < trans_features.size(); ++j) {
-    Feature &f = *trans_features[j];
-    TagPair &klasses = f.klasses;
-    *f.lambda -= trans_marginals[klasses.prev][klasses.curr] * gain;
+  for (size_t j = 0; j < trans_ids.size(); ++j) {
+    const TagPair &klasses = feature_klasses[trans_ids[j]];
+    weights[trans_ids[j]] -= trans_marginals[klasses.prev][klasses.curr] * gain;
   }
 }
 
@@ -884,14 +2234,14 @@ void Tagger::Impl::compute_weights(Contexts &c, lbfgsfloatval_t gain) {
  * Used to compute the initial loss in the calibration process for stochastic
  * gradient descent optimization.
  */
-lbfgsfloatval_t Tagger::Impl::score(Contexts &contexts, lbfgsfloatval_t decay) {
+lbfgsfloatval_t Tagger::Impl::score(const Instance &instance, Buffers &b, lbfgsfloatval_t decay) {
   lbfgsfloatval_t score = 0.0;
-  log_z = 0.0;
-  reset(contexts.size());
-  compute_psis(contexts, psis, decay);
-  forward(contexts, alphas, psis, scale);
-  //backward(contexts, betas, psis, scale);
-  score -= (sum_llhood(contexts, decay) - log_z);
+  b.reset(instance.size());
+  compute_trans(b, decay);
+  compute_states(instance, b.states, decay);
+  lbfgsfloatval_t log_z = forward(instance, b);
+  //backward(instance, b);
+  score -= (sum_llhood(instance, decay) - log_z);
   return score;
 }
 
@@ -901,92 +2251,591 @@ lbfgsfloatval_t Tagger::Impl::score(Contexts &contexts, lbfgsfloatval_t decay) {
  * and computes the unregularized loss for that instance. Used in stochastic
  * gradient descent optimization.
  */
-lbfgsfloatval_t Tagger::Impl::score_instance(Contexts &contexts, lbfgsfloatval_t decay, lbfgsfloatval_t gain) {
+lbfgsfloatval_t Tagger::Impl::score_instance(const Instance &instance, Buffers &b, lbfgsfloatval_t decay, lbfgsfloatval_t gain) {
   lbfgsfloatval_t score;
-  log_z = 0.0;
-  reset(contexts.size());
-  score = (sum_llhood(contexts, decay));
-  compute_psis(contexts, psis, decay);
-  forward(contexts, alphas, psis, scale);
-  backward(contexts, betas, psis, scale);
-  compute_marginals(contexts);
-  compute_weights(contexts, gain);
+  b.reset(instance.size());
+  score = (sum_llhood(instance, decay));
+  compute_trans(b, decay);
+  compute_states(instance, b.states, decay);
+  lbfgsfloatval_t log_z = forward(instance, b);
+  backward(instance, b);
+  compute_marginals(instance, b);
+  compute_weights(instance, b, gain, lambdas);
   //std::cout << -score << ' ' << log_z << ' ' << (attributes.sum_lambda_sq() * inv_sigma_sq * 0.5) <<  std::endl;
   return -score + log_z;
 }
 
 /**
- * train_lbfgs.
- * Perform L-BFGS optimization given a labelled training dataset. Uses the
- * libLBFGS library for the optimization, which requires the calculation of
- * the function objective value (negative regularised log likelihood) and
- * the gradient of each feature lambda at each iteration.
+ * score_gradient.
+ * Adds the gradient of the unregularized loss on a training instance to the
+ * buffer's accumulated gradient (b.exp) without changing the lambdas, and
+ * returns the loss. Used in mini-batch stochastic gradient descent. The
+ * transition activations must already be computed for the given decay.
+ */
+lbfgsfloatval_t Tagger::Impl::score_gradient(const Instance &instance, Buffers &b, lbfgsfloatval_t decay) {
+  lbfgsfloatval_t score;
+  b.reset(instance.size());
+  score = (sum_llhood(instance, decay));
+  compute_states(instance, b.states, decay);
+  lbfgsfloatval_t log_z = forward(instance, b);
+  backward(instance, b);
+  compute_marginals(instance, b);
+  compute_weights(instance, b, 1.0, &b.exp[0]);
+  return -score + log_z;
+}
+
+/**
+ * train_lbfgs.
+ * Perform L-BFGS optimization given a labelled training dataset. Uses the
+ * libLBFGS library for the optimization, which requires the calculation of
+ * the function objective value (negative regularised log likelihood) and
+ * the gradient of each feature lambda at each iteration.
+ *
+ * With a positive l1 coefficient, libLBFGS uses the orthant-wise limited
+ * memory quasi-Newton method (OWL-QN), which adds the L1 norm of the lambdas
+ * to the objective itself. Combined with the L2 term from sigma, this is
+ * elastic net regularization. Many lambdas end up exactly zero, and are not
+ * saved in the model.
+ */
+void Tagger::Impl::train_lbfgs(Reader &reader, lbfgsfloatval_t *weights) {
+  logger << "beginning L-BFGS optimization" << std::endl;
+  const size_t n = model.nfeatures();
+  lbfgs_parameter_t param;
+  uint64_t niterations = cfg.niterations();
+
+  if (resumed)
+    niterations -= std::min(niterations, resumed->iteration);
+  else
+    reset_weights(weights);
+
+  if (niterations == 0) {
+    logger << "L-BFGS optimization already completed " << cfg.niterations() << " iterations" << std::endl;
+    return;
+  }
+
+  lbfgs_parameter_init(&param);
+  param.max_iterations = niterations;
+  param.linesearch = LBFGS_LINESEARCH_MORETHUENTE;
+  param.epsilon = 1e-5;
+  param.delta = 1e-5;
+  param.past = 10;
+
+  if (cfg.l1() > 0.0) {
+    param.orthantwise_c = cfg.l1();
+    param.orthantwise_start = 0;
+    param.orthantwise_end = n;
+    param.linesearch = LBFGS_LINESEARCH_BACKTRACKING;
+    logger << "using OWL-QN with L1 coefficient " << cfg.l1() << std::endl;
+  }
+
+  attributes.assign_lambdas(weights);
+  clock_begin = clock();
+
+  int ret;
+  if (remotes.empty()) {
+    partition(std::max<uint64_t>(cfg.threads(), 1));
+    if (cfg.check_kernels())
+      check_kernels();
+    ret = lbfgs(n, weights, NULL, lbfgs_evaluate, lbfgs_progress, (void *)this, &param);
+  }
+  else {
+    ret = lbfgs(n, weights, NULL, lbfgs_remote_evaluate, lbfgs_progress, (void *)this, &param);
+    for (Sockets::iterator i = remotes.begin(); i != remotes.end(); ++i)
+      (*i)->send(STOP);
+  }
+
+  logger << "L-BFGS optimization terminated with status code " << ret << std::endl;
+  logger << "L-BFGS made " << nevaluations << " passes over the training data" << std::endl;
+}
+
+/**
+ * train_tron.
+ * Perform trust region Newton (TRON) optimization of the regularised log
+ * likelihood, as in LIBLINEAR (Lin, Weng and Keerthi 2008). At each
+ * iteration, the Newton step is found approximately by conjugate gradient
+ * (CG), using the exact Hessian-vector products from hessian_vector, and
+ * is limited to a trust region whose radius grows or shrinks depending on
+ * how well the quadratic model predicted the actual reduction in the
+ * objective. CG stops when the residual falls below 0.1 of the gradient
+ * norm or the step reaches the trust region boundary.
+ *
+ * Each objective evaluation and each Hessian-vector product is a pass over
+ * the training data (the latter about twice as expensive), and the number
+ * of each is logged, so the cost can be compared with L-BFGS. Training
+ * stops when the gradient norm falls below epsilon times max(1, xnorm) as
+ * for L-BFGS, the step no longer changes the objective, or after
+ * niterations accepted steps. The workers are shared with evaluation, so
+ * both are multithreaded.
+ */
+void Tagger::Impl::train_tron(Reader &reader, lbfgsfloatval_t *weights) {
+  logger << "beginning TRON optimization" << std::endl;
+  if (cfg.l1() > 0.0)
+    throw Util::config::ConfigException("the tron trainer does not support L1 regularization", "l1");
+
+  const int n = model.nfeatures();
+  const lbfgsfloatval_t eta0 = 1e-4, eta1 = 0.25, eta2 = 0.75;
+  const lbfgsfloatval_t sigma1 = 0.25, sigma2 = 0.5, sigma3 = 4.0;
+  const lbfgsfloatval_t epsilon = 1e-5;
+  std::vector<lbfgsfloatval_t> g(n), s(n), r(n), d(n), hd(n), old_w(n), old_g(n);
+
+  reset_weights(weights);
+  attributes.assign_lambdas(weights);
+  partition(std::max<uint64_t>(cfg.threads(), 1));
+  for (Workers::iterator i = workers.begin(); i != workers.end(); ++i)
+    (*i)->buffers.init_hessian(ntags, model.max_size());
+  clock_begin = clock();
+
+  lbfgsfloatval_t f = _lbfgs_evaluate(weights, &g[0], n, 0.0);
+  lbfgsfloatval_t gnorm = std::sqrt(vector_dot(&g[0], &g[0], n));
+  lbfgsfloatval_t radius = gnorm;
+  uint64_t iteration = 1;
+  uint64_t cg_total = 0;
+
+  while (iteration <= cfg.niterations()) {
+    // conjugate gradient for the step s that minimizes the quadratic model
+    // g.s + 0.5 * s.H.s within the trust region, leaving the residual
+    // -(g + H.s) in r
+    std::fill(s.begin(), s.end(), 0.0);
+    for (int i = 0; i < n; ++i)
+      r[i] = d[i] = -g[i];
+    lbfgsfloatval_t rr = vector_dot(&r[0], &r[0], n);
+    const lbfgsfloatval_t cg_tol = 0.1 * gnorm;
+    uint64_t cg = 0;
+    while (std::sqrt(rr) > cg_tol) {
+      ++cg;
+      _hessian_vector(&d[0], &hd[0], n);
+      lbfgsfloatval_t alpha = rr / vector_dot(&d[0], &hd[0], n);
+      for (int i = 0; i < n; ++i)
+        s[i] += alpha * d[i];
+      if (std::sqrt(vector_dot(&s[0], &s[0], n)) > radius) {
+        // step back and move to the trust region boundary along d
+        for (int i = 0; i < n; ++i)
+          s[i] -= alpha * d[i];
+        const lbfgsfloatval_t sd = vector_dot(&s[0], &d[0], n);
+        const lbfgsfloatval_t ss = vector_dot(&s[0], &s[0], n);
+        const lbfgsfloatval_t dd = vector_dot(&d[0], &d[0], n);
+        const lbfgsfloatval_t rad_sq = radius * radius;
+        const lbfgsfloatval_t rad = std::sqrt(sd * sd + dd * (rad_sq - ss));
+        alpha = (sd >= 0.0) ? (rad_sq - ss) / (sd + rad) : (rad - sd) / dd;
+        for (int i = 0; i < n; ++i) {
+          s[i] += alpha * d[i];
+          r[i] -= alpha * hd[i];
+        }
+        break;
+      }
+      for (int i = 0; i < n; ++i)
+        r[i] -= alpha * hd[i];
+      const lbfgsfloatval_t rr_new = vector_dot(&r[0], &r[0], n);
+      const lbfgsfloatval_t beta = rr_new / rr;
+      for (int i = 0; i < n; ++i)
+        d[i] = beta * d[i] + r[i];
+      rr = rr_new;
+    }
+    cg_total += cg;
+
+    // evaluate the step, keeping the old point in case it is rejected
+    std::copy(weights, weights + n, old_w.begin());
+    std::copy(g.begin(), g.end(), old_g.begin());
+    for (int i = 0; i < n; ++i)
+      weights[i] += s[i];
+    const lbfgsfloatval_t gs = vector_dot(&old_g[0], &s[0], n);
+    const lbfgsfloatval_t predicted = -0.5 * (gs - vector_dot(&s[0], &r[0], n));
+    const lbfgsfloatval_t f_new = _lbfgs_evaluate(weights, &g[0], n, 0.0);
+    const lbfgsfloatval_t actual = f - f_new;
+
+    // update the trust region radius
+    const lbfgsfloatval_t snorm = std::sqrt(vector_dot(&s[0], &s[0], n));
+    if (iteration == 1)
+      radius = std::min(radius, snorm);
+    const lbfgsfloatval_t curvature = f_new - f - gs;
+    const lbfgsfloatval_t factor = (curvature <= 0.0) ? sigma3 : std::max(sigma1, -0.5 * (gs / curvature));
+    if (actual < eta0 * predicted)
+      radius = std::min(std::max(factor, sigma1) * snorm, sigma2 * radius);
+    else if (actual < eta1 * predicted)
+      radius = std::max(sigma1 * radius, std::min(factor * snorm, sigma2 * radius));
+    else if (actual < eta2 * predicted)
+      radius = std::max(sigma1 * radius, std::min(factor * snorm, sigma3 * radius));
+    else
+      radius = std::max(radius, std::min(factor * snorm, sigma3 * radius));
+
+    if (actual > eta0 * predicted) {
+      f = f_new;
+      gnorm = std::sqrt(vector_dot(&g[0], &g[0], n));
+      const lbfgsfloatval_t xnorm = std::sqrt(vector_dot(weights, weights, n));
+      logger << "Iteration " << iteration << '\n' << "  llhood = " << f;
+      logger << ", xnorm = " << xnorm << ", gnorm = " << gnorm;
+      logger << ", radius = " << radius << ", cg = " << cg;
+      logger << ", passes = " << (nevaluations + nproducts);
+      logger << ", time = " << duration_s() << "s" << std::endl;
+      clock_begin = clock();
+      ++iteration;
+      if (gnorm <= epsilon * std::max<lbfgsfloatval_t>(1.0, xnorm))
+        break;
+    }
+    else {
+      std::copy(old_w.begin(), old_w.end(), weights);
+      std::copy(old_g.begin(), old_g.end(), g.begin());
+    }
+
+    if (actual <= 0.0 && predicted <= 0.0) {
+      logger << "TRON stopped as the step does not reduce the objective" << std::endl;
+      break;
+    }
+    if (std::fabs(actual) <= 1e-12 * std::fabs(f) && std::fabs(predicted) <= 1e-12 * std::fabs(f)) {
+      logger << "TRON stopped as the objective no longer changes" << std::endl;
+      break;
+    }
+  }
+
+  logger << "TRON made " << nevaluations << " evaluations and " << nproducts;
+  logger << " Hessian-vector products (" << cg_total << " CG iterations)" << std::endl;
+}
+
+/**
+ * train_sgd.
+ * Perform stochastic gradient descent optimization given a labelled training
+ * dataset. With more than one thread or a batch size greater than one, each
+ * epoch is run by a pool of SGD workers (see sgd_epoch).
+ */
+void Tagger::Impl::train_sgd(Reader &reader, lbfgsfloatval_t *weights) {
+  logger << "beginning SGD optimization" << std::endl;
+  const size_t n = model.nfeatures();
+  lbfgsfloatval_t lambda = 1.0 / (instances.size() * cfg.sigma() * cfg.sigma());
+  InstanceRefs refs; // randomly shuffling views is faster
+
+  for (size_t i = 0; i < instances.size(); ++i)
+    refs.push_back(instances[i]);
+
+  const size_t nthreads = std::max<uint64_t>(cfg.threads(), 1);
+  const size_t batch = std::max<uint64_t>(cfg.batch(), 1);
+  if (nthreads > 1 || batch > 1) {
+    for (size_t i = 0; i < nthreads; ++i) {
+      sgd_workers.push_back(new SGDWorker(*this, i));
+      sgd_workers.back()->buffers.init(ntags, model.max_size(), batch > 1 ? n : 0);
+    }
+    if (batch > 1)
+      schedule.barrier = new Util::Barrier(nthreads);
+    logger << "using " << nthreads << " SGD workers with a batch size of " << batch << std::endl;
+  }
+
+  lbfgsfloatval_t t0;
+  if (resumed)
+    t0 = resumed->t0;
+  else {
+    reset_weights(weights);
+    attributes.assign_lambdas(weights);
+
+    clock_begin = clock();
+    t0 = calibrate(refs, weights, lambda, cfg.eta(), n);
+    logger << "Calibration time: " << duration_s() << "s\n" << std::endl;
+  }
+  progress.t0 = t0;
+
+  clock_begin = clock();
+  sgd_iterate(refs, weights, n, refs.size(), t0, lambda, cfg.niterations(), cfg.period());
+}
+
+/**
+ * train_adaptive.
+ * Perform stochastic gradient descent optimization with per-feature adaptive
+ * learning rates (AdaGrad or Adam) given a labelled training dataset. The
+ * eta option is the base learning rate, and no calibration is needed. The
+ * epochs and convergence checks are the same as for SGD (see sgd_iterate).
+ * With the average option, the final lambdas are the average of the iterates
+ * over every update.
+ */
+void Tagger::Impl::train_adaptive(Reader &reader, lbfgsfloatval_t *weights,
+    const Adaptive::Method method) {
+  logger << "beginning " << (method == Adaptive::ADAGRAD ? "AdaGrad" : "Adam") << " optimization" << std::endl;
+  const size_t n = model.nfeatures();
+  lbfgsfloatval_t lambda = 1.0 / (instances.size() * cfg.sigma() * cfg.sigma());
+  InstanceRefs refs;
+
+  for (size_t i = 0; i < instances.size(); ++i)
+    refs.push_back(instances[i]);
+
+  adaptive = new Adaptive(method, n, cfg.eta(), cfg.average());
+
+  clock_begin = clock();
+  sgd_iterate(refs, weights, n, refs.size(), 0.0, lambda, cfg.niterations(), cfg.period());
+  adaptive_flush(n, lambda);
+
+  if (adaptive->average && adaptive->t > 0) {
+    for (size_t i = 0; i < n; ++i)
+      weights[i] -= adaptive->sums[i] / adaptive->t;
+    logger << "averaged the weights over " << adaptive->t << " updates" << std::endl;
+  }
+}
+
+/**
+ * train_svrg.
+ * Perform stochastic variance reduced gradient (SVRG) optimization given a
+ * labelled training dataset. Each epoch starts from a snapshot of the
+ * lambdas, whose objective and full gradient are computed by the L-BFGS
+ * workers (so this part is multithreaded), followed by one pass of
+ * variance reduced updates over the shuffled instances (see svrg_epoch).
+ * Unlike SGD, the learning rate stays constant, and training converges
+ * linearly to the optimum rather than stalling near it.
+ *
+ * The learning rate is calibrated as for SGD. If an epoch increases the
+ * objective, the lambdas are reset to the snapshot and the learning rate is
+ * halved. Training stops after niterations epochs, or when the relative
+ * improvement in the objective over an epoch falls below delta.
+ */
+void Tagger::Impl::train_svrg(Reader &reader, lbfgsfloatval_t *weights) {
+  logger << "beginning SVRG optimization" << std::endl;
+  if (cfg.l1() > 0.0)
+    throw Util::config::ConfigException("the svrg trainer does not support L1 regularization", "l1");
+
+  const int n = model.nfeatures();
+  const lbfgsfloatval_t lambda = 1.0 / (instances.size() * cfg.sigma() * cfg.sigma());
+  const lbfgsfloatval_t sigma_sq = cfg.sigma() * cfg.sigma();
+  std::vector<lbfgsfloatval_t> g(n), snapshot(n), snapshot_g(n), target(n);
+  InstanceRefs refs;
+  Buffers snap;
+
+  for (size_t i = 0; i < instances.size(); ++i)
+    refs.push_back(instances[i]);
+  snap.init(ntags, model.max_size(), 0);
+
+  reset_weights(weights);
+  attributes.assign_lambdas(weights);
+  clock_begin = clock();
+  lbfgsfloatval_t eta = 1.0 / (lambda * calibrate(refs, weights, lambda, cfg.eta(), n));
+  logger << "Calibration time: " << duration_s() << "s\n" << std::endl;
+  reset_weights(weights);
+
+  partition(std::max<uint64_t>(cfg.threads(), 1));
+  lbfgsfloatval_t best = std::numeric_limits<lbfgsfloatval_t>::max();
+  lbfgsfloatval_t improvement = cfg.delta();
+  lbfgsfloatval_t f = 0.0;
+  uint64_t epoch = 1;
+
+  for ( ; ; ++epoch) {
+    clock_begin = clock();
+    logger << "Snapshot " << epoch << std::endl;
+    f = _lbfgs_evaluate(weights, &g[0], n, 0.0);
+    if (f > best) {
+      std::copy(snapshot.begin(), snapshot.end(), weights);
+      std::copy(snapshot_g.begin(), snapshot_g.end(), g.begin());
+      eta *= 0.5;
+      logger << "  Loss = " << f << " (worse), halving the learning rate" << std::endl;
+    }
+    else {
+      if (best != std::numeric_limits<lbfgsfloatval_t>::max())
+        improvement = (best - f) / f;
+      best = f;
+      std::copy(weights, weights + n, snapshot.begin());
+      std::copy(g.begin(), g.end(), snapshot_g.begin());
+      logger << "  Loss = " << f << std::endl;
+      logger << "  Gradient norm = " << std::sqrt(vector_dot(&g[0], &g[0], n)) << std::endl;
+      logger << "  Improvement ratio = " << improvement << std::endl;
+    }
+    if (epoch > cfg.niterations() || improvement < cfg.delta())
+      break;
+
+    logger << "  Learning rate (eta) = " << eta << std::endl;
+    for (int i = 0; i < n; ++i)
+      target[i] = snapshot[i] - sigma_sq * g[i];
+    compute_trans(snap, &snapshot[0]);
+    std::random_shuffle(refs.begin(), refs.end());
+    svrg_epoch(refs, weights, &snapshot[0], &target[0], snap, eta, n);
+    logger << "  Epoch time = " << duration_s() << "s\n" << std::endl;
+  }
+
+  logger << "SVRG made " << nevaluations << " full gradient evaluations and ";
+  logger << (epoch - 1) * refs.size() << " stochastic updates" << std::endl;
+}
+
+/**
+ * perceptron_decode.
+ * Finds the highest scoring tag sequence for a training instance with the
+ * Viterbi algorithm, using the current (unaveraged) lambdas. The state
+ * scores in b.states and the transition scores in b.trans are the sums of
+ * the lambdas rather than their exponentials, so the path score is a sum.
+ * b.alphas holds the best score of a path ending in each tag at each
+ * position.
  */
-void Tagger::Impl::train_lbfgs(Reader &reader, lbfgsfloatval_t *weights) {
-  logger << "beginning L-BFGS optimization" << std::endl;
-  const size_t n = model.nfeatures();
-  lbfgs_parameter_t param;
+void Tagger::Impl::perceptron_decode(const Instance &instance, Buffers &b,
+    Tags &path, std::vector<uint16_t> &backpointers) {
+  PDFs &states = b.states;
+  PDFs &scores = b.alphas;
+  PDFs &trans = b.trans;
+  const size_t size = instance.size();
+
+  b.reset(size);
+  for (size_t i = 0; i < size; ++i)
+    for (const uint32_t *j = instance.begin(i); j != instance.end(i); ++j) {
+      const TagPair &klasses = feature_klasses[*j];
+      if (klasses.prev == None::val)
+        states[i][klasses.curr] += lambdas[*j];
+    }
 
-  for (size_t i = 0; i < n; ++i)
-    weights[i] = 0.0;
+  for (Tag curr(2); curr < ntags; ++curr)
+    scores[0][curr] = states[0][curr];
 
-  lbfgs_parameter_init(&param);
-  param.max_iterations = cfg.niterations();
-  param.linesearch = LBFGS_LINESEARCH_MORETHUENTE;
-  param.epsilon = 1e-5;
-  param.delta = 1e-5;
-  param.past = 10;
+  for (size_t i = 1; i < size; ++i)
+    for (Tag curr(2); curr < ntags; ++curr) {
+      Tag best(2);
+      lbfgsfloatval_t max = scores[i-1][best] + trans[best][curr];
+      for (Tag prev(3); prev < ntags; ++prev) {
+        lbfgsfloatval_t score = scores[i-1][prev] + trans[prev][curr];
+        if (score > max) {
+          max = score;
+          best = prev;
+        }
+      }
+      scores[i][curr] = max + states[i][curr];
+      backpointers[i * ntags + curr] = best;
+    }
 
-  attributes.assign_lambdas(weights);
-  clock_begin = clock();
+  path.resize(size);
+  Tag best(2);
+  for (Tag curr(3); curr < ntags; ++curr)
+    if (scores[size - 1][curr] > scores[size - 1][best])
+      best = curr;
+  path[size - 1] = best;
+  for (size_t i = size - 1; i > 0; --i)
+    path[i - 1] = backpointers[i * ntags + path[i]];
+}
+
+/**
+ * perceptron_update.
+ * Applies the perceptron update for a decoded training instance: +1 to the
+ * lambda of each feature that matches the gold tags, and -1 to each feature
+ * that matches the predicted tags. Only positions where the gold and
+ * predicted tags (or tag pairs) differ are visited, since the updates
+ * cancel elsewhere.
+ *
+ * The averaged lambdas are maintained with the usual trick of accumulating
+ * c * update in sums, where c counts the instances seen so far; the average
+ * at the end of training is lambda - sums / c. This keeps each update
+ * sparse, rather than adding the whole weight vector to a running total
+ * after every instance.
+ *
+ * The transition scores in b.trans are updated along with the transition
+ * lambdas. Returns the number of mistagged positions.
+ */
+size_t Tagger::Impl::perceptron_update(const Instance &instance, Buffers &b,
+    const Tags &path, const std::vector<int64_t> &pair_ids,
+    lbfgsfloatval_t *sums, const lbfgsfloatval_t c) {
+  PDFs &trans = b.trans;
+  size_t nerrors = 0;
+
+  for (size_t i = 0; i < instance.size(); ++i) {
+    const TagPair &gold = instance.klass(i);
+    const TagPair pred(i > 0 ? path[i - 1] : gold.prev, path[i]);
+    const bool state_error = gold.curr != pred.curr;
+    if (!state_error && gold == pred)
+      continue;
+    if (state_error)
+      ++nerrors;
+
+    for (const uint32_t *j = instance.begin(i); j != instance.end(i); ++j) {
+      const TagPair &klasses = feature_klasses[*j];
+      lbfgsfloatval_t update = 0.0;
+      if (klasses.prev == None::val) {
+        if (state_error)
+          update = (klasses.curr == gold.curr) - (klasses.curr == pred.curr);
+      }
+      else
+        update = (klasses == gold) - (klasses == pred);
+      if (update != 0.0) {
+        lambdas[*j] += update;
+        sums[*j] += c * update;
+      }
+    }
 
-  int ret = lbfgs(n, weights, NULL, lbfgs_evaluate, lbfgs_progress, (void *)this, &param);
+    if (i > 0) {
+      int64_t id = pair_ids[gold.index(ntags)];
+      if (id >= 0) {
+        lambdas[id] += 1.0;
+        sums[id] += c;
+        trans[gold.prev][gold.curr] += 1.0;
+      }
+      id = pair_ids[pred.index(ntags)];
+      if (id >= 0) {
+        lambdas[id] -= 1.0;
+        sums[id] -= c;
+        trans[pred.prev][pred.curr] -= 1.0;
+      }
+    }
+  }
 
-  logger << "L-BFGS optimization terminated with status code " << ret << std::endl;
+  return nerrors;
 }
 
 /**
- * train_sgd.
- * Perform stochastic gradient descent optimization given a labelled training
- * dataset.
+ * train_perceptron.
+ * Trains an averaged structured perceptron given a labelled training dataset.
+ *
+ * Each epoch shuffles the training instances, decodes each one with Viterbi
+ * over the current lambdas, and updates the features on the positions that
+ * were mistagged. Decoding is the same cost as tagging, and no marginals are
+ * computed. At the end of training, the lambdas are replaced by their
+ * averages over every instance seen, which are saved as normal.
  */
-void Tagger::Impl::train_sgd(Reader &reader, lbfgsfloatval_t *weights) {
-  logger << "beginning SGD optimization" << std::endl;
+void Tagger::Impl::train_perceptron(Reader &reader, lbfgsfloatval_t *weights) {
+  logger << "beginning averaged perceptron training" << std::endl;
   const size_t n = model.nfeatures();
-  lbfgsfloatval_t lambda = 1.0 / (instances.size() * cfg.sigma() * cfg.sigma());
-  InstancePtrs instance_ptrs; // randomly shuffling pointers is faster
-
-  for (Instances::iterator i = instances.begin(); i != instances.end(); ++i)
-    instance_ptrs.push_back(&(*i));
+  lbfgsfloatval_t *sums = new lbfgsfloatval_t[n];
+  std::vector<uint16_t> backpointers(model.max_size() * ntags, 0);
+  std::vector<int64_t> pair_ids(TagPair::npairs(ntags), -1);
+  InstanceRefs refs;
+  Tags path;
+  lbfgsfloatval_t c = 1.0;
+
+  reset_weights(weights);
+  std::fill(sums, sums + n, 0.0);
+  buffers.trans.fill(0.0);
+  for (size_t i = 0; i < trans_ids.size(); ++i) {
+    const TagPair &pair = feature_klasses[trans_ids[i]];
+    pair_ids[pair.index(ntags)] = trans_ids[i];
+    buffers.trans[pair.prev][pair.curr] = weights[trans_ids[i]];
+  }
+  for (size_t i = 0; i < instances.size(); ++i)
+    refs.push_back(instances[i]);
 
-  for (size_t i = 0; i < n; ++i)
-    weights[i] = 0.0;
+  for (uint64_t epoch = 1; epoch <= cfg.niterations(); ++epoch) {
+    clock_begin = clock();
+    logger << "Epoch " << epoch << std::endl;
+    std::random_shuffle(refs.begin(), refs.end());
+
+    size_t nerrors = 0;
+    for (InstanceRefs::iterator i = refs.begin(); i != refs.end(); ++i) {
+      if (i->size() == 0)
+        continue;
+      perceptron_decode(*i, buffers, path, backpointers);
+      nerrors += perceptron_update(*i, buffers, path, pair_ids, sums, c);
+      c += 1.0;
+    }
 
-  attributes.assign_lambdas(weights);
+    logger << "  Errors = " << nerrors << '/' << instances.ntokens() << std::endl;
+    logger << "  Epoch time = " << duration_s() << "s\n" << std::endl;
+    if (nerrors == 0)
+      break;
+  }
 
-  clock_begin = clock();
-  lbfgsfloatval_t t0 = calibrate(instance_ptrs, weights, lambda, cfg.eta(), n);
-  logger << "Calibration time: " << duration_s() << "s\n" << std::endl;
+  for (size_t i = 0; i < n; ++i)
+    weights[i] -= sums[i] / c;
 
-  clock_begin = clock();
-  sgd_iterate(instance_ptrs, weights, n, instance_ptrs.size(), t0, lambda, cfg.niterations(), cfg.period());
+  delete [] sums;
 }
 
 void Tagger::Impl::train_loopy_bp(Reader &reader, lbfgsfloatval_t *weights) {
   logger << "beginning loopy BP optimization" << std::endl;
   const size_t n = model.nfeatures();
   graph.build(model.max_size());
-
-  for (size_t i = 0; i < n; ++i)
-    weights[i] = 0.0;
+  buffers.init_psis(ntags, model.max_size());
+  reset_weights(weights);
 
   attributes.assign_lambdas(weights);
   clock_begin = clock();
-  for (Instances::iterator i = instances.begin(); i != instances.end(); ++i) {
-    Contexts &contexts = *i;
-    reset(contexts.size());
-    compute_psis(contexts, psis);
-    //print_psis(contexts, psis);
+  for (size_t i = 0; i < instances.size(); ++i) {
+    Instance instance = instances[i];
+    buffers.reset(instance.size());
+    compute_psis(instance, buffers.psis);
+    //print_psis(instance, buffers.psis);
   }
   regularised_llhood();
 
@@ -1046,6 +2895,11 @@ void Tagger::Impl::reg(void) {
  * Loads the lexicon and tag hash tables, registers the active features, and
  * loads the trained model. This function must be called before tagging
  * sentences.
+ *
+ * A model trained on lattices pruned by the tag dictionary has no useful
+ * weights for the tags that the restricted words were pruned to exclude,
+ * so it is only tagged with the same tag dictionary. The cutoff saved with
+ * the model is used, and a different tagdict_cutoff is an error.
  */
 void Tagger::Impl::load(void) {
   lexicon.load();
@@ -1053,14 +2907,27 @@ void Tagger::Impl::load(void) {
   limits.calc();
   reg();
   _load_model(model);
+  if (cfg.tagdict_cutoff() && cfg.tagdict_cutoff() != model.tagdict_cutoff())
+    throw Util::config::ConfigException(model.tagdict_cutoff() ?
+        "the model was trained with a different tag dictionary cutoff" :
+        "the model was trained without the tag dictionary, so it cannot be applied when tagging", "tagdict_cutoff");
+  if (model.tagdict_cutoff())
+    tagdict.load(tags, model.tagdict_cutoff());
 }
 
 /**
  * _load_model.
  * Reads the model statistics, and loads the feature lambdas and attributes.
+ * A hashed model has no attributes file, so its features are loaded into
+ * the hashed attributes table instead of the feature dictionaries.
  */
 void Tagger::Impl::_load_model(Model &model) {
   model.read_config();
+  if (model.hash_bits()) {
+    attributes.hash_keys(model.hash_bits());
+    attributes.load_hashed(cfg.features());
+    return;
+  }
   _read_weights(model);
   _read_attributes(model);
 }
@@ -1156,12 +3023,321 @@ void Tagger::Impl::_read_attributes(Model &model) {
     throw IOException("number of attributes read is not equal to configuration value", cfg.attributes(), nlines);
 }
 
+namespace {
+
+  // the number of sentences read for each thread at a time during parallel
+  // feature extraction
+  const size_t EXTRACT_BLOCK = 4096;
+
+  // the number of sentences in the tagging pipeline for each tagger thread
+  const size_t PIPELINE_SLOTS = 64;
+
+}
+
+void Tagger::Impl::Extractor::run(void) {
+  try {
+    Contexts unused;
+    for (size_t i = begin; i != end; ++i) {
+      Sentence &sent = block[i];
+      if (count)
+        impl.registry.generate(*attributes, impl.lexicon, impl.tags, sent, impl.chains, unused, true);
+      else if (impl.in_shard(offset + i)) {
+        Contexts contexts(sent.words.size());
+        impl.registry.generate(impl.attributes, impl.lexicon, impl.tags, sent, impl.chains, contexts, false);
+        impl.add_instance(instances, sent, contexts);
+      }
+    }
+  }
+  catch (std::exception &e) {
+    error = e.what();
+  }
+}
+
+/**
+ * add_instance.
+ * Appends the contexts built for a sentence to instances, along with the
+ * candidate tags of each word when the training lattices are pruned with
+ * the tag dictionary.
+ */
+void Tagger::Impl::add_instance(Instances &instances, const Sentence &sent,
+    const Contexts &contexts) {
+  instances.add(contexts, lambdas);
+  if (!model.tagdict_cutoff())
+    return;
+  for (size_t i = 0; i < sent.words.size(); ++i) {
+    TagDict::Candidates c = candidates(sent, i);
+    instances.add_candidates(c.begin, c.end);
+  }
+}
+
+/**
+ * generate.
+ * Runs the feature generators over every sentence from the reader. If
+ * instances is NULL, the attributes and features are counted (pass 2).
+ * Otherwise the contexts of each sentence in the shard of this process are
+ * built and appended to instances (pass 3).
+ *
+ * With more than one thread, the sentences are read in blocks, and each
+ * block is split into one contiguous range per Extractor. The attributes
+ * and instances of the extractors are combined in the order of their
+ * ranges, so the attributes, feature ids and instances are identical to
+ * those built by a single thread.
+ */
+void Tagger::Impl::generate(Reader &reader, Instances *instances) {
+  const size_t nthreads = cfg.threads() ? cfg.threads() : 1;
+  const bool count = instances == 0;
+
+  if (nthreads == 1) {
+    Sentence sent;
+    Contexts unused;
+    for (size_t i = 0; reader.next(sent); ++i) {
+      if (count)
+        registry.generate(attributes, lexicon, tags, sent, chains, unused, true);
+      else if (in_shard(i)) {
+        Contexts contexts(sent.words.size());
+        registry.generate(attributes, lexicon, tags, sent, chains, contexts, false);
+        add_instance(*instances, sent, contexts);
+      }
+      sent.reset();
+    }
+    return;
+  }
+
+  Sentences block(nthreads * EXTRACT_BLOCK);
+  Extractors extractors;
+  try {
+    for (size_t t = 0; t < nthreads; ++t)
+      extractors.push_back(new Extractor(*this, block, count));
+
+    size_t n = block.size();
+    for (size_t offset = 0; n == block.size(); offset += n) {
+      for (n = 0; n < block.size(); ++n) {
+        block[n].reset();
+        if (!reader.next(block[n]))
+          break;
+      }
+
+      const size_t range = (n + nthreads - 1) / nthreads;
+      for (size_t t = 0; t < nthreads; ++t) {
+        Extractor &e = *extractors[t];
+        e.begin = std::min(n, t * range);
+        e.end = std::min(n, e.begin + range);
+        e.offset = offset;
+        if (count) {
+          delete e.attributes;
+          e.attributes = new Attributes();
+          e.attributes->copy_key_filter(attributes);
+        }
+        e.start();
+      }
+
+      for (size_t t = 0; t < nthreads; ++t) {
+        Extractor &e = *extractors[t];
+        e.join();
+        if (!e.error.empty())
+          throw Exception(e.error);
+        if (count)
+          attributes.merge(*e.attributes);
+        else {
+          instances->append(e.instances);
+          e.instances = Instances();
+        }
+      }
+    }
+  }
+  catch (...) {
+    for (Extractors::iterator i = extractors.begin(); i != extractors.end(); ++i)
+      delete *i;
+    throw;
+  }
+
+  for (Extractors::iterator i = extractors.begin(); i != extractors.end(); ++i)
+    delete *i;
+}
+
+/**
+ * Pipeline::fail.
+ * Records the first error in any stage and wakes every stage so that they
+ * stop. Must be called with the mutex held.
+ */
+void Tagger::Impl::Pipeline::fail(const std::string &msg) {
+  if (error.empty())
+    error = msg.empty() ? "tagging failed" : msg;
+  changed.broadcast();
+}
+
+/**
+ * PipelineReader::run.
+ * Reads each sentence into its slot once the writer has freed it.
+ */
+void Tagger::Impl::PipelineReader::run(void) {
+  Pipeline &p = pipeline;
+  const size_t nslots = p.sents.size();
+  try {
+    for ( ; ; ) {
+      Sentence *sent;
+      {
+        Util::Lock lock(p.mutex);
+        while (p.nread - p.nwritten == nslots && p.error.empty())
+          p.changed.wait(p.mutex);
+        if (!p.error.empty())
+          return;
+        sent = &p.sents[p.nread % nslots];
+      }
+
+      const bool more = reader.next(*sent);
+
+      Util::Lock lock(p.mutex);
+      if (!more) {
+        p.eof = true;
+        p.changed.broadcast();
+        return;
+      }
+      p.status[p.nread++ % nslots] = Pipeline::READ;
+      p.changed.broadcast();
+    }
+  }
+  catch (std::exception &e) {
+    Util::Lock lock(p.mutex);
+    p.fail(e.what());
+  }
+}
+
+/**
+ * PipelineTagger::run.
+ * Claims the next sentence that has been read, tags it and marks it as
+ * tagged, until the input is exhausted.
+ */
+void Tagger::Impl::PipelineTagger::run(void) {
+  Pipeline &p = pipeline;
+  const size_t nslots = p.sents.size();
+  try {
+    for ( ; ; ) {
+      size_t slot;
+      {
+        Util::Lock lock(p.mutex);
+        while (p.next == p.nread && !p.eof && p.error.empty())
+          p.changed.wait(p.mutex);
+        if (!p.error.empty() || p.next == p.nread)
+          return;
+        slot = p.next++ % nslots;
+      }
+
+      impl.tag(state, p.sents[slot]);
+      state.reset();
+
+      Util::Lock lock(p.mutex);
+      p.status[slot] = Pipeline::TAGGED;
+      p.changed.broadcast();
+    }
+  }
+  catch (std::exception &e) {
+    Util::Lock lock(p.mutex);
+    p.fail(e.what());
+  }
+}
+
+/**
+ * run_tag.
+ * Tags each sentence from the reader and writes it to the writer, in input
+ * order.
+ *
+ * With more than one thread, tagging is a pipeline: a reader thread, a pool
+ * of tagger threads, each with its own State but sharing the loaded model
+ * (which is read-only), and the calling thread as the writer, all running
+ * concurrently (see Pipeline). The sentences are written in input order, so
+ * the output is identical to single threaded tagging.
+ */
+void Tagger::Impl::run_tag(Reader &reader, Writer &writer) {
+  load();
+  const size_t nthreads = cfg.threads() ? cfg.threads() : 1;
+  kernels = &Util::simd::kernels(cfg.simd());
+
+  if (nthreads == 1) {
+    Sentence sent;
+    State state(tags.size(), *kernels);
+    while (reader.next(sent)) {
+      tag(state, sent);
+      writer.next(sent);
+      sent.reset();
+      state.reset();
+    }
+    return;
+  }
+
+  Pipeline p(nthreads * PIPELINE_SLOTS);
+  const size_t nslots = p.sents.size();
+  PipelineReader stage(p, reader);
+  PipelineTaggers taggers;
+  try {
+    for (size_t t = 0; t < nthreads; ++t)
+      taggers.push_back(new PipelineTagger(*this, p));
+    stage.start();
+    for (PipelineTaggers::iterator i = taggers.begin(); i != taggers.end(); ++i)
+      (*i)->start();
+
+    for ( ; ; ) {
+      Sentence *sent;
+      {
+        Util::Lock lock(p.mutex);
+        while (p.error.empty() && !(p.nwritten < p.nread && p.status[p.nwritten % nslots] == Pipeline::TAGGED) &&
+            !(p.eof && p.nwritten == p.nread))
+          p.changed.wait(p.mutex);
+        if (!p.error.empty() || p.nwritten == p.nread)
+          break;
+        sent = &p.sents[p.nwritten % nslots];
+      }
+
+      try {
+        writer.next(*sent);
+      }
+      catch (std::exception &e) {
+        Util::Lock lock(p.mutex);
+        p.fail(e.what());
+        break;
+      }
+      sent->reset();
+
+      Util::Lock lock(p.mutex);
+      p.status[p.nwritten++ % nslots] = Pipeline::FREE;
+      p.changed.broadcast();
+    }
+  }
+  catch (...) {
+    {
+      Util::Lock lock(p.mutex);
+      p.fail("");
+    }
+    stage.join();
+    for (PipelineTaggers::iterator i = taggers.begin(); i != taggers.end(); ++i)
+      (*i)->join();
+    for (PipelineTaggers::iterator i = taggers.begin(); i != taggers.end(); ++i)
+      delete *i;
+    throw;
+  }
+
+  // each tagger must finish running before it is destroyed, since ~Thread
+  // only joins after the derived PipelineTagger (and its State) is gone
+  stage.join();
+  for (PipelineTaggers::iterator i = taggers.begin(); i != taggers.end(); ++i)
+    (*i)->join();
+  for (PipelineTaggers::iterator i = taggers.begin(); i != taggers.end(); ++i)
+    delete *i;
+  if (!p.error.empty())
+    throw Exception(p.error);
+}
+
 /**
  * extract.
  * Runs the feature extraction process by calling the pure virtual functions
  * _pass1, _pass2, and _pass3. These methods are to be implemented by the
  * Tagger::Impl subclasses.
  *
+ * The input is read and parsed only once: pass 1 spools each sentence as
+ * interned string ids (in memory, or in the spool file if one is given),
+ * and passes 2 and 3 replay the spool. This means the input does not need
+ * to be seekable, so training data can be read from stdin.
+ *
  * In general:
  *
  *  _pass1: extracts the word lexicon, the tags present in the
@@ -1176,26 +3352,378 @@ void Tagger::Impl::_read_attributes(Model &model) {
  *    any relevant cutoffs for eliminating rare attributes and features is
  *    applied
  *
- *  _pass3: constructs the instances vector used in training. For each
- *          training instance, build a vector of contexts, one for each word
- *          in the sentence. For each context, compute a feature vector that
+ *  _pass3: constructs the instances used in training. For each training
+ *          instance, build a vector of contexts, one for each word in the
+ *          sentence. For each context, compute a feature vector that
  *          consists of pointers to the appropriate feature object in the
- *          attributes dictionary
+ *          attributes dictionary. The contexts are then appended to the
+ *          compact instances storage as dense feature ids
+ *
+ * If a sketch size is given and the cutoffs are above one, pass 2 is
+ * preceded by a pass that only counts the attributes in a count-min sketch.
+ * Pass 2 then skips attributes whose estimated count is below the cutoffs.
+ * The estimate is never below the true count, so the skipped attributes
+ * would have been removed by the cutoffs anyway, and the model is unchanged
+ * while most of the rare attributes are never stored.
+ *
+ * The lambdas are allocated and assigned to the features after the cutoffs
+ * are applied and before _pass3, since the dense id of a feature is the
+ * offset of its lambda. The tagpair of each feature is copied into a dense
+ * array in the same order, and the ids of the transition features (which
+ * are loaded during _pass3) are collected afterwards.
  */
-void Tagger::Impl::extract(Reader &reader, Instances &instances) {
+void Tagger::Impl::extract(Reader &input, Instances &instances) {
+  SpoolReader reader(input, cfg.spool());
+  if (cfg.threads() > 1)
+    logger << "extracting features with " << cfg.threads() << " threads" << std::endl;
   logger << "beginning pass 1" << std::endl;
   _pass1(reader);
   reader.reset();
-  logger << "beginning pass 2" << std::endl;
-  _pass2(reader);
+  logger << "spooled " << reader.nsents() << " sentences with " << reader.nstrings() << " distinct strings" << std::endl;
+
+  // an attribute or feature can only pass the cutoffs if the attribute was
+  // observed at least this many times
+  const uint64_t min_freq = std::max(cfg.cutoff_default(), cfg.cutoff_attribs());
+  const uint64_t min_word_freq = std::max(cfg.cutoff_words(), cfg.cutoff_attribs());
+  if (cfg.sketch() && std::max(min_freq, min_word_freq) > 1) {
+    Util::CountMinSketch sketch(cfg.sketch());
+    logger << "beginning sketch pass with " << sketch.bytes() / (1024 * 1024) << "MB of counters" << std::endl;
+    attributes.count_keys(&sketch);
+    count_attributes(reader);
+    attributes.count_keys(0);
+    reader.reset();
+
+    logger << "beginning pass 2" << std::endl;
+    attributes.filter_keys(&sketch, Types::w, min_word_freq, min_freq);
+    _pass2(reader);
+    attributes.filter_keys(0, Types::w, 0, 0);
+  }
+  else {
+    if (cfg.sketch())
+      logger << "ignoring sketch since no cutoffs are set" << std::endl;
+    logger << "beginning pass 2" << std::endl;
+    _pass2(reader);
+  }
+  logger << "stored " << attributes.size() << " attributes" << std::endl;
 
   attributes.apply_cutoff(Types::w, cfg.cutoff_words(), cfg.cutoff_default());
   if (cfg.cutoff_attribs() > 1)
     attributes.apply_attrib_cutoff(cfg.cutoff_attribs());
 
+  model.nattributes(attributes.size());
+  model.nfeatures(attributes.nfeatures());
+  lambdas = new lbfgsfloatval_t[model.nfeatures()];
+  std::fill(lambdas, lambdas + model.nfeatures(), 0.0);
+  attributes.assign_lambdas(lambdas);
+
+  feature_klasses.resize(model.nfeatures());
+  attributes.copy_klasses(feature_klasses.empty() ? 0 : &feature_klasses[0]);
+  if (cfg.tagdict_cutoff()) {
+    tagdict.load(tags, cfg.tagdict_cutoff());
+    logger << "restricting " << tagdict.nrestricted() << '/' << tagdict.size() << " words to their tags in the tag dictionary" << std::endl;
+  }
+
   reader.reset();
   logger << "beginning pass 3" << std::endl;
   _pass3(reader, instances);
+
+  FeaturePtrs &trans_features = attributes.trans_features();
+  for (FeaturePtrs::iterator i = trans_features.begin(); i != trans_features.end(); ++i)
+    if ((*i)->lambda)
+      trans_ids.push_back((*i)->lambda - lambdas);
+  logger << "stored " << instances.ntokens() << " tokens with " << instances.nentries() << " active features" << std::endl;
+  if (instances.pruned())
+    logger << "stored " << instances.ncandidates() << " candidate tags for the restricted tokens" << std::endl;
+}
+
+namespace {
+
+  // identify the checkpoint files, and change whenever their layout does
+  const uint64_t EXTRACTION_MAGIC = 0x7874652d66726302ULL;
+  const uint64_t CHECKPOINT_MAGIC = 0x74706b2d66726301ULL;
+
+  /**
+   * commit.
+   * Closes a file written to filename + ".tmp" and renames it to filename,
+   * so that a crash part way through writing never leaves a truncated file
+   * in place of the previous one.
+   */
+  void commit(std::ofstream &out, const std::string &filename) {
+    const std::string tmp = filename + ".tmp";
+    out.close();
+    if (!out)
+      throw IOException("could not write file", tmp);
+    if (rename(tmp.c_str(), filename.c_str()))
+      throw IOException("could not rename file", tmp);
+  }
+
+}
+
+/**
+ * Checkpoint::save.
+ * Writes the checkpoint to filename in binary.
+ */
+void Tagger::Impl::Checkpoint::save(const std::string &filename) const {
+  const std::string tmp = filename + ".tmp";
+  std::ofstream out(tmp.c_str(), std::ios::binary);
+  if (!out)
+    throw IOException("unable to open file for writing", tmp);
+
+  Util::binary::write(out, CHECKPOINT_MAGIC);
+  Util::binary::write(out, trainer);
+  Util::binary::write(out, iteration);
+  Util::binary::write(out, t);
+  Util::binary::write(out, t0);
+  Util::binary::write(out, best_loss);
+  Util::binary::write(out, losses);
+  Util::binary::write(out, weights);
+  commit(out, filename);
+}
+
+/**
+ * Checkpoint::load.
+ * Reads a checkpoint written by save.
+ */
+void Tagger::Impl::Checkpoint::load(const std::string &filename) {
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if (!in)
+    throw IOException("could not open file", filename);
+
+  uint64_t magic;
+  Util::binary::read(in, magic);
+  if (magic != CHECKPOINT_MAGIC)
+    throw IOException("not a training checkpoint", filename);
+  Util::binary::read(in, trainer);
+  Util::binary::read(in, iteration);
+  Util::binary::read(in, t);
+  Util::binary::read(in, t0);
+  Util::binary::read(in, best_loss);
+  Util::binary::read(in, losses);
+  Util::binary::read(in, weights);
+}
+
+/**
+ * CheckpointWriter::run.
+ * Writes the extraction artifacts (the first time only) and the checkpoint.
+ * The extraction artifacts are not changed by training, so they are read
+ * directly rather than copied.
+ */
+void Tagger::Impl::CheckpointWriter::run(void) {
+  try {
+    if (save_extraction) {
+      impl.save_extraction(impl.cfg.checkpoint() + ".extract");
+      save_extraction = false;
+    }
+    checkpoint.save(impl.cfg.checkpoint() + ".state");
+  }
+  catch (IOException &e) {
+    error = e.msg + " " + e.uri;
+  }
+}
+
+/**
+ * save_extraction.
+ * Writes everything that training needs from feature extraction: the model
+ * sizes, the attributes and features with their frequencies, the training
+ * instances, and the dense tagpair and transition feature arrays. With the
+ * tags file saved in pass 1, this is enough to resume training.
+ */
+void Tagger::Impl::save_extraction(const std::string &filename) const {
+  const std::string tmp = filename + ".tmp";
+  std::ofstream out(tmp.c_str(), std::ios::binary);
+  if (!out)
+    throw IOException("unable to open file for writing", tmp);
+
+  Util::binary::write(out, EXTRACTION_MAGIC);
+  Util::binary::write(out, (uint64_t)model.nattributes());
+  Util::binary::write(out, (uint64_t)model.nfeatures());
+  Util::binary::write(out, (uint64_t)model.max_size());
+  attributes.save_binary(out);
+  instances.save(out);
+  Util::binary::write(out, feature_klasses);
+  Util::binary::write(out, trans_ids);
+  commit(out, filename);
+}
+
+/**
+ * load_extraction.
+ * Reads the extraction artifacts written by save_extraction, and allocates
+ * and assigns the lambdas as extract does.
+ */
+void Tagger::Impl::load_extraction(const std::string &filename) {
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if (!in)
+    throw IOException("could not open file", filename);
+
+  uint64_t magic, nattributes, nfeatures, max_size;
+  Util::binary::read(in, magic);
+  if (magic != EXTRACTION_MAGIC)
+    throw IOException("not a training checkpoint", filename);
+  Util::binary::read(in, nattributes);
+  Util::binary::read(in, nfeatures);
+  Util::binary::read(in, max_size);
+  attributes.load_binary(in);
+  instances.load(in);
+  Util::binary::read(in, feature_klasses);
+  Util::binary::read(in, trans_ids);
+  if (attributes.nfeatures() != nfeatures || feature_klasses.size() != nfeatures)
+    throw IOException("inconsistent number of features in checkpoint", filename);
+
+  model.nattributes(nattributes);
+  model.nfeatures(nfeatures);
+  model.max_size(max_size);
+  lambdas = new lbfgsfloatval_t[nfeatures];
+  std::fill(lambdas, lambdas + nfeatures, 0.0);
+  attributes.assign_lambdas(lambdas);
+  logger << "loaded " << instances.ntokens() << " tokens with " << instances.nentries() << " active features" << std::endl;
+}
+
+/**
+ * resume.
+ * Loads the tags saved in pass 1, the extraction artifacts and the latest
+ * checkpoint in place of feature extraction, and restores the lambdas.
+ * The trainer then continues from the iteration after the checkpoint.
+ */
+void Tagger::Impl::resume(const std::string &trainer) {
+  if (trainer != "lbfgs" && trainer != "sgd")
+    throw ValueException("only lbfgs and sgd training can be resumed", trainer);
+
+  logger << "resuming from checkpoint " << cfg.checkpoint() << std::endl;
+  tags.load();
+  load_extraction(cfg.checkpoint() + ".extract");
+
+  const std::string filename = cfg.checkpoint() + ".state";
+  resumed = new Checkpoint;
+  resumed->load(filename);
+  if (resumed->trainer != trainer)
+    throw IOException("checkpoint was saved by the " + resumed->trainer + " trainer", filename);
+  if (resumed->weights.size() != model.nfeatures())
+    throw IOException("inconsistent number of weights in checkpoint", filename);
+
+  std::copy(resumed->weights.begin(), resumed->weights.end(), lambdas);
+  logger << "resuming " << trainer << " training after iteration " << resumed->iteration << std::endl;
+}
+
+/**
+ * checkpoint.
+ * Called at the end of each L-BFGS iteration or SGD epoch. If checkpoints
+ * are enabled and one is due, waits for the previous checkpoint to finish
+ * writing, copies the current state and weights, and starts writing them
+ * in the background.
+ */
+void Tagger::Impl::checkpoint(const lbfgsfloatval_t *weights, const uint64_t iteration) {
+  if (!checkpointer)
+    return;
+
+  const uint64_t every = cfg.checkpoint_every();
+  const double minutes = cfg.checkpoint_minutes();
+  if (!(every && iteration % every == 0) && !(minutes > 0.0 && difftime(time(0), checkpoint_time) >= minutes * 60.0))
+    return;
+
+  checkpointer->join();
+  if (!checkpointer->error.empty()) {
+    logger << "  could not save the previous checkpoint: " << checkpointer->error << std::endl;
+    checkpointer->error.clear();
+  }
+
+  progress.iteration = iteration;
+  checkpointer->checkpoint = progress;
+  checkpointer->checkpoint.weights.assign(weights, weights + model.nfeatures());
+  checkpoint_time = time(0);
+  checkpointer->start();
+  logger << "  Saving checkpoint for iteration " << iteration << std::endl;
+}
+
+/**
+ * init_from_model.
+ * Maps the weights of the model saved in dir onto the features of the
+ * current training data, to warm start training. Features are matched by
+ * the type and text value of their attribute and by the names of their
+ * tags, since the attribute, feature and tag ids of the two models are
+ * unrelated. Features that are not in the existing model start at zero,
+ * and features of the existing model that are no longer present (or were
+ * removed by a cutoff) are dropped.
+ */
+void Tagger::Impl::init_from_model(const std::string &dir) {
+  logger << "initializing weights from " << dir << std::endl;
+  const std::string prefix = dir + Util::port::PATH_SEP;
+  uint64_t nlines = 0;
+  std::string preface;
+
+  // map the tag ids of the existing model to the current tag ids
+  TagSet old_tags(prefix + "tags");
+  old_tags.load();
+  std::map<std::string, uint16_t> tag_ids;
+  for (size_t i = 0; i < tags.size(); ++i)
+    tag_ids[tags.str(i)] = i;
+  std::vector<int> tag_map(old_tags.size(), -1);
+  for (size_t i = 0; i < old_tags.size(); ++i) {
+    std::map<std::string, uint16_t>::iterator j = tag_ids.find(old_tags.str(i));
+    if (j != tag_ids.end())
+      tag_map[i] = j->second;
+  }
+
+  // the attributes file has one attribute per line: type, text value and
+  // frequency, where the text value may contain spaces
+  const std::string attributes_file = prefix + "attributes";
+  std::ifstream attributes_in(attributes_file.c_str());
+  if (!attributes_in)
+    throw IOException("could not open file", attributes_file);
+  read_preface(attributes_file, attributes_in, preface, nlines);
+
+  std::vector<std::pair<std::string, std::string> > old_attributes;
+  std::string line;
+  while (std::getline(attributes_in, line)) {
+    ++nlines;
+    const std::string::size_type first = line.find(' ');
+    const std::string::size_type last = line.rfind(' ');
+    if (first == std::string::npos || first == last)
+      throw IOException("could not parse attribute", attributes_file, nlines);
+    old_attributes.push_back(std::make_pair(line.substr(0, first), line.substr(first + 1, last - first - 1)));
+  }
+
+  const std::string features_file = prefix + "features";
+  std::ifstream features_in(features_file.c_str());
+  if (!features_in)
+    throw IOException("could not open file", features_file);
+  nlines = 0;
+  read_preface(features_file, features_in, preface, nlines);
+
+  initial.assign(model.nfeatures(), 0.0);
+  uint64_t attrib, prev, curr, freq, nmapped = 0, nold = 0;
+  lbfgsfloatval_t lambda;
+  while (features_in >> attrib >> prev >> curr >> freq >> lambda) {
+    ++nlines;
+    ++nold;
+    if (attrib >= old_attributes.size())
+      throw IOException("attribute id >= number of attributes", features_file, nlines);
+    if (prev >= tag_map.size() || curr >= tag_map.size() || tag_map[prev] < 0 || tag_map[curr] < 0)
+      continue;
+
+    const std::pair<std::string, std::string> &a = old_attributes[attrib];
+    lbfgsfloatval_t *x = attributes.find_lambda(a.first, a.second, TagPair(tag_map[prev], tag_map[curr]));
+    if (x) {
+      initial[x - lambdas] = lambda;
+      ++nmapped;
+    }
+  }
+  if (!features_in.eof())
+    throw IOException("could not parse weight tuple", features_file, nlines);
+
+  std::copy(initial.begin(), initial.end(), lambdas);
+  logger << "initialized " << nmapped << '/' << model.nfeatures() << " features from " << nold << " existing features" << std::endl;
+}
+
+/**
+ * reset_weights.
+ * Sets the weights to their starting values before optimization: the
+ * weights mapped from an existing model with init_model, or zero.
+ */
+void Tagger::Impl::reset_weights(lbfgsfloatval_t *weights) {
+  if (initial.empty())
+    std::fill(weights, weights + model.nfeatures(), 0.0);
+  else
+    std::copy(initial.begin(), initial.end(), weights);
 }
 
 /**
@@ -1206,48 +3734,133 @@ void Tagger::Impl::extract(Reader &reader, Instances &instances) {
 void Tagger::Impl::train(Reader &reader, const std::string &trainer) {
   clock_t begin = clock();
   clock_begin = begin;
-  logger << "beginning feature extraction" << std::endl;
-  reg();
-  extract(reader, instances);
+  if (!cfg.listen().empty() || !cfg.connect().empty()) {
+    if (trainer != "lbfgs")
+      throw ValueException("distributed training requires the lbfgs trainer", trainer);
+    if (cfg.resume())
+      throw Util::config::ConfigException("distributed training cannot be resumed from a checkpoint", "resume");
+    if (!cfg.connect().empty())
+      connect_coordinator();
+    else
+      accept_workers();
+  }
+
+  model.tagdict_cutoff(cfg.tagdict_cutoff());
+  if (cfg.tagdict_cutoff()) {
+    if (trainer == "perceptron" || trainer == "pl" || trainer == "piecewise" || trainer == "loopy_bp")
+      throw Util::config::ConfigException("the tag dictionary only prunes the forward-backward lattice, which the " + trainer + " trainer does not use", "tagdict_cutoff");
+    if (chains.size() > 1)
+      throw Util::config::ConfigException("the tag dictionary can only prune the lattice of a single chain", "tagdict_cutoff");
+  }
+
+  if (cfg.hash_bits()) {
+    if (cfg.resume())
+      throw Util::config::ConfigException("a hashed model cannot be resumed from a checkpoint", "resume");
+    if (!cfg.init_model().empty())
+      throw Util::config::ConfigException("a hashed model cannot be initialized from an existing model", "init_model");
+    attributes.hash_keys(cfg.hash_bits());
+    logger << "hashing attributes into " << (1ULL << cfg.hash_bits()) << " buckets" << std::endl;
+  }
+
+  if (cfg.resume())
+    resume(trainer);
+  else {
+    logger << "beginning feature extraction" << std::endl;
+    reg();
+    extract(reader, instances);
+  }
   limits.calc();
-  logger << "completed feature extraction in " << duration_s() << "s\n" << std::endl;
+  logger << "completed " << (resumed ? "loading the checkpoint" : "feature extraction") << " in " << duration_s() << "s\n" << std::endl;
+
+  if (!cfg.init_model().empty()) {
+    if (resumed)
+      logger << "ignoring init_model when resuming from a checkpoint" << std::endl;
+    else
+      init_from_model(cfg.init_model());
+  }
 
   ntags = tags.size();
   inv_sigma_sq = 1.0 / (cfg.sigma() * cfg.sigma());
 
-  // initialize the working vectors. each one is prepopulated to the size
-  // of the longest sentence seen in the training data to avoid the overhead
-  // of extra memory allocations during training
-  for (size_t i = 0; i < ntags; ++i)
-    trans_marginals.push_back(PDF(ntags, 0.0));
+  if (instances.pruned()) {
+    trans_index.assign(ntags * ntags, -1);
+    for (size_t i = 0; i < trans_ids.size(); ++i)
+      trans_index[feature_klasses[trans_ids[i]].index(ntags)] = trans_ids[i];
+    all_klasses.clear();
+    for (uint16_t tag = 2; tag < ntags; ++tag)
+      all_klasses.push_back(tag);
+  }
 
-  for (size_t i = 0; i < model.max_size(); ++i) {
-    alphas.push_back(PDF(ntags, 0.0));
-    betas.push_back(PDF(ntags, 0.0));
-    state_marginals.push_back(PDF(ntags, 0.0));
-    scale.push_back(1.0);
-    psis.push_back(PDFs(0));
-    for (size_t j = 0; j < ntags; ++j)
-      psis[i].push_back(PDF(ntags, 0.0));
+  lbfgsfloatval_t *weights = lambdas;
+  buffers.init(ntags, model.max_size(), model.nfeatures());
+  kernels = &Util::simd::kernels(cfg.simd());
+  logger << "using " << kernels->name << " kernels" << std::endl;
+
+  if (coordinator) {
+    serve();
+    delete [] weights;
+    lambdas = 0;
+    logger << "Total training time: " << (clock() - begin) / (60.0 * CLOCKS_PER_SEC) << " minutes" << std::endl;
+    return;
   }
+  if (!remotes.empty())
+    check_workers();
 
-  model.nattributes(attributes.size());
-  model.nfeatures(attributes.nfeatures());
-  lbfgsfloatval_t *weights = new lbfgsfloatval_t[model.nfeatures()];
+  progress.trainer = trainer;
+  if (cfg.checkpoint_every() || cfg.checkpoint_minutes() > 0.0) {
+    if (!remotes.empty() || (trainer != "lbfgs" && trainer != "sgd") || cfg.hash_bits())
+      logger << "checkpoints are only supported by single process lbfgs and sgd training without hashing" << std::endl;
+    else {
+      checkpointer = new CheckpointWriter(*this, !resumed);
+      checkpoint_time = time(0);
+    }
+  }
 
   if (trainer == "lbfgs")
     train_lbfgs(reader, weights);
   else if (trainer == "sgd")
     train_sgd(reader, weights);
+  else if (trainer == "adagrad")
+    train_adaptive(reader, weights, Adaptive::ADAGRAD);
+  else if (trainer == "adam")
+    train_adaptive(reader, weights, Adaptive::ADAM);
+  else if (trainer == "perceptron")
+    train_perceptron(reader, weights);
+  else if (trainer == "pl") {
+    logger << "using the pseudo-likelihood objective" << std::endl;
+    objective = PSEUDO_LIKELIHOOD;
+    train_lbfgs(reader, weights);
+  }
+  else if (trainer == "piecewise") {
+    logger << "using the piecewise objective" << std::endl;
+    objective = PIECEWISE;
+    train_lbfgs(reader, weights);
+  }
+  else if (trainer == "tron")
+    train_tron(reader, weights);
+  else if (trainer == "svrg")
+    train_svrg(reader, weights);
   else if (trainer == "loopy_bp")
     train_loopy_bp(reader, weights);
   else
     throw ValueException("Unknown training algorithm", trainer);
 
+  if (checkpointer) {
+    checkpointer->join();
+    if (!checkpointer->error.empty())
+      logger << "could not save the last checkpoint: " << checkpointer->error << std::endl;
+  }
+
+  uint64_t nattributes, nfeatures;
+  attributes.save(cfg.attributes(), cfg.features(), preface, nattributes, nfeatures);
+  logger << "saved " << nattributes << '/' << model.nattributes() << " attributes and " << nfeatures << '/' << model.nfeatures() << " features" << std::endl;
+  model.nattributes(nattributes);
+  model.nfeatures(nfeatures);
+  model.hash_bits(cfg.hash_bits());
   model.save(preface);
-  attributes.save_features(cfg.features(), preface);
   attributes.zero_lambdas();
   delete [] weights;
+  lambdas = 0;
 
   logger << "Total training time: " << (clock() - begin) / (60.0 * CLOCKS_PER_SEC) << " minutes" << std::endl;
 }
@@ -1276,6 +3889,18 @@ lbfgsfloatval_t Tagger::Impl::lbfgs_bp_evaluate(void *_instance,
   return reinterpret_cast<Tagger::Impl *>(_instance)->_lbfgs_bp_evaluate(x, g, n, step);
 }
 
+/**
+ * lbfgs_remote_evaluate.
+ * Static function required for libLBFGS. Casts the instance parameter to
+ * its true type of a Tagger::Impl pointer, and then calls the
+ * _lbfgs_remote_evaluate method on it.
+ */
+lbfgsfloatval_t Tagger::Impl::lbfgs_remote_evaluate(void *_instance,
+    const lbfgsfloatval_t *x, lbfgsfloatval_t *g, const int n,
+    const lbfgsfloatval_t step) {
+  return reinterpret_cast<Tagger::Impl *>(_instance)->_lbfgs_remote_evaluate(x, g, n, step);
+}
+
 /**
  * lbfgs_progress.
  * Static function required for libLBFGS. Prints out the progress of training
@@ -1305,12 +3930,14 @@ int Tagger::Impl::lbfgs_progress(void *instance, const lbfgsfloatval_t *x,
 
   Tagger::Impl *impl = reinterpret_cast<Tagger::Impl *>(instance);
   Log &logger = impl->logger;
-  logger << "Iteration " << k << '\n' << "  llhood = " << fx;
+  const uint64_t iteration = (impl->resumed ? impl->resumed->iteration : 0) + k;
+  logger << "Iteration " << iteration << '\n' << "  llhood = " << fx;
   logger << ", xnorm = " << xnorm << ", gnorm = " << gnorm;
   logger << ", step = " << step << ", trials = " << ls;
   logger << ", nactives = " << nactives << '/' << n;
   logger << ", time = " << impl->duration_s() << "s" << std::endl;
 
+  impl->checkpoint(x, iteration);
   impl->clock_begin = clock();
   return 0;
 }
@@ -0,0 +1,135 @@
+#include "base.h"
+
+#include "io/reader.h"
+#include "io/reader_spool.h"
+
+#include <cstdio>
+
+namespace NLP {
+
+  SpoolReader::SpoolReader(Reader &source, const std::string &filename)
+    : Reader(source), _source(source), _filename(filename), _ids(), _strings(),
+      _buffer(), _scratch(), _out(), _in(), _nsents(0), _position(0),
+      _recording(true) {
+    if (!_filename.empty()) {
+      _out.open(_filename.c_str(), std::ios::binary | std::ios::trunc);
+      if (!_out)
+        throw IOException("could not open spool file for writing", _filename);
+    }
+  }
+
+  SpoolReader::~SpoolReader(void) {
+    if (!_filename.empty()) {
+      _out.close();
+      _in.close();
+      std::remove(_filename.c_str());
+    }
+  }
+
+  /**
+   * record.
+   * Appends the number of strings in a field and their interned ids to the
+   * scratch buffer, assigning ids to strings that have not been seen.
+   */
+  void SpoolReader::record(const Raws &raws) {
+    _scratch.push_back(raws.size());
+    for (Raws::const_iterator i = raws.begin(); i != raws.end(); ++i) {
+      std::pair<Ids::iterator, bool> res = _ids.insert(Ids::value_type(*i, _strings.size()));
+      if (res.second)
+        _strings.push_back(*i);
+      _scratch.push_back(res.first->second);
+    }
+  }
+
+  /**
+   * replay.
+   * Reads the next field from the spool into raws. Returns false only if
+   * the spool is exhausted at the first field of a sentence.
+   */
+  bool SpoolReader::replay(Raws &raws, const bool first) {
+    const uint32_t *ids;
+    uint32_t n;
+    if (_filename.empty()) {
+      if (_position == _buffer.size()) {
+        if (first)
+          return false;
+        throw IOException("unexpected end of spooled input", uri);
+      }
+      n = _buffer[_position];
+      ids = &_buffer[_position + 1];
+      _position += n + 1;
+    }
+    else {
+      if (first && _in.peek() == std::char_traits<char>::eof())
+        return false;
+      Util::binary::read(_in, n);
+      _scratch.resize(n);
+      if (n && !_in.read(reinterpret_cast<char *>(&_scratch[0]), n * sizeof(uint32_t)))
+        throw IOException("unexpected end of spool file", _filename);
+      ids = n ? &_scratch[0] : 0;
+    }
+
+    raws.reserve(raws.size() + n);
+    for (uint32_t i = 0; i < n; ++i)
+      raws.push_back(_strings[ids[i]]);
+    return true;
+  }
+
+  bool SpoolReader::next(Sentence &sent) {
+    if (_recording) {
+      if (!_source.next(sent))
+        return false;
+
+      _scratch.clear();
+      record(sent.words);
+      record(sent.pos);
+      record(sent.chunks);
+      record(sent.entities);
+      if (_filename.empty())
+        _buffer.insert(_buffer.end(), _scratch.begin(), _scratch.end());
+      else if (!_out.write(reinterpret_cast<const char *>(&_scratch[0]), _scratch.size() * sizeof(uint32_t)))
+        throw IOException("could not write to spool file", _filename);
+      ++_nsents;
+      return true;
+    }
+
+    if (!replay(sent.words, true))
+      return false;
+    replay(sent.pos, false);
+    replay(sent.chunks, false);
+    replay(sent.entities, false);
+    return true;
+  }
+
+  /**
+   * reset.
+   * The first reset finishes spooling the rest of the source, and switches
+   * to replaying the spool. Later resets rewind the spool.
+   */
+  void SpoolReader::reset(void) {
+    if (_recording) {
+      Sentence sent;
+      while (next(sent))
+        sent.reset();
+      _recording = false;
+      _ids.clear();
+
+      if (!_filename.empty()) {
+        _out.close();
+        if (!_out)
+          throw IOException("could not write to spool file", _filename);
+        _in.open(_filename.c_str(), std::ios::binary);
+        if (!_in)
+          throw IOException("could not open spool file for reading", _filename);
+      }
+    }
+    else if (!_filename.empty()) {
+      _in.clear();
+      _in.seekg(0, std::ios::beg);
+      if (!_in)
+        throw IOException("spool file could not be seeked to the beginning", _filename);
+    }
+    _position = 0;
+  }
+
+}
@@ -0,0 +1,469 @@
+#include "std.h"
+#include "exception.h"
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace Util { namespace simd {
+
+/**
+ * Scalar reference implementations.
+ */
+static double dot_scalar(const double *a, const double *b, const size_t n) {
+  double sum = 0.0;
+  for (size_t i = 0; i < n; ++i)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+static double dot3_scalar(const double *a, const double *b, const double *c, const size_t n) {
+  double sum = 0.0;
+  for (size_t i = 0; i < n; ++i)
+    sum += a[i] * b[i] * c[i];
+  return sum;
+}
+
+static double mul_sum_scalar(double *y, const double *x, const size_t n) {
+  double sum = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    y[i] *= x[i];
+    sum += y[i];
+  }
+  return sum;
+}
+
+static void scale_scalar(double *y, const double s, const size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    y[i] *= s;
+}
+
+static void axpy_mul_scalar(double *y, const double s, const double *a, const double *b, const size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    y[i] += s * a[i] * b[i];
+}
+
+static void axpy_mul3_scalar(double *y, const double s, const double *a, const double *b, const double *c, const size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    y[i] += s * a[i] * b[i] * c[i];
+}
+
+static void max_plus_scalar(double *y, uint16_t *idx, const double s, const double *a, const uint16_t k, const size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    const double v = s + a[i];
+    if (v > y[i]) {
+      y[i] = v;
+      idx[i] = k;
+    }
+  }
+}
+
+static const Kernels SCALAR_KERNELS = {
+  SCALAR, "scalar", dot_scalar, dot3_scalar, mul_sum_scalar, scale_scalar,
+  axpy_mul_scalar, axpy_mul3_scalar, max_plus_scalar
+};
+
+#ifdef SIMD_X86
+
+/**
+ * SSE2 implementations. Two doubles per register.
+ */
+__attribute__((target("sse2")))
+static inline double hsum_sse2(__m128d v) {
+  return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+__attribute__((target("sse2")))
+static double dot_sse2(const double *a, const double *b, const size_t n) {
+  __m128d acc = _mm_setzero_pd();
+  size_t i = 0;
+  for ( ; i + 2 <= n; i += 2)
+    acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  double sum = hsum_sse2(acc);
+  for ( ; i < n; ++i)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+__attribute__((target("sse2")))
+static double dot3_sse2(const double *a, const double *b, const double *c, const size_t n) {
+  __m128d acc = _mm_setzero_pd();
+  size_t i = 0;
+  for ( ; i + 2 <= n; i += 2) {
+    __m128d ab = _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    acc = _mm_add_pd(acc, _mm_mul_pd(ab, _mm_loadu_pd(c + i)));
+  }
+  double sum = hsum_sse2(acc);
+  for ( ; i < n; ++i)
+    sum += a[i] * b[i] * c[i];
+  return sum;
+}
+
+__attribute__((target("sse2")))
+static double mul_sum_sse2(double *y, const double *x, const size_t n) {
+  __m128d acc = _mm_setzero_pd();
+  size_t i = 0;
+  for ( ; i + 2 <= n; i += 2) {
+    __m128d v = _mm_mul_pd(_mm_loadu_pd(y + i), _mm_loadu_pd(x + i));
+    _mm_storeu_pd(y + i, v);
+    acc = _mm_add_pd(acc, v);
+  }
+  double sum = hsum_sse2(acc);
+  for ( ; i < n; ++i) {
+    y[i] *= x[i];
+    sum += y[i];
+  }
+  return sum;
+}
+
+__attribute__((target("sse2")))
+static void scale_sse2(double *y, const double s, const size_t n) {
+  const __m128d vs = _mm_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 2 <= n; i += 2)
+    _mm_storeu_pd(y + i, _mm_mul_pd(_mm_loadu_pd(y + i), vs));
+  for ( ; i < n; ++i)
+    y[i] *= s;
+}
+
+__attribute__((target("sse2")))
+static void axpy_mul_sse2(double *y, const double s, const double *a, const double *b, const size_t n) {
+  const __m128d vs = _mm_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 2 <= n; i += 2) {
+    __m128d ab = _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(vs, ab)));
+  }
+  for ( ; i < n; ++i)
+    y[i] += s * a[i] * b[i];
+}
+
+__attribute__((target("sse2")))
+static void axpy_mul3_sse2(double *y, const double s, const double *a, const double *b, const double *c, const size_t n) {
+  const __m128d vs = _mm_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 2 <= n; i += 2) {
+    __m128d ab = _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+    __m128d abc = _mm_mul_pd(ab, _mm_loadu_pd(c + i));
+    _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(vs, abc)));
+  }
+  for ( ; i < n; ++i)
+    y[i] += s * a[i] * b[i] * c[i];
+}
+
+__attribute__((target("sse2")))
+static void max_plus_sse2(double *y, uint16_t *idx, const double s, const double *a, const uint16_t k, const size_t n) {
+  const __m128d vs = _mm_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 2 <= n; i += 2) {
+    const __m128d v = _mm_add_pd(vs, _mm_loadu_pd(a + i));
+    const __m128d old = _mm_loadu_pd(y + i);
+    const __m128d gt = _mm_cmpgt_pd(v, old);
+    const int mask = _mm_movemask_pd(gt);
+    if (mask) {
+      _mm_storeu_pd(y + i, _mm_or_pd(_mm_and_pd(gt, v), _mm_andnot_pd(gt, old)));
+      for (int j = 0; j < 2; ++j)
+        if (mask & (1 << j))
+          idx[i + j] = k;
+    }
+  }
+  for ( ; i < n; ++i)
+    if (s + a[i] > y[i]) {
+      y[i] = s + a[i];
+      idx[i] = k;
+    }
+}
+
+static const Kernels SSE2_KERNELS = {
+  SSE2, "sse2", dot_sse2, dot3_sse2, mul_sum_sse2, scale_sse2,
+  axpy_mul_sse2, axpy_mul3_sse2, max_plus_sse2
+};
+
+/**
+ * AVX2 implementations. Four doubles per register, with fused multiply-add.
+ */
+__attribute__((target("avx2,fma")))
+static inline double hsum_avx2(__m256d v) {
+  __m128d lo = _mm256_castpd256_pd128(v);
+  __m128d hi = _mm256_extractf128_pd(v, 1);
+  lo = _mm_add_pd(lo, hi);
+  return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx2,fma")))
+static double dot_avx2(const double *a, const double *b, const size_t n) {
+  __m256d acc = _mm256_setzero_pd();
+  size_t i = 0;
+  for ( ; i + 4 <= n; i += 4)
+    acc = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), acc);
+  double sum = hsum_avx2(acc);
+  for ( ; i < n; ++i)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static double dot3_avx2(const double *a, const double *b, const double *c, const size_t n) {
+  __m256d acc = _mm256_setzero_pd();
+  size_t i = 0;
+  for ( ; i + 4 <= n; i += 4) {
+    __m256d ab = _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+    acc = _mm256_fmadd_pd(ab, _mm256_loadu_pd(c + i), acc);
+  }
+  double sum = hsum_avx2(acc);
+  for ( ; i < n; ++i)
+    sum += a[i] * b[i] * c[i];
+  return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static double mul_sum_avx2(double *y, const double *x, const size_t n) {
+  __m256d acc = _mm256_setzero_pd();
+  size_t i = 0;
+  for ( ; i + 4 <= n; i += 4) {
+    __m256d v = _mm256_mul_pd(_mm256_loadu_pd(y + i), _mm256_loadu_pd(x + i));
+    _mm256_storeu_pd(y + i, v);
+    acc = _mm256_add_pd(acc, v);
+  }
+  double sum = hsum_avx2(acc);
+  for ( ; i < n; ++i) {
+    y[i] *= x[i];
+    sum += y[i];
+  }
+  return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static void scale_avx2(double *y, const double s, const size_t n) {
+  const __m256d vs = _mm256_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(y + i, _mm256_mul_pd(_mm256_loadu_pd(y + i), vs));
+  for ( ; i < n; ++i)
+    y[i] *= s;
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_mul_avx2(double *y, const double s, const double *a, const double *b, const size_t n) {
+  const __m256d vs = _mm256_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 4 <= n; i += 4) {
+    __m256d ab = _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+    _mm256_storeu_pd(y + i, _mm256_fmadd_pd(vs, ab, _mm256_loadu_pd(y + i)));
+  }
+  for ( ; i < n; ++i)
+    y[i] += s * a[i] * b[i];
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_mul3_avx2(double *y, const double s, const double *a, const double *b, const double *c, const size_t n) {
+  const __m256d vs = _mm256_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 4 <= n; i += 4) {
+    __m256d ab = _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+    __m256d abc = _mm256_mul_pd(ab, _mm256_loadu_pd(c + i));
+    _mm256_storeu_pd(y + i, _mm256_fmadd_pd(vs, abc, _mm256_loadu_pd(y + i)));
+  }
+  for ( ; i < n; ++i)
+    y[i] += s * a[i] * b[i] * c[i];
+}
+
+__attribute__((target("avx2,fma")))
+static void max_plus_avx2(double *y, uint16_t *idx, const double s, const double *a, const uint16_t k, const size_t n) {
+  const __m256d vs = _mm256_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 4 <= n; i += 4) {
+    const __m256d v = _mm256_add_pd(vs, _mm256_loadu_pd(a + i));
+    const __m256d old = _mm256_loadu_pd(y + i);
+    const __m256d gt = _mm256_cmp_pd(v, old, _CMP_GT_OQ);
+    const int mask = _mm256_movemask_pd(gt);
+    if (mask) {
+      _mm256_storeu_pd(y + i, _mm256_blendv_pd(old, v, gt));
+      for (int j = 0; j < 4; ++j)
+        if (mask & (1 << j))
+          idx[i + j] = k;
+    }
+  }
+  for ( ; i < n; ++i)
+    if (s + a[i] > y[i]) {
+      y[i] = s + a[i];
+      idx[i] = k;
+    }
+}
+
+static const Kernels AVX2_KERNELS = {
+  AVX2, "avx2", dot_avx2, dot3_avx2, mul_sum_avx2, scale_avx2,
+  axpy_mul_avx2, axpy_mul3_avx2, max_plus_avx2
+};
+
+/**
+ * AVX-512 implementations. Eight doubles per register, with fused
+ * multiply-add.
+ */
+__attribute__((target("avx512f")))
+static inline double hsum_avx512(__m512d v) {
+  // the masked extract, since the unmasked one (and the cast) trip
+  // -Wuninitialized in GCC on their undefined pass-through operand
+  const __m256d zero = _mm256_setzero_pd();
+  __m256d half = _mm256_add_pd(_mm512_mask_extractf64x4_pd(zero, 0xff, v, 0),
+      _mm512_mask_extractf64x4_pd(zero, 0xff, v, 1));
+  __m128d lo = _mm_add_pd(_mm256_castpd256_pd128(half), _mm256_extractf128_pd(half, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx512f")))
+static double dot_avx512(const double *a, const double *b, const size_t n) {
+  __m512d acc = _mm512_setzero_pd();
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8)
+    acc = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), acc);
+  double sum = hsum_avx512(acc);
+  for ( ; i < n; ++i)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+__attribute__((target("avx512f")))
+static double dot3_avx512(const double *a, const double *b, const double *c, const size_t n) {
+  __m512d acc = _mm512_setzero_pd();
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8) {
+    __m512d ab = _mm512_mul_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+    acc = _mm512_fmadd_pd(ab, _mm512_loadu_pd(c + i), acc);
+  }
+  double sum = hsum_avx512(acc);
+  for ( ; i < n; ++i)
+    sum += a[i] * b[i] * c[i];
+  return sum;
+}
+
+__attribute__((target("avx512f")))
+static double mul_sum_avx512(double *y, const double *x, const size_t n) {
+  __m512d acc = _mm512_setzero_pd();
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8) {
+    __m512d v = _mm512_mul_pd(_mm512_loadu_pd(y + i), _mm512_loadu_pd(x + i));
+    _mm512_storeu_pd(y + i, v);
+    acc = _mm512_add_pd(acc, v);
+  }
+  double sum = hsum_avx512(acc);
+  for ( ; i < n; ++i) {
+    y[i] *= x[i];
+    sum += y[i];
+  }
+  return sum;
+}
+
+__attribute__((target("avx512f")))
+static void scale_avx512(double *y, const double s, const size_t n) {
+  const __m512d vs = _mm512_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8)
+    _mm512_storeu_pd(y + i, _mm512_mul_pd(_mm512_loadu_pd(y + i), vs));
+  for ( ; i < n; ++i)
+    y[i] *= s;
+}
+
+__attribute__((target("avx512f")))
+static void axpy_mul_avx512(double *y, const double s, const double *a, const double *b, const size_t n) {
+  const __m512d vs = _mm512_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8) {
+    __m512d ab = _mm512_mul_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+    _mm512_storeu_pd(y + i, _mm512_fmadd_pd(vs, ab, _mm512_loadu_pd(y + i)));
+  }
+  for ( ; i < n; ++i)
+    y[i] += s * a[i] * b[i];
+}
+
+__attribute__((target("avx512f")))
+static void axpy_mul3_avx512(double *y, const double s, const double *a, const double *b, const double *c, const size_t n) {
+  const __m512d vs = _mm512_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8) {
+    __m512d ab = _mm512_mul_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+    __m512d abc = _mm512_mul_pd(ab, _mm512_loadu_pd(c + i));
+    _mm512_storeu_pd(y + i, _mm512_fmadd_pd(vs, abc, _mm512_loadu_pd(y + i)));
+  }
+  for ( ; i < n; ++i)
+    y[i] += s * a[i] * b[i] * c[i];
+}
+
+__attribute__((target("avx512f")))
+static void max_plus_avx512(double *y, uint16_t *idx, const double s, const double *a, const uint16_t k, const size_t n) {
+  const __m512d vs = _mm512_set1_pd(s);
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8) {
+    const __m512d v = _mm512_add_pd(vs, _mm512_loadu_pd(a + i));
+    const __mmask8 mask = _mm512_cmp_pd_mask(v, _mm512_loadu_pd(y + i), _CMP_GT_OQ);
+    if (mask) {
+      _mm512_mask_storeu_pd(y + i, mask, v);
+      for (int j = 0; j < 8; ++j)
+        if (mask & (1 << j))
+          idx[i + j] = k;
+    }
+  }
+  for ( ; i < n; ++i)
+    if (s + a[i] > y[i]) {
+      y[i] = s + a[i];
+      idx[i] = k;
+    }
+}
+
+static const Kernels AVX512_KERNELS = {
+  AVX512, "avx512", dot_avx512, dot3_avx512, mul_sum_avx512, scale_avx512,
+  axpy_mul_avx512, axpy_mul3_avx512, max_plus_avx512
+};
+
+#endif
+
+/**
+ * detect.
+ * Queries cpuid (through the compiler builtins, which also check that the
+ * operating system saves the extended register state).
+ */
+Level detect(void) {
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return SSE2;
+#endif
+  return SCALAR;
+}
+
+const Kernels &kernels(const Level level) {
+  static const Level supported = detect();
+  if (level > supported)
+    throw Exception("instruction set is not supported by this CPU");
+
+  switch (level) {
+#ifdef SIMD_X86
+    case AVX512: return AVX512_KERNELS;
+    case AVX2: return AVX2_KERNELS;
+    case SSE2: return SSE2_KERNELS;
+#endif
+    default: return SCALAR_KERNELS;
+  }
+}
+
+const Kernels &kernels(const std::string &name) {
+  if (name == "auto")
+    return kernels(detect());
+  else if (name == "avx512")
+    return kernels(AVX512);
+  else if (name == "avx2")
+    return kernels(AVX2);
+  else if (name == "sse2")
+    return kernels(SSE2);
+  else if (name == "scalar")
+    return kernels(SCALAR);
+  throw ValueException("unknown instruction set", name);
+}
+
+} }
@@ -0,0 +1,212 @@
+#include "std.h"
+#include "exception.h"
+#include "socket.h"
+
+#include <cerrno>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace Util {
+
+namespace {
+
+  const std::string UNIX_PREFIX = "unix:";
+
+  bool is_unix(const std::string &address) {
+    return address.compare(0, UNIX_PREFIX.size(), UNIX_PREFIX) == 0;
+  }
+
+  /**
+   * unix_address.
+   * Fills in a Unix domain socket address from a unix:path address.
+   */
+  void unix_address(const std::string &address, sockaddr_un &addr) {
+    const std::string path = address.substr(UNIX_PREFIX.size());
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+      throw IOException("invalid Unix domain socket path", address);
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path.c_str());
+  }
+
+  /**
+   * resolve.
+   * Resolves a host:port address to a list of TCP addresses, which must be
+   * released with freeaddrinfo. An empty host means every local interface
+   * when the address is used by a listener.
+   */
+  addrinfo *resolve(const std::string &address, const bool passive) {
+    const std::string::size_type colon = address.rfind(':');
+    if (colon == std::string::npos || colon == address.size() - 1)
+      throw IOException("address must be host:port or unix:path", address);
+
+    const std::string host = address.substr(0, colon);
+    const std::string port = address.substr(colon + 1);
+
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive)
+      hints.ai_flags = AI_PASSIVE;
+
+    addrinfo *result = 0;
+    if (getaddrinfo(host.empty() ? 0 : host.c_str(), port.c_str(), &hints, &result))
+      throw IOException("could not resolve address", address);
+    return result;
+  }
+
+  /**
+   * no_delay.
+   * Disables Nagle's algorithm on a TCP socket, since the small command
+   * messages are always followed by a wait for a reply. This has no effect
+   * on Unix domain sockets.
+   */
+  void no_delay(const int fd) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+
+  /**
+   * try_connect.
+   * Makes a single attempt to connect to address, returning the file
+   * descriptor of the connected socket or -1.
+   */
+  int try_connect(const std::string &address) {
+    if (is_unix(address)) {
+      sockaddr_un addr;
+      unix_address(address, addr);
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0)
+        throw IOException("could not create socket", address);
+      if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0)
+        return fd;
+      close(fd);
+      return -1;
+    }
+
+    addrinfo *result = resolve(address, false);
+    int fd = -1;
+    for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0)
+        continue;
+      if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        no_delay(fd);
+        break;
+      }
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+  }
+
+}
+
+Socket::~Socket(void) {
+  close(_fd);
+}
+
+void Socket::send(const void *buffer, const size_t size) {
+  const char *p = static_cast<const char *>(buffer);
+  size_t remaining = size;
+  while (remaining) {
+    ssize_t n = ::send(_fd, p, remaining, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      throw IOException("could not write to socket", _address);
+    p += n;
+    remaining -= n;
+  }
+}
+
+void Socket::recv(void *buffer, const size_t size) {
+  char *p = static_cast<char *>(buffer);
+  size_t remaining = size;
+  while (remaining) {
+    ssize_t n = ::recv(_fd, p, remaining, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0)
+      throw IOException("connection closed", _address);
+    if (n < 0)
+      throw IOException("could not read from socket", _address);
+    p += n;
+    remaining -= n;
+  }
+}
+
+Listener::Listener(const std::string &address) : _fd(-1), _address(address), _path() {
+  if (is_unix(address)) {
+    sockaddr_un addr;
+    unix_address(address, addr);
+    _fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_fd < 0)
+      throw IOException("could not create socket", address);
+    unlink(addr.sun_path);
+    if (bind(_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+      close(_fd);
+      throw IOException("could not bind to address", address);
+    }
+    _path = addr.sun_path;
+  }
+  else {
+    addrinfo *result = resolve(address, true);
+    for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+      _fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (_fd < 0)
+        continue;
+      int on = 1;
+      setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      if (bind(_fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        break;
+      close(_fd);
+      _fd = -1;
+    }
+    freeaddrinfo(result);
+    if (_fd < 0)
+      throw IOException("could not bind to address", address);
+  }
+
+  if (listen(_fd, SOMAXCONN)) {
+    close(_fd);
+    throw IOException("could not listen on address", address);
+  }
+}
+
+Listener::~Listener(void) {
+  close(_fd);
+  if (!_path.empty())
+    unlink(_path.c_str());
+}
+
+Socket *Listener::accept(void) {
+  int fd;
+  do {
+    fd = ::accept(_fd, 0, 0);
+  } while (fd < 0 && errno == EINTR);
+  if (fd < 0)
+    throw IOException("could not accept connection", _address);
+  if (_path.empty())
+    no_delay(fd);
+  return new Socket(fd, _address);
+}
+
+Socket *connect(const std::string &address, const unsigned int timeout) {
+  for (unsigned int i = 0; ; ++i) {
+    int fd = try_connect(address);
+    if (fd >= 0)
+      return new Socket(fd, address);
+    if (i >= timeout)
+      throw IOException("could not connect to address", address);
+    sleep(1);
+  }
+}
+
+}
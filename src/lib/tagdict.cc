@@ -0,0 +1,119 @@
+#include "base.h"
+
+#include "hashtable.h"
+#include "tagset.h"
+#include "tagdict.h"
+
+namespace NLP {
+  /**
+   * TagRange.
+   * The total frequency of a word in the tag dictionary, and the range of
+   * its tag ids in the klasses vector (empty if the word is not restricted).
+   */
+  struct TagRange {
+    uint64_t freq;
+    uint32_t begin;
+    uint32_t end;
+
+    TagRange(void) : freq(0), begin(0), end(0) { }
+  };
+
+  typedef HT::StringEntry<TagRange> Entry;
+  typedef HT::BaseHashTable<Entry, std::string> ImplBase;
+  class TagDict::Impl : public ImplBase, public Util::Shared {
+    public:
+      typedef std::pair<Entry *, uint16_t> WordTag;
+
+      std::string preface;
+      std::string filename;
+      std::vector<uint16_t> klasses;
+      size_t nrestricted;
+
+      Impl(const std::string &filename, const size_t nbuckets,
+          const size_t pool_size) : ImplBase(nbuckets, pool_size), Shared(),
+          preface(), filename(filename), klasses(), nrestricted(0) { }
+
+      void load(const TagSet &tags, const uint64_t cutoff) {
+        std::ifstream input(filename.c_str());
+        if (!input)
+          throw IOException("Unable to open tag dictionary file", filename);
+        load(filename, input, tags, cutoff);
+      }
+
+      /**
+       * load.
+       * Reads the word, tag and frequency lines saved by _pass1, and
+       * restricts each word seen at least cutoff times to its tags. A word
+       * with a tag that is missing from the tag set is left unrestricted.
+       */
+      void load(const std::string &filename, std::istream &input,
+          const TagSet &tags, const uint64_t cutoff) {
+        uint64_t nlines = 0;
+
+        read_preface(filename, input, preface, nlines);
+
+        std::vector<WordTag> pairs;
+        std::string word, tag;
+        uint64_t freq;
+        while (input >> word >> tag >> freq) {
+          ++nlines;
+          if (input.get() != '\n')
+            throw IOException("expected newline after frequency in tag dictionary file", filename, nlines);
+          Entry *e = add(word);
+          e->value.freq += freq;
+          pairs.push_back(WordTag(e, tags.canonize(tag).id()));
+        }
+
+        if (!input.eof())
+          throw IOException("could not parse word, tag or frequency information for tag dictionary", filename, nlines);
+
+        // group the tags of each word, in ascending order of tag id
+        std::sort(pairs.begin(), pairs.end());
+        std::vector<WordTag>::iterator i = pairs.begin();
+        while (i != pairs.end()) {
+          Entry *e = i->first;
+          std::vector<WordTag>::iterator j = i;
+          bool known = true;
+          for ( ; j != pairs.end() && j->first == e; ++j)
+            known = known && j->second > Sentinel::val;
+
+          if (known && e->value.freq >= cutoff) {
+            e->value.begin = klasses.size();
+            for ( ; i != j; ++i)
+              klasses.push_back(i->second);
+            e->value.end = klasses.size();
+            ++nrestricted;
+          }
+          i = j;
+        }
+      }
+
+      Candidates get(const std::string &word) const {
+        Entry *e = find(word);
+        if (!e || e->value.begin == e->value.end)
+          return Candidates();
+        const uint16_t *base = &klasses[0];
+        return Candidates(base + e->value.begin, base + e->value.end);
+      }
+
+      size_t size(void) const { return ImplBase::_size; }
+  };
+
+  TagDict::TagDict(const std::string &filename, const size_t nbuckets,
+      const size_t pool_size) : _impl(new Impl(filename, nbuckets, pool_size)) { }
+
+  TagDict::TagDict(const TagDict &other) : _impl(share(other._impl)) { }
+
+  TagDict::~TagDict(void) { release(_impl); }
+
+  void TagDict::load(const TagSet &tags, const uint64_t cutoff) { _impl->load(tags, cutoff); }
+  void TagDict::load(const std::string &filename, std::istream &input,
+      const TagSet &tags, const uint64_t cutoff) {
+    _impl->load(filename, input, tags, cutoff);
+  }
+
+  TagDict::Candidates TagDict::get(const std::string &word) const { return _impl->get(word); }
+
+  size_t TagDict::size(void) const { return _impl->size(); }
+  size_t TagDict::nrestricted(void) const { return _impl->nrestricted; }
+}
@@ -0,0 +1,161 @@
+#include "base.h"
+
+#include "config.h"
+#include "main.h"
+
+/**
+ * test_simd.
+ * Checks every set of vectorized kernels supported by the running CPU
+ * against the scalar kernels, on fixed pseudo-random input of every length
+ * up to MAX_SIZE (so the unrolled loops and their remainders are all
+ * exercised). Also runs a scaled forward pass over a random lattice with
+ * each set, as the tagger does in training, and compares the log partition
+ * functions. Exits with an error on the first mismatch.
+ */
+namespace simd = Util::simd;
+
+typedef std::vector<double> Doubles;
+
+const static size_t MAX_SIZE = 67;
+const static size_t NTAGS = 47;
+const static size_t NWORDS = 40;
+const static double TOLERANCE = 1e-12;
+
+static double uniform(const double lower, const double upper) {
+  return lower + (upper - lower) * (rand() / (RAND_MAX + 1.0));
+}
+
+static void fill(Doubles &v, const double lower, const double upper) {
+  for (size_t i = 0; i < v.size(); ++i)
+    v[i] = uniform(lower, upper);
+}
+
+static void check(const simd::Kernels &k, const char *kernel, const size_t n,
+    const double expected, const double actual) {
+  if (std::fabs(expected - actual) > TOLERANCE * std::max(1.0, std::fabs(expected))) {
+    std::ostringstream msg;
+    msg << k.name << ' ' << kernel << " (n = " << n << ") gave " << std::setprecision(17)
+        << actual << " but the scalar kernel gave " << expected;
+    throw Exception(msg.str());
+  }
+}
+
+static void check(const simd::Kernels &k, const char *kernel, const size_t n,
+    const Doubles &expected, const Doubles &actual) {
+  for (size_t i = 0; i < expected.size(); ++i)
+    check(k, kernel, n, expected[i], actual[i]);
+}
+
+/**
+ * check_kernels.
+ * Compares each kernel of k against the scalar kernel s for every length
+ * from 1 to MAX_SIZE. max_plus does no summation, so it must match exactly.
+ */
+static void check_kernels(const simd::Kernels &s, const simd::Kernels &k) {
+  for (size_t n = 1; n <= MAX_SIZE; ++n) {
+    Doubles a(n), b(n), c(n), y(n), expected(n), actual(n);
+    fill(a, -2.0, 2.0);
+    fill(b, -2.0, 2.0);
+    fill(c, 0.0, 1.0);
+    fill(y, -1.0, 1.0);
+    const double x = uniform(-2.0, 2.0);
+
+    check(k, "dot", n, s.dot(&a[0], &b[0], n), k.dot(&a[0], &b[0], n));
+    check(k, "dot3", n, s.dot3(&a[0], &b[0], &c[0], n), k.dot3(&a[0], &b[0], &c[0], n));
+
+    expected = y;
+    actual = y;
+    check(k, "mul_sum", n, s.mul_sum(&expected[0], &a[0], n), k.mul_sum(&actual[0], &a[0], n));
+    check(k, "mul_sum", n, expected, actual);
+
+    expected = y;
+    actual = y;
+    s.scale(&expected[0], x, n);
+    k.scale(&actual[0], x, n);
+    check(k, "scale", n, expected, actual);
+
+    expected = y;
+    actual = y;
+    s.axpy_mul(&expected[0], x, &a[0], &b[0], n);
+    k.axpy_mul(&actual[0], x, &a[0], &b[0], n);
+    check(k, "axpy_mul", n, expected, actual);
+
+    expected = y;
+    actual = y;
+    s.axpy_mul3(&expected[0], x, &a[0], &b[0], &c[0], n);
+    k.axpy_mul3(&actual[0], x, &a[0], &b[0], &c[0], n);
+    check(k, "axpy_mul3", n, expected, actual);
+
+    expected = y;
+    actual = y;
+    std::vector<uint16_t> expected_idx(n, 0), actual_idx(n, 0);
+    for (uint16_t p = 1; p < 5; ++p) {
+      // a repeated score checks that ties keep the earlier index
+      const double score = p == 4 ? x : uniform(-2.0, 2.0);
+      s.max_plus(&expected[0], &expected_idx[0], score, &a[0], p, n);
+      k.max_plus(&actual[0], &actual_idx[0], score, &a[0], p, n);
+    }
+    for (size_t i = 0; i < n; ++i)
+      if (expected[i] != actual[i] || expected_idx[i] != actual_idx[i]) {
+        std::ostringstream msg;
+        msg << k.name << " max_plus (n = " << n << ") differs from the scalar kernel at " << i;
+        throw Exception(msg.str());
+      }
+  }
+}
+
+/**
+ * forward.
+ * The scaled forward algorithm over a lattice of NWORDS positions, as in
+ * Tagger::Impl::forward. states holds the exponentiated state activations
+ * and trans_t the transposed transition activations, and tags 0 and 1 are
+ * the None and Sentinel tags. Returns the log partition function.
+ */
+static double forward(const simd::Kernels &k, const std::vector<Doubles> &states,
+    const std::vector<Doubles> &trans_t) {
+  const size_t n = NTAGS - 2;
+  std::vector<Doubles> alphas(NWORDS, Doubles(NTAGS, 0.0));
+  double log_z = 0.0;
+
+  double sum = 0.0;
+  for (size_t tag = 2; tag < NTAGS; ++tag)
+    sum += alphas[0][tag] = states[0][tag];
+  k.scale(&alphas[0][0], 1.0 / sum, NTAGS);
+  log_z += std::log(sum);
+
+  for (size_t i = 1; i < NWORDS; ++i) {
+    double *curr = &alphas[i][0];
+    for (size_t tag = 2; tag < NTAGS; ++tag)
+      curr[tag] = k.dot(&trans_t[tag][2], &alphas[i-1][2], n);
+    sum = k.mul_sum(curr + 2, &states[i][2], n);
+    k.scale(curr, 1.0 / sum, NTAGS);
+    log_z += std::log(sum);
+  }
+
+  return log_z;
+}
+
+int run(int argc, char *argv[]) {
+  srand(1);
+  const simd::Kernels &scalar = simd::kernels(simd::SCALAR);
+  const simd::Level widest = simd::detect();
+
+  std::vector<Doubles> states(NWORDS, Doubles(NTAGS, 0.0));
+  std::vector<Doubles> trans_t(NTAGS, Doubles(NTAGS, 0.0));
+  for (size_t i = 0; i < NWORDS; ++i)
+    for (size_t tag = 2; tag < NTAGS; ++tag)
+      states[i][tag] = std::exp(uniform(-3.0, 3.0));
+  for (size_t curr = 2; curr < NTAGS; ++curr)
+    for (size_t prev = 2; prev < NTAGS; ++prev)
+      trans_t[curr][prev] = std::exp(uniform(-3.0, 3.0));
+  const double log_z = forward(scalar, states, trans_t);
+
+  for (int level = simd::SSE2; level <= widest; ++level) {
+    const simd::Kernels &k = simd::kernels(static_cast<simd::Level>(level));
+    check_kernels(scalar, k);
+    check(k, "forward log Z", NWORDS, log_z, forward(k, states, trans_t));
+    std::cout << k.name << " kernels match the scalar kernels" << std::endl;
+  }
+
+  return 0;
+}